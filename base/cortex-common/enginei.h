@@ -31,7 +31,7 @@ class EngineI {
   virtual bool IsSupported(const std::string& f) {
     if (f == "HandleChatCompletion" || f == "HandleEmbedding" ||
         f == "LoadModel" || f == "UnloadModel" || f == "GetModelStatus" ||
-        f == "GetModels") {
+        f == "GetModels" || f == "GetMetrics" || f == "CancelRequest") {
       return true;
     }
     return false;
@@ -41,4 +41,15 @@ class EngineI {
   virtual void GetModels(
       std::shared_ptr<Json::Value> json_body,
       std::function<void(Json::Value&&, Json::Value&&)>&& callback) = 0;
+
+  // Metrics in Prometheus text format, as `data` of the response.
+  virtual void GetMetrics(
+      std::shared_ptr<Json::Value> json_body,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) = 0;
+
+  // Stops the chat completion sent with the same `request_id`, e.g. when its
+  // client disconnected.
+  virtual void CancelRequest(
+      std::shared_ptr<Json::Value> json_body,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) = 0;
 };
\ No newline at end of file
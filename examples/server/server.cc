@@ -2,8 +2,11 @@
 #include "dylib.h"
 #include "httplib.h"
 #include "json/reader.h"
+#include "json/writer.h"
 
 #include <signal.h>
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
@@ -38,6 +41,13 @@ class Server {
       cond.notify_one();
     }
 
+    // Waits for the next item without taking it
+    std::pair<Json::Value, Json::Value> wait_and_front() {
+      std::unique_lock<std::mutex> l(mtx);
+      cond.wait(l, [this] { return !q.empty(); });
+      return q.front();
+    }
+
     std::pair<Json::Value, Json::Value> wait_and_pop() {
       std::unique_lock<std::mutex> l(mtx);
       cond.wait(l, [this] { return !q.empty(); });
@@ -69,6 +79,9 @@ inline void signal_handler(int signal) {
 
 using SyncQueue = Server::SyncQueue;
 
+// HTTP worker threads unless given as the third argument
+constexpr size_t kDefaultThreads = 64;
+
 int main(int argc, char** argv) {
   std::string hostname = "127.0.0.1";
   int port = 3928;
@@ -83,6 +96,7 @@ int main(int argc, char** argv) {
 
   Server server;
   Json::Reader r;
+  std::atomic<uint64_t> next_request_id = 0;
   auto svr = std::make_unique<httplib::Server>();
 
   if (!svr->bind_to_port(hostname, port)) {
@@ -100,17 +114,35 @@ int main(int argc, char** argv) {
   };
 
   auto process_stream_res = [&server](httplib::Response& resp,
-                                      std::shared_ptr<SyncQueue> q) {
+                                      std::shared_ptr<SyncQueue> q,
+                                      const std::string& request_id) {
     const auto chunked_content_provider =
-        [&server, q](size_t size, httplib::DataSink& sink) {
+        [&server, q, request_id](size_t size, httplib::DataSink& sink) {
           while (true) {
             auto [status, res] = q->wait_and_pop();
             auto str = res["data"].asString();
+            if (status["has_error"].asBool()) {
+              // The status line is sent, the error goes in the stream
+              Json::Value error;
+              error["error"]["message"] = res["message"];
+              error["error"]["code"] = status["status_code"];
+              Json::StreamWriterBuilder writer;
+              writer["indentation"] = "";
+              str = "data: " + Json::writeString(writer, error) +
+                    "\n\ndata: [DONE]\n\n";
+            }
             LOG_TRACE << "data: " << str;
 
             if (!sink.write(str.c_str(), str.size())) {
-              LOG_WARN << "Failed to write";
-              //   return false;
+              LOG_WARN << "Failed to write, cancelling " << request_id;
+              // The client is gone, stop generating for it
+              if (server.engine_->IsSupported("CancelRequest")) {
+                auto body = std::make_shared<Json::Value>();
+                (*body)["request_id"] = request_id;
+                server.engine_->CancelRequest(
+                    body, [](Json::Value status, Json::Value res) {});
+              }
+              return false;
             }
             if (status["has_error"].asBool() || status["is_done"].asBool()) {
               LOG_INFO << "Done";
@@ -161,14 +193,42 @@ int main(int argc, char** argv) {
     auto req_body = std::make_shared<Json::Value>();
     r.parse(req.body, *req_body);
     bool is_stream = (*req_body).get("stream", false).asBool();
+    // Lets the request be cancelled if the client disconnects
+    if (!req_body->isMember("request_id")) {
+      (*req_body)["request_id"] =
+          "req-" + std::to_string(next_request_id.fetch_add(1));
+    }
+    auto request_id = (*req_body)["request_id"].asString();
+    (*req_body)["report_queue"] = true;
     // This is an async call, need to use queue
     auto q = std::make_shared<SyncQueue>();
     server.engine_->HandleChatCompletion(
         req_body, [&server, q](Json::Value status, Json::Value res) {
           q->push(std::make_pair(status, res));
         });
+    // Queued requests first get their queue position. Requests answered or
+    // rejected right away get their response instead.
+    auto [queued_status, queued] = q->wait_and_front();
+    if (queued_status.get("is_queued", false).asBool()) {
+      q->wait_and_pop();
+      resp.set_header("X-Queue-Position", queued["queue_position"].asString());
+      if (queued.isMember("estimated_wait_ms")) {
+        resp.set_header("X-Queue-Estimated-Wait-Ms",
+                        queued["estimated_wait_ms"].asString());
+      }
+    }
+    // Nothing is committed until the request starts decoding, so a request
+    // that fails in the queue still gets its own status code
+    auto [status, res] = q->wait_and_front();
+    if (status["has_error"].asBool()) {
+      if (status.isMember("retry_after_s")) {
+        resp.set_header("Retry-After", status["retry_after_s"].asString());
+      }
+      process_non_stream_res(resp, *q);
+      return;
+    }
     if (is_stream) {
-      process_stream_res(resp, q);
+      process_stream_res(resp, q, request_id);
     } else {
       process_non_stream_res(resp, *q);
     }
@@ -217,6 +277,23 @@ int main(int argc, char** argv) {
         });
   };
 
+  const auto handle_get_metrics = [&](const httplib::Request& req,
+                                      httplib::Response& resp) {
+    resp.set_header("Access-Control-Allow-Origin",
+                    req.get_header_value("Origin"));
+    if (!server.engine_->IsSupported("GetMetrics")) {
+      resp.status = 404;
+      return;
+    }
+    auto req_body = std::make_shared<Json::Value>();
+    server.engine_->GetMetrics(
+        req_body, [&server, &resp](Json::Value status, Json::Value res) {
+          resp.set_content(res["data"].asString(),
+                           "text/plain; version=0.0.4; charset=utf-8");
+          resp.status = status["status_code"].asInt();
+        });
+  };
+
   svr->Post("/loadmodel", handle_load_model);
   // Use POST since httplib does not read request body for GET method
   svr->Post("/unloadmodel", handle_unload_model);
@@ -224,6 +301,7 @@ int main(int argc, char** argv) {
   svr->Post("/v1/embeddings", handle_embeddings);
   svr->Post("/modelstatus", handle_get_model_status);
   svr->Get("/models", handle_get_running_models);
+  svr->Get("/metrics", handle_get_metrics);
   std::atomic<bool> running = true;
   svr->Delete("/destroy",
             [&](const httplib::Request& req, httplib::Response& resp) {
@@ -232,8 +310,15 @@ int main(int argc, char** argv) {
             });
 
   LOG_INFO << "HTTP server listening: " << hostname << ":" << port;
-  svr->new_task_queue = [] {
-    return new httplib::ThreadPool(5);
+  // Every chat completion holds a thread while it waits in the engine's
+  // queue and while it decodes, so size this for n_parallel plus
+  // max_queue_depth of the loaded models, and a few for the other endpoints
+  size_t n_threads = kDefaultThreads;
+  if (argc > 3) {
+    n_threads = std::max(1, std::atoi(argv[3]));
+  }
+  svr->new_task_queue = [n_threads] {
+    return new httplib::ThreadPool(n_threads);
   };
   // run the HTTP server in a thread - see comment below
   std::thread t([&]() {
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""Generates src/unicode_fold.cc from the Unicode database of this Python.
+
+The fold tables map every code point to what the BERT BasicTokenizer makes of
+it for uncased models: `str.lower()`, then NFD, then combining marks
+(category Mn) dropped. Hangul syllables decompose algorithmically and are not
+listed. The class tables follow the tokenizer's `_is_whitespace` (Zs),
+`_is_control` (Cc and Cf) and `_is_punctuation` (P*, plus all non-alphanumeric
+ASCII).
+
+    python3 scripts/gen_unicode_fold.py > src/unicode_fold.cc
+"""
+import unicodedata
+
+
+def fold(c):
+    t = unicodedata.normalize("NFD", c.lower())
+    return "".join(x for x in t if unicodedata.category(x) != "Mn")
+
+
+def pack(entries, indent="    "):
+    """Lines of comma-separated `entries` that fit in 80 columns."""
+    lines = []
+    line = indent
+    for entry in entries:
+        if len(line) + len(entry) + 2 > 80 and line != indent:
+            lines.append(line.rstrip())
+            line = indent
+        line += entry + ", "
+    if line != indent:
+        lines.append(line.rstrip())
+    return lines
+
+
+def add(ranges, cp):
+    if ranges and ranges[-1][1] == cp - 1:
+        ranges[-1][1] = cp
+    else:
+        ranges.append([cp, cp])
+
+
+def is_punctuation(cp):
+    if 33 <= cp <= 47 or 58 <= cp <= 64 or 91 <= cp <= 96 or 123 <= cp <= 126:
+        return True
+    return unicodedata.category(chr(cp)).startswith("P")
+
+
+def ranges_table(comment, name, ranges):
+    out = ["// " + comment, "constexpr CodePointRange %s[] = {" % name]
+    out += pack("{0x%04X, 0x%04X}" % (first, last) for first, last in ranges)
+    out += ["};", ""]
+    return out
+
+
+def main():
+    marks = []
+    spaces = []
+    controls = []
+    punctuation = []
+    singles = []
+    expansions = []
+    for cp in range(0x110000):
+        category = unicodedata.category(chr(cp))
+        if category == "Zs" or chr(cp) in " \t\n\r":
+            add(spaces, cp)
+        elif category in ("Cc", "Cf"):
+            add(controls, cp)
+        if is_punctuation(cp):
+            add(punctuation, cp)
+        if 0xD800 <= cp <= 0xDFFF or 0xAC00 <= cp <= 0xD7A3:
+            continue
+        c = chr(cp)
+        if category == "Mn":
+            add(marks, cp)
+            continue
+        f = fold(c)
+        if f == c:
+            continue
+        if len(f) == 1:
+            singles.append((cp, ord(f)))
+        else:
+            expansions.append((cp, f))
+
+    out = [HEAD % unicodedata.unidata_version]
+    out += ranges_table("Space separators (Zs), tab and line breaks",
+                        "kSpaces", spaces)
+    out += ranges_table("Control (Cc) and format (Cf) characters but tab "
+                        "and line breaks", "kControls", controls)
+    out += ranges_table("Punctuation (P*) and non-alphanumeric ASCII",
+                        "kPunctuation", punctuation)
+    out += ranges_table("Nonspacing marks (Mn), dropped", "kMarks", marks)
+    out.append("// Code points that fold to a single other one")
+    out.append("constexpr Fold kFolds[] = {")
+    out += pack("{0x%04X, 0x%04X}" % (cp, to) for cp, to in singles)
+    out.append("};")
+    out.append("")
+    out.append("// Code points that fold to more than one")
+    out.append("constexpr Expansion kExpansions[] = {")
+    for cp, f in expansions:
+        utf8 = "".join("\\x%02X" % b for b in f.encode("utf-8"))
+        out.append('    {0x%04X, "%s"},' % (cp, utf8))
+    out.append("};")
+    out.append(TAIL)
+    print("\n".join(out))
+
+
+HEAD = """// Generated by scripts/gen_unicode_fold.py from Unicode %s, do not edit.
+#include "unicode_fold.h"
+#include <algorithm>
+#include <iterator>
+
+namespace cortex_onnx {
+namespace {
+struct CodePointRange {
+  uint32_t first;
+  uint32_t last;
+};
+
+struct Fold {
+  uint32_t code_point;
+  uint32_t folded;
+};
+
+struct Expansion {
+  uint32_t code_point;
+  const char* utf8;
+};
+"""
+
+
+TAIL = """
+void AppendUtf8(uint32_t cp, std::string& out) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
+
+template <size_t N>
+bool InRanges(const CodePointRange (&table)[N], uint32_t cp) {
+  auto it = std::upper_bound(
+      std::begin(table), std::end(table), cp,
+      [](uint32_t value, const CodePointRange& r) { return value < r.first; });
+  return it != std::begin(table) && cp <= std::prev(it)->last;
+}
+
+// Entry of `code_point` in a table sorted by code point, null if none
+template <typename T, size_t N>
+const T* Find(const T (&table)[N], uint32_t cp) {
+  auto it = std::lower_bound(std::begin(table), std::end(table), cp,
+                             [](const T& entry, uint32_t value) {
+                               return entry.code_point < value;
+                             });
+  return it != std::end(table) && it->code_point == cp ? &*it : nullptr;
+}
+}  // namespace
+
+void AppendFolded(uint32_t cp, std::string& out) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp >= 'A' && cp <= 'Z' ? cp - 'A' + 'a' : cp);
+    return;
+  }
+  // Hangul syllables decompose into their conjoining jamo
+  if (cp >= 0xAC00 && cp <= 0xD7A3) {
+    auto index = cp - 0xAC00;
+    AppendUtf8(0x1100 + index / 588, out);
+    AppendUtf8(0x1161 + index % 588 / 28, out);
+    if (index % 28 != 0) {
+      AppendUtf8(0x11A7 + index % 28, out);
+    }
+    return;
+  }
+  if (InRanges(kMarks, cp)) {
+    return;
+  }
+  if (const auto* fold = Find(kFolds, cp)) {
+    AppendUtf8(fold->folded, out);
+    return;
+  }
+  if (const auto* expansion = Find(kExpansions, cp)) {
+    out += expansion->utf8;
+    return;
+  }
+  AppendUtf8(cp, out);
+}
+
+bool IsWhitespace(uint32_t cp) {
+  return InRanges(kSpaces, cp);
+}
+
+bool IsControl(uint32_t cp) {
+  return InRanges(kControls, cp);
+}
+
+bool IsPunctuation(uint32_t cp) {
+  return InRanges(kPunctuation, cp);
+}
+}  // namespace cortex_onnx"""
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,267 @@
+#include "batch_scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "trantor/utils/Logger.h"
+
+namespace cortex_onnx {
+namespace {
+// Weight of the latest iteration in the rate averages
+constexpr double kRateWeight = 0.1;
+
+void UpdateAverage(std::atomic<double>& average, double rate) {
+  double current = average;
+  average = current == 0 ? rate : current + kRateWeight * (rate - current);
+}
+
+uint64_t TokensLeft(const InferenceState& state) {
+  auto left = state.req.max_tokens - state.generated_tokens;
+  return left > 0 ? static_cast<uint64_t>(left) : 0;
+}
+}  // namespace
+
+BatchScheduler::BatchScheduler(size_t max_active, StepFn step,
+                               ExpireFn expire, const std::string& name)
+    : step_(std::move(step)),
+      expire_(std::move(expire)),
+      name_(name),
+      max_active_(std::max<size_t>(1, max_active)) {
+  worker_ = std::thread([this] { Loop(); });
+}
+
+BatchScheduler::~BatchScheduler() {
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  // Flush what is left so that every request gets its final callback. The
+  // owner makes steps fail fast before destroying the scheduler.
+  for (auto& task : tasks_) {
+    task();
+  }
+  for (auto& state : pending_) {
+    active_.push_back(std::move(state));
+  }
+  for (auto& state : active_) {
+    while (step_(*state)) {
+    }
+  }
+}
+
+void BatchScheduler::Enqueue(std::shared_ptr<InferenceState> state) {
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    pending_tokens_ += state->queued_tokens;
+    // After the requests it does not run before, FIFO among equals
+    auto it = std::find_if(pending_.begin(), pending_.end(),
+                           [&state](const auto& queued) {
+                             return RunsBefore(*state, *queued);
+                           });
+    pending_.insert(it, std::move(state));
+  }
+  cv_.notify_one();
+}
+
+BatchScheduler::Admission BatchScheduler::Admit(const InferenceState& state,
+                                                size_t max_pending,
+                                                uint64_t max_pending_tokens) {
+  std::lock_guard<std::mutex> l(mtx_);
+  Admission admission;
+  admission.admitted =
+      (max_pending == 0 || pending_.size() < max_pending) &&
+      (max_pending_tokens == 0 ||
+       pending_tokens_ + state.queued_tokens <= max_pending_tokens);
+  admission.position = 0;
+  uint64_t decode_ahead = active_decode_tokens_;
+  uint64_t prefill_ahead = active_prefill_tokens_;
+  for (const auto& queued : pending_) {
+    if (RunsBefore(state, *queued)) {
+      break;
+    }
+    admission.position++;
+    decode_ahead += TokensLeft(*queued);
+    prefill_ahead += queued->prompt_tokens;
+  }
+  double rate = tokens_per_second_;
+  double prefill_rate = prefill_tokens_per_second_;
+  if (admission.position == 0 && active_count_ < max_active_) {
+    // Takes a free slot at the next iteration
+    admission.estimated_wait_s = 0;
+  } else if (rate > 0) {
+    admission.estimated_wait_s =
+        decode_ahead / rate +
+        (prefill_rate > 0 ? prefill_ahead / prefill_rate : 0);
+  } else {
+    admission.estimated_wait_s = -1;
+  }
+  return admission;
+}
+
+bool BatchScheduler::RunsBefore(const InferenceState& a,
+                                const InferenceState& b) {
+  if (a.req.priority != b.req.priority) {
+    return a.req.priority > b.req.priority;
+  }
+  return a.deadline < b.deadline;
+}
+
+void BatchScheduler::RunTask(std::function<void()>&& task) {
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void BatchScheduler::SetMaxActive(size_t max_active) {
+  max_active_ = std::max<size_t>(1, max_active);
+  cv_.notify_one();
+}
+
+size_t BatchScheduler::PendingCount() {
+  std::lock_guard<std::mutex> l(mtx_);
+  return pending_.size() + tasks_.size();
+}
+
+uint64_t BatchScheduler::PendingTokens() {
+  std::lock_guard<std::mutex> l(mtx_);
+  return pending_tokens_;
+}
+
+void BatchScheduler::ExpirePending() {
+  std::vector<std::shared_ptr<InferenceState>> expired;
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& state : pending_) {
+      if (state->deadline < now) {
+        expired.push_back(state);
+      }
+    }
+  }
+  if (expired.empty()) {
+    return;
+  }
+  // Replies go out without the lock and without taking a decode slot
+  expired.erase(std::remove_if(expired.begin(), expired.end(),
+                               [this](const auto& state) {
+                                 return !expire_(*state);
+                               }),
+                expired.end());
+  std::lock_guard<std::mutex> l(mtx_);
+  for (const auto& state : expired) {
+    pending_tokens_ -= state->queued_tokens;
+    pending_.erase(std::find(pending_.begin(), pending_.end(), state));
+  }
+}
+
+void BatchScheduler::Loop() {
+  LOG_INFO << "Scheduler started: " << name_;
+  while (true) {
+    std::deque<std::function<void()>> tasks;
+    {
+      std::unique_lock<std::mutex> l(mtx_);
+      cv_.wait(l, [this] {
+        return stop_ || !tasks_.empty() || !active_.empty() ||
+               (!pending_.empty() && active_.size() < max_active_);
+      });
+      if (stop_) {
+        break;
+      }
+    }
+    // Right after the previous iteration's steps, so that a deadline that
+    // passed during them is answered before anything else runs
+    ExpirePending();
+    {
+      std::lock_guard<std::mutex> l(mtx_);
+      // Admit new sequences between decode steps
+      while (!pending_.empty() && active_.size() < max_active_) {
+        pending_tokens_ -= pending_.front()->queued_tokens;
+        active_.push_back(std::move(pending_.front()));
+        pending_.pop_front();
+      }
+      tasks.swap(tasks_);
+    }
+    active_count_ = active_.size();
+
+    for (auto& task : tasks) {
+      task();
+    }
+
+    // Prefills only wait for their budget when they would stall others
+    uint64_t budget = prefill_budget_;
+    bool decoding = std::any_of(
+        active_.begin(), active_.end(),
+        [](const auto& state) { return state->generator != nullptr; });
+    prefill_credit_ += budget;
+    bool deferred = false;
+
+    // Every step decodes one token of its sequence, or prefills it
+    size_t steps = 0;
+    uint64_t prefilled = 0;
+    double decode_s = 0;
+    double prefill_s = 0;
+    for (auto it = active_.begin(); it != active_.end();) {
+      auto& state = **it;
+      // A cancelled request is stepped right away to reply
+      bool cancelled = state.cancelled != nullptr && *state.cancelled;
+      if (state.generator == nullptr && budget > 0 && decoding &&
+          !cancelled) {
+        if (deferred || state.prompt_tokens > prefill_credit_) {
+          // Older prefills go first
+          deferred = true;
+          ++it;
+          continue;
+        }
+        prefill_credit_ -= state.prompt_tokens;
+      }
+      bool prefill = state.generator == nullptr;
+      auto start = std::chrono::steady_clock::now();
+      bool more = step_(state);
+      double elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      if (!prefill) {
+        steps++;
+        decode_s += elapsed;
+      } else if (state.generator != nullptr) {
+        // Cancelled and expired requests leave without a prefill
+        prefilled += state.prompt_tokens;
+        prefill_s += elapsed;
+      }
+      if (more) {
+        ++it;
+      } else {
+        it = active_.erase(it);
+      }
+    }
+    active_count_ = active_.size();
+    uint64_t decode_tokens = 0;
+    uint64_t prefill_tokens = 0;
+    for (const auto& state : active_) {
+      decode_tokens += TokensLeft(*state);
+      if (state->generator == nullptr) {
+        prefill_tokens += state->prompt_tokens;
+      }
+    }
+    active_decode_tokens_ = decode_tokens;
+    active_prefill_tokens_ = prefill_tokens;
+    // Credit only builds up for a prefill that is waiting
+    if (!deferred) {
+      prefill_credit_ = std::min(prefill_credit_, budget);
+    }
+    if (steps > 0 && decode_s > 0) {
+      UpdateAverage(tokens_per_second_, steps / decode_s);
+    }
+    if (prefilled > 0 && prefill_s > 0) {
+      UpdateAverage(prefill_tokens_per_second_, prefilled / prefill_s);
+    }
+  }
+  LOG_INFO << "Scheduler stopped: " << name_;
+}
+
+}  // namespace cortex_onnx
@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "inference_state.h"
+
+namespace cortex_onnx {
+// Iteration-level scheduler. Keeps up to `max_active` sequences in flight and
+// advances each of them by one decode step per iteration, so new requests join
+// between steps and finished ones leave without waiting for the others.
+// Waiting requests are admitted by priority, then earliest deadline, then
+// arrival. All model work (steps and one-shot tasks) runs on a single worker
+// thread.
+class BatchScheduler {
+ public:
+  // Advances `state` by one step. Returns false once the sequence is finished
+  // and should leave the batch.
+  using StepFn = std::function<bool(InferenceState&)>;
+  // Replies to a waiting request whose deadline passed. Returns false to
+  // keep it waiting, when other requests still need what it generates.
+  using ExpireFn = std::function<bool(InferenceState&)>;
+  struct Admission {
+    bool admitted;
+    // Requests that would be admitted before this one
+    size_t position;
+    // Time until a decode slot frees up for this request: the tokens left to
+    // decode by the requests running and queued ahead at the decode rate of
+    // all sequences together, plus the prompts ahead at the prefill rate.
+    // Negative while the decode rate is not known yet.
+    double estimated_wait_s;
+  };
+
+  BatchScheduler(size_t max_active, StepFn step, ExpireFn expire,
+                 const std::string& name);
+  ~BatchScheduler();
+
+  void Enqueue(std::shared_ptr<InferenceState> state);
+  // Whether `state` may be queued without putting more than `max_pending`
+  // requests or `max_pending_tokens` tokens (see InferenceState) in the queue,
+  // 0 meaning no limit. The caller serializes admission and Enqueue, the queue
+  // can only shrink in between.
+  Admission Admit(const InferenceState& state, size_t max_pending,
+                  uint64_t max_pending_tokens);
+  // Runs `task` on the worker thread between two iterations.
+  void RunTask(std::function<void()>&& task);
+
+  void SetMaxActive(size_t max_active);
+  // Prompt tokens to prefill per iteration while other sequences decode, 0
+  // for no limit. GenAI prefills a prompt in one step, so a prompt over the
+  // budget waits until enough iterations' worth has accrued: streams keep
+  // decoding in between instead of stalling on back-to-back prefills.
+  void SetPrefillBudget(uint64_t tokens_per_iteration) {
+    prefill_budget_ = tokens_per_iteration;
+  }
+  size_t PendingCount();
+  size_t ActiveCount() const { return active_count_; }
+  uint64_t PendingTokens();
+  // Moving average of the tokens decoded per second by all sequences, 0
+  // until the first iteration. Prefill steps do not count.
+  double TokensPerSecond() const { return tokens_per_second_; }
+  // Moving average of the prompt tokens prefilled per second, 0 until the
+  // first prefill
+  double PrefillTokensPerSecond() const { return prefill_tokens_per_second_; }
+
+ private:
+  void Loop();
+  // Takes the waiting requests past their deadline off the queue. Runs on
+  // the worker thread, the only one that takes requests off the queue.
+  void ExpirePending();
+  static bool RunsBefore(const InferenceState& a, const InferenceState& b);
+
+ private:
+  StepFn step_;
+  ExpireFn expire_;
+  std::string name_;
+  std::atomic<size_t> max_active_;
+  std::atomic<size_t> active_count_ = 0;
+  std::atomic<double> tokens_per_second_ = 0;
+  std::atomic<double> prefill_tokens_per_second_ = 0;
+  // Of the active sequences, as of the last iteration, for Admit
+  std::atomic<uint64_t> active_decode_tokens_ = 0;
+  std::atomic<uint64_t> active_prefill_tokens_ = 0;
+  std::atomic<uint64_t> prefill_budget_ = 0;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  // Kept in admission order
+  std::deque<std::shared_ptr<InferenceState>> pending_;
+  uint64_t pending_tokens_ = 0;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_ = false;
+
+  // Only touched from the worker thread
+  std::list<std::shared_ptr<InferenceState>> active_;
+  // Prefill tokens accrued while a prefill waits for its turn
+  uint64_t prefill_credit_ = 0;
+  std::thread worker_;
+};
+}  // namespace cortex_onnx
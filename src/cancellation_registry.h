@@ -0,0 +1,64 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace cortex_onnx {
+// Cancellation flags of in-flight requests by request id. A request holds its
+// flag for as long as it runs and checks it between tokens. The registry only
+// keeps weak references, so finished requests need no unregistering; expired
+// ids are swept as new requests come in.
+class CancellationRegistry {
+ public:
+  using Token = std::shared_ptr<std::atomic<bool>>;
+
+  // A request without an id gets a flag nobody else can set. Returns null if
+  // a request with the same id is still running, as cancelling by that id
+  // could only reach one of them.
+  Token Register(const std::string& request_id) {
+    auto token = std::make_shared<std::atomic<bool>>(false);
+    if (request_id.empty()) {
+      return token;
+    }
+    std::lock_guard<std::mutex> l(mtx_);
+    if (tokens_.size() >= sweep_at_) {
+      for (auto it = tokens_.begin(); it != tokens_.end();) {
+        it = it->second.expired() ? tokens_.erase(it) : std::next(it);
+      }
+      sweep_at_ = std::max<size_t>(kMinSweep, tokens_.size() * 2);
+    }
+    auto& registered = tokens_[request_id];
+    if (!registered.expired()) {
+      return nullptr;
+    }
+    registered = token;
+    return token;
+  }
+
+  // Returns false if no request with this id is running
+  bool Cancel(const std::string& request_id) {
+    std::lock_guard<std::mutex> l(mtx_);
+    auto it = tokens_.find(request_id);
+    if (it == tokens_.end()) {
+      return false;
+    }
+    auto token = it->second.lock();
+    tokens_.erase(it);
+    if (token == nullptr) {
+      return false;
+    }
+    *token = true;
+    return true;
+  }
+
+ private:
+  static constexpr size_t kMinSweep = 64;
+
+  std::mutex mtx_;
+  std::unordered_map<std::string, std::weak_ptr<std::atomic<bool>>> tokens_;
+  size_t sweep_at_ = kMinSweep;
+};
+}  // namespace cortex_onnx
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include "json/value.h"
 
 namespace onnx::inferences {
@@ -11,6 +12,12 @@ struct ChatCompletionRequest {
   float presence_penalty = 0;
   Json::Value stop = Json::Value(Json::arrayValue);
   Json::Value messages = Json::Value(Json::arrayValue);
+  Json::Value response_format;
+  // Higher priorities are admitted first
+  int priority = 0;
+  // Milliseconds from arrival by which generation must have started, 0 for
+  // none
+  int64_t deadline_ms = 0;
   std::string model_id;
 };
 
@@ -27,6 +34,9 @@ inline ChatCompletionRequest fromJson(std::shared_ptr<Json::Value> jsonBody) {
         (*jsonBody).get("presence_penalty", 0).asFloat();
     completion.messages = (*jsonBody)["messages"];
     completion.stop = (*jsonBody)["stop"];
+    completion.response_format = (*jsonBody)["response_format"];
+    completion.priority = (*jsonBody).get("priority", 0).asInt();
+    completion.deadline_ms = (*jsonBody).get("deadline_ms", 0).asInt64();
     completion.model_id = (*jsonBody).get("model", {}).asString();
   }
   return completion;
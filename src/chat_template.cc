@@ -0,0 +1,322 @@
+#include "chat_template.h"
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include "json/reader.h"
+#include "trantor/utils/Logger.h"
+
+namespace cortex_onnx {
+namespace {
+using Instruction = ChatTemplate::Instruction;
+using Op = ChatTemplate::Instruction::Op;
+
+Instruction Literal(std::string text) {
+  return Instruction{Op::kLiteral, std::move(text)};
+}
+Instruction Role() {
+  return Instruction{Op::kRole, {}};
+}
+Instruction Content() {
+  return Instruction{Op::kContent, {}};
+}
+
+std::string_view AsView(const Json::Value& v) {
+  const char* begin = nullptr;
+  const char* end = nullptr;
+  if (v.isString() && v.getString(&begin, &end)) {
+    return std::string_view(begin, end - begin);
+  }
+  return {};
+}
+
+std::string_view Trim(std::string_view s) {
+  const auto* ws = " \t\n\r";
+  auto first = s.find_first_not_of(ws);
+  if (first == std::string_view::npos) {
+    return {};
+  }
+  return s.substr(first, s.find_last_not_of(ws) - first + 1);
+}
+
+// `chat_template` is either a string or a list of named templates
+std::string GetChatTemplate(const Json::Value& config) {
+  const auto& t = config["chat_template"];
+  if (t.isString()) {
+    return t.asString();
+  }
+  if (t.isArray()) {
+    for (const auto& named : t) {
+      if (named["name"].asString() == "default") {
+        return named["template"].asString();
+      }
+    }
+  }
+  return {};
+}
+
+// Text of a Jinja string literal in `source` that starts with `marker` and
+// ends before `end`, with `\n` escapes resolved. Literals built from
+// expressions are skipped. Empty if there is none.
+std::string FindLiteral(const std::string& source, std::string_view marker,
+                        std::string_view end) {
+  for (auto pos = source.find(marker); pos != std::string::npos;
+       pos = source.find(marker, pos + 1)) {
+    auto begin = pos + marker.size();
+    auto stop = source.find(end, begin);
+    if (stop == std::string::npos) {
+      break;
+    }
+    auto text = std::string_view(source).substr(begin, stop - begin);
+    if (text.find_first_of("'\"{}+") != std::string_view::npos) {
+      continue;
+    }
+    std::string out;
+    for (size_t i = 0; i < text.size(); i++) {
+      if (text[i] == '\\' && i + 1 < text.size() && text[i + 1] == 'n') {
+        out += '\n';
+        i++;
+      } else {
+        out += text[i];
+      }
+    }
+    return out;
+  }
+  return {};
+}
+
+// `%d %b %Y`, as `strftime_now` formats it in Llama 3.2 templates
+std::string Today() {
+  static std::mutex mtx;
+  auto now = std::time(nullptr);
+  char date[32] = {};
+  std::lock_guard<std::mutex> l(mtx);
+  std::strftime(date, sizeof(date), "%d %b %Y", std::localtime(&now));
+  return date;
+}
+
+std::string GetBosToken(const Json::Value& config) {
+  const auto& bos = config["bos_token"];
+  if (bos.isObject()) {
+    return bos["content"].asString();
+  }
+  return bos.isString() ? bos.asString() : std::string();
+}
+}  // namespace
+
+ChatTemplate ChatTemplate::FromPrompts(const std::string& system_prompt,
+                                       const std::string& user_prompt,
+                                       const std::string& ai_prompt,
+                                       const std::string& pre_prompt) {
+  ChatTemplate t;
+  t.name_ = "prompts";
+  t.pre_prompt_ = pre_prompt;
+  t.system_ = {Literal(system_prompt), Content()};
+  t.user_ = {Literal(user_prompt), Content()};
+  t.assistant_ = {Literal(ai_prompt), Content()};
+  t.other_ = {Role(), Content()};
+  t.generation_prefix_ = ai_prompt;
+  return t;
+}
+
+bool ChatTemplate::FromModelPath(const std::string& model_path,
+                                 const std::string& pre_prompt, bool add_bos,
+                                 ChatTemplate& out) {
+  std::ifstream file(model_path + "/tokenizer_config.json");
+  if (!file.is_open()) {
+    return false;
+  }
+  Json::Value config;
+  Json::CharReaderBuilder builder;
+  std::string errs;
+  if (!Json::parseFromStream(builder, file, &config, &errs)) {
+    LOG_WARN << "Failed to parse tokenizer_config.json: " << errs;
+    return false;
+  }
+  auto source = GetChatTemplate(config);
+
+  ChatTemplate t;
+  Program turn;
+  if (source.find("<|start_header_id|>") != std::string::npos) {
+    t.name_ = "llama3";
+    turn = {Literal("<|start_header_id|>"), Role(),
+            Literal("<|end_header_id|>\n\n"), Content(), Literal("<|eot_id|>")};
+    t.generation_prefix_ = "<|start_header_id|>assistant<|end_header_id|>\n\n";
+    t.trim_content_ = true;
+    // Llama 3.1 and later
+    t.knowledge_cutoff_ =
+        FindLiteral(source, "Cutting Knowledge Date: ", "\\n");
+    if (!t.knowledge_cutoff_.empty()) {
+      t.name_ = "llama3.1";
+      t.leading_system_ = true;
+      if (source.find("strftime_now") == std::string::npos) {
+        t.today_date_ = FindLiteral(source, "date_string = \"", "\"");
+      }
+    }
+  } else if (source.find("<|im_start|>") != std::string::npos) {
+    t.name_ = "chatml";
+    turn = {Literal("<|im_start|>"), Role(), Literal("\n"), Content(),
+            Literal("<|im_end|>\n")};
+    t.generation_prefix_ = "<|im_start|>assistant\n";
+    // Qwen templates add a system turn of their own
+    t.default_system_ =
+        FindLiteral(source, "<|im_start|>system\\n", "<|im_end|>");
+    if (!t.default_system_.empty()) {
+      t.name_ = "qwen";
+      t.leading_system_ = true;
+    }
+  } else if (source.find("<|assistant|>") != std::string::npos &&
+             source.find("<|end|>") != std::string::npos) {
+    t.name_ = "phi3";
+    turn = {Literal("<|"), Role(), Literal("|>\n"), Content(),
+            Literal("<|end|>\n")};
+    t.generation_prefix_ = "<|assistant|>\n";
+  } else if (source.empty()) {
+    return false;
+  } else {
+    // Rendering it with other role prefixes would silently feed the model
+    // prompts it was not trained on
+    throw std::runtime_error(
+        "Unsupported chat template in tokenizer_config.json, pass "
+        "user_prompt, ai_prompt and system_prompt to load this model");
+  }
+
+  if (add_bos && source.find("bos_token") != std::string::npos) {
+    t.bos_ = GetBosToken(config);
+  }
+  t.pre_prompt_ = pre_prompt;
+  t.system_ = turn;
+  t.user_ = turn;
+  t.assistant_ = turn;
+  t.other_ = turn;
+  out = std::move(t);
+  return true;
+}
+
+const ChatTemplate::Program& ChatTemplate::ProgramFor(
+    std::string_view role) const {
+  if (role == "user") {
+    return user_;
+  } else if (role == "assistant") {
+    return assistant_;
+  } else if (role == "system") {
+    return system_;
+  }
+  return other_;
+}
+
+void ChatTemplate::Render(const std::vector<const Json::Value*>& messages,
+                          std::string& out,
+                          std::vector<size_t>& segment_ends) const {
+  struct Turn {
+    const Program* program;
+    std::string_view role;
+    std::string_view content;
+  };
+  std::vector<Turn> turns;
+  turns.reserve(messages.size() + 1);
+  size_t size = bos_.size() + pre_prompt_.size() + generation_prefix_.size();
+  auto add_turn = [&](std::string_view role, std::string_view content) {
+    const auto& program = ProgramFor(role);
+    for (const auto& ins : program) {
+      size += ins.op == Op::kLiteral ? ins.text.size()
+              : ins.op == Op::kRole  ? role.size()
+                                     : content.size();
+    }
+    turns.push_back(Turn{&program, role, content});
+  };
+  // Content of the first system turn when the template adds to it
+  std::string first_system;
+  for (size_t i = 0; i < messages.size(); i++) {
+    auto role = AsView((*messages[i])["role"]);
+    auto content = AsView((*messages[i])["content"]);
+    if (trim_content_) {
+      content = Trim(content);
+    }
+    if (i == 0 && leading_system_) {
+      if (role == "system") {
+        first_system = FirstSystemContent(content);
+        content = first_system;
+      } else {
+        first_system = FirstSystemContent(default_system_);
+        add_turn("system", first_system);
+      }
+    }
+    add_turn(role, content);
+  }
+  if (messages.empty() && leading_system_) {
+    first_system = FirstSystemContent(default_system_);
+    add_turn("system", first_system);
+  }
+
+  out.clear();
+  out.reserve(size);
+  segment_ends.clear();
+  segment_ends.reserve(turns.size() + 2);
+  out += bos_;
+  bool header_done = false;
+  for (const auto& turn : turns) {
+    if (!header_done && turn.role != "system") {
+      header_done = true;
+      if (!pre_prompt_.empty()) {
+        out += pre_prompt_;
+        segment_ends.push_back(out.size());
+      }
+    }
+    Append(*turn.program, turn.role, turn.content, out);
+    segment_ends.push_back(out.size());
+  }
+  if (!header_done && !pre_prompt_.empty()) {
+    out += pre_prompt_;
+    segment_ends.push_back(out.size());
+  }
+  out += generation_prefix_;
+  segment_ends.push_back(out.size());
+}
+
+void ChatTemplate::RenderMessage(const Json::Value& message,
+                                 std::string& out) const {
+  auto role = AsView(message["role"]);
+  auto content = AsView(message["content"]);
+  if (trim_content_) {
+    content = Trim(content);
+  }
+  out.clear();
+  Append(ProgramFor(role), role, content, out);
+}
+
+std::string ChatTemplate::Overhead() const {
+  std::string system;
+  if (leading_system_) {
+    Append(system_, "system", FirstSystemContent(default_system_), system);
+  }
+  return bos_ + pre_prompt_ + system + generation_prefix_;
+}
+
+std::string ChatTemplate::FirstSystemContent(std::string_view content) const {
+  if (knowledge_cutoff_.empty()) {
+    return std::string(content);
+  }
+  auto today = today_date_.empty() ? Today() : today_date_;
+  return "Cutting Knowledge Date: " + knowledge_cutoff_ +
+         "\nToday Date: " + today + "\n\n" + std::string(content);
+}
+
+void ChatTemplate::Append(const Program& program, std::string_view role,
+                          std::string_view content, std::string& out) const {
+  for (const auto& ins : program) {
+    switch (ins.op) {
+      case Op::kLiteral:
+        out += ins.text;
+        break;
+      case Op::kRole:
+        out += role;
+        break;
+      case Op::kContent:
+        out += content;
+        break;
+    }
+  }
+}
+
+}  // namespace cortex_onnx
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include "json/value.h"
+
+namespace cortex_onnx {
+// Chat template compiled once at LoadModel into a small program per role:
+// literals interleaved with the message role and content. Rendering a request
+// only runs these programs into a single pre-sized buffer. The model's Jinja
+// template is not evaluated: known template families are recognized by their
+// markers and replaced with an equivalent program.
+class ChatTemplate {
+ public:
+  struct Instruction {
+    enum class Op { kLiteral, kRole, kContent };
+    Op op;
+    std::string text;
+  };
+  using Program = std::vector<Instruction>;
+
+  // Legacy `system_prompt`/`user_prompt`/`ai_prompt` prefixes.
+  static ChatTemplate FromPrompts(const std::string& system_prompt,
+                                  const std::string& user_prompt,
+                                  const std::string& ai_prompt,
+                                  const std::string& pre_prompt);
+  // Compiles the `chat_template` of `tokenizer_config.json` in `model_path`.
+  // Returns false if there is none, and throws if it is not of a known
+  // template family. `add_bos` tells whether the template should emit the BOS
+  // token itself.
+  static bool FromModelPath(const std::string& model_path,
+                            const std::string& pre_prompt, bool add_bos,
+                            ChatTemplate& out);
+
+  // Renders `messages` in order, followed by the assistant generation prefix.
+  // `segment_ends` receives the offset in `out` where each rendered message
+  // ends; the last one is the end of `out`.
+  void Render(const std::vector<const Json::Value*>& messages,
+              std::string& out, std::vector<size_t>& segment_ends) const;
+
+  // Renders a single message turn, without BOS, pre prompt or generation
+  // prefix. Used to measure messages on their own.
+  void RenderMessage(const Json::Value& message, std::string& out) const;
+  // Text `Render` adds around the messages, at most.
+  std::string Overhead() const;
+
+  const std::string& name() const { return name_; }
+
+ private:
+  const Program& ProgramFor(std::string_view role) const;
+  void Append(const Program& program, std::string_view role,
+              std::string_view content, std::string& out) const;
+  // Content of the first system turn, `content` being the one of the system
+  // message if the conversation starts with one
+  std::string FirstSystemContent(std::string_view content) const;
+
+ private:
+  std::string name_;
+  std::string bos_;
+  std::string pre_prompt_;
+  Program system_;
+  Program user_;
+  Program assistant_;
+  Program other_;
+  std::string generation_prefix_;
+  bool trim_content_ = false;
+  // Some templates always start with a system turn, with `default_system_`
+  // as its content when the conversation does not start with a system
+  // message
+  bool leading_system_ = false;
+  std::string default_system_;
+  // Llama 3.1 and later state the knowledge cutoff and the date at the start
+  // of the system turn. An empty `today_date_` stands for the current date.
+  std::string knowledge_cutoff_;
+  std::string today_date_;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,349 @@
+#include "embedding_cache.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include "prompt_cache.h"
+#include "trantor/utils/Logger.h"
+
+namespace cortex_onnx {
+namespace {
+constexpr char kMagic[8] = {'C', 'X', 'E', 'M', 'B', '0', '0', '2'};
+// Records of this version lack the key text, so such files start afresh
+constexpr char kOldMagic[8] = {'C', 'X', 'E', 'M', 'B', '0', '0', '1'};
+// Memory tier bookkeeping per entry, on top of the vector itself
+constexpr size_t kEntryOverhead = 64;
+
+// Followed by `dims` floats, in host byte order, and the key text
+struct RecordHeader {
+  uint64_t hash;
+  // Of the vector and text bytes, to drop a record torn by a crash
+  uint64_t checksum;
+  uint32_t dims;
+  uint32_t text_size;
+};
+static_assert(sizeof(RecordHeader) == 24, "RecordHeader must not be padded");
+
+size_t MemoryBytes(const std::string& text, size_t dims) {
+  return dims * sizeof(float) + text.size() + kEntryOverhead;
+}
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+}  // namespace
+
+EmbeddingCache::EmbeddingCache(size_t budget_bytes, const std::string& path,
+                               uint64_t disk_budget_bytes)
+    : budget_bytes_(budget_bytes),
+      path_(path),
+      disk_budget_bytes_(disk_budget_bytes) {
+  if (path_.empty()) {
+    return;
+  }
+  OpenDisk();
+  std::lock_guard<std::mutex> l(log_mtx_);
+  if (log_.is_open() && disk_end_ > disk_budget_bytes_) {
+    Compact();
+  }
+}
+
+EmbeddingCache::Key EmbeddingCache::MakeKey(std::string_view scope,
+                                            std::string_view text) {
+  std::string normalized(scope);
+  normalized += '\0';
+  bool space = false;
+  for (char c : text) {
+    if (IsSpace(c)) {
+      space = true;
+      continue;
+    }
+    if (space && normalized.back() != '\0') {
+      normalized += ' ';
+    }
+    space = false;
+    normalized += c;
+  }
+  auto hash = Fnv1a(normalized.data(), normalized.size());
+  return Key{hash, std::move(normalized)};
+}
+
+bool EmbeddingCache::Get(const Key& key, std::vector<float>& embedding) {
+  std::lock_guard<std::mutex> l(mtx_);
+  auto* disk = FindDisk(key);
+  if (disk != nullptr) {
+    disk->last_used = ++tick_;
+  }
+  auto it = entries_.find(&key);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    embedding = it->second->embedding;
+    hits_++;
+    return true;
+  }
+  if (disk != nullptr && ReadDisk(*disk, embedding)) {
+    PutMemory(key, embedding);
+    hits_++;
+    return true;
+  }
+  misses_++;
+  return false;
+}
+
+void EmbeddingCache::Put(const Key& key, const std::vector<float>& embedding) {
+  if (embedding.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    if (entries_.count(&key) == 0) {
+      PutMemory(key, embedding);
+    }
+    if (FindDisk(key) != nullptr) {
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> log_lock(log_mtx_);
+  if (!log_.is_open()) {
+    return;
+  }
+  {
+    // Another request may have written the same text meanwhile
+    std::lock_guard<std::mutex> l(mtx_);
+    if (FindDisk(key) != nullptr) {
+      return;
+    }
+  }
+  const auto* data = reinterpret_cast<const char*>(embedding.data());
+  const size_t size = embedding.size() * sizeof(float);
+  const size_t record_size = sizeof(RecordHeader) + size + key.text.size();
+  if (disk_end_ + record_size > disk_budget_bytes_) {
+    Compact();
+    if (!log_.is_open() || disk_end_ + record_size > disk_budget_bytes_) {
+      return;
+    }
+  }
+  RecordHeader header{
+      key.hash,
+      Fnv1a(key.text.data(), key.text.size(), Fnv1a(data, size)),
+      static_cast<uint32_t>(embedding.size()),
+      static_cast<uint32_t>(key.text.size())};
+  log_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  log_.write(data, size);
+  log_.write(key.text.data(), key.text.size());
+  log_.flush();
+  if (!log_) {
+    LOG_WARN << "Failed to write embedding cache " << path_
+             << ", continuing in memory only";
+    log_.close();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    disk_.emplace(key.hash,
+                  DiskRecord{disk_end_ + sizeof(header), header.dims,
+                             header.text_size, ++tick_});
+    disk_bytes_ += record_size;
+  }
+  disk_end_ += record_size;
+}
+
+EmbeddingCache::Stats EmbeddingCache::GetStats() {
+  std::lock_guard<std::mutex> l(mtx_);
+  return Stats{hits_,  misses_,      entries_.size(),
+               bytes_, disk_.size(), disk_bytes_};
+}
+
+void EmbeddingCache::OpenDisk() {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  bool create = !fs::exists(path_, ec) || fs::file_size(path_, ec) == 0;
+  if (!create) {
+    char magic[sizeof(kOldMagic)] = {};
+    std::ifstream(path_, std::ios::binary).read(magic, sizeof(magic));
+    if (std::memcmp(magic, kOldMagic, sizeof(kOldMagic)) == 0) {
+      LOG_INFO << "Embedding cache " << path_
+               << " has an older format, starting afresh";
+      create = true;
+    }
+  }
+  if (create) {
+    std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+    file.write(kMagic, sizeof(kMagic));
+  }
+  if (!mapped_.Open(path_) || mapped_.size() < sizeof(kMagic) ||
+      std::memcmp(mapped_.data(), kMagic, sizeof(kMagic)) != 0) {
+    LOG_WARN << "Cannot use embedding cache file " << path_
+             << ", caching in memory only";
+    mapped_.Close();
+    return;
+  }
+
+  const char* data = mapped_.data();
+  const size_t size = mapped_.size();
+  size_t pos = sizeof(kMagic);
+  while (pos + sizeof(RecordHeader) <= size) {
+    RecordHeader header;
+    std::memcpy(&header, data + pos, sizeof(header));
+    const size_t bytes = static_cast<size_t>(header.dims) * sizeof(float) +
+                         header.text_size;
+    const size_t begin = pos + sizeof(header);
+    if (header.dims == 0 || begin + bytes > size ||
+        Fnv1a(data + begin, bytes) != header.checksum) {
+      break;
+    }
+    // Later records count as more recently used. A text written twice, by
+    // a process that lost its mapping, keeps its first record.
+    disk_.emplace(header.hash, DiskRecord{begin, header.dims,
+                                          header.text_size, ++tick_});
+    pos = begin + bytes;
+  }
+  if (pos < size) {
+    // Appending after a torn record would hide everything written later
+    LOG_WARN << "Dropping " << size - pos
+             << " bytes of incomplete records from " << path_;
+    mapped_.Close();
+    fs::resize_file(path_, pos, ec);
+    if (ec || !mapped_.Open(path_)) {
+      LOG_WARN << "Cannot truncate embedding cache file " << path_
+               << ", caching in memory only";
+      disk_.clear();
+      return;
+    }
+  }
+  disk_end_ = pos;
+  disk_bytes_ = pos - sizeof(kMagic);
+  log_.open(path_, std::ios::binary | std::ios::app);
+  LOG_INFO << "Embedding cache " << path_ << ": " << disk_.size()
+           << " embeddings";
+}
+
+void EmbeddingCache::PutMemory(const Key& key, std::vector<float> embedding) {
+  const size_t size = MemoryBytes(key.text, embedding.size());
+  if (size > budget_bytes_) {
+    return;
+  }
+  while (!lru_.empty() && bytes_ + size > budget_bytes_) {
+    const auto& last = lru_.back();
+    bytes_ -= MemoryBytes(last.key.text, last.embedding.size());
+    entries_.erase(&last.key);
+    lru_.pop_back();
+  }
+  lru_.push_front(Entry{key, std::move(embedding)});
+  entries_[&lru_.front().key] = lru_.begin();
+  bytes_ += size;
+}
+
+EmbeddingCache::DiskRecord* EmbeddingCache::FindDisk(const Key& key) {
+  auto [begin, end] = disk_.equal_range(key.hash);
+  for (auto it = begin; it != end; ++it) {
+    const auto& record = it->second;
+    if (record.text_size == key.text.size() && Mapped(record) &&
+        std::memcmp(mapped_.data() + record.offset +
+                        static_cast<size_t>(record.dims) * sizeof(float),
+                    key.text.data(), key.text.size()) == 0) {
+      return &it->second;
+    }
+  }
+  return nullptr;
+}
+
+bool EmbeddingCache::Mapped(const DiskRecord& record) {
+  const size_t end = record.offset +
+                     static_cast<size_t>(record.dims) * sizeof(float) +
+                     record.text_size;
+  if (end > mapped_.size()) {
+    // Appended after the file was mapped
+    mapped_.Open(path_);
+  }
+  return end <= mapped_.size();
+}
+
+bool EmbeddingCache::ReadDisk(const DiskRecord& record,
+                              std::vector<float>& embedding) {
+  if (!Mapped(record)) {
+    return false;
+  }
+  const size_t bytes = static_cast<size_t>(record.dims) * sizeof(float);
+  embedding.resize(record.dims);
+  std::memcpy(embedding.data(), mapped_.data() + record.offset, bytes);
+  return true;
+}
+
+// Rewrites the log with the most recently used records that fit in half the
+// disk budget. Appends wait on log_mtx_ meanwhile; lookups keep reading the
+// old mapping until the new file is swapped in.
+void EmbeddingCache::Compact() {
+  namespace fs = std::filesystem;
+  std::vector<std::pair<uint64_t, DiskRecord>> records;
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    records.assign(disk_.begin(), disk_.end());
+  }
+  std::sort(records.begin(), records.end(), [](const auto& a, const auto& b) {
+    return a.second.last_used > b.second.last_used;
+  });
+
+  const auto tmp_path = path_ + ".tmp";
+  MappedFile old;
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  out.write(kMagic, sizeof(kMagic));
+  DiskRecords kept;
+  // Old offset of every kept record, to carry over its tick below
+  std::unordered_map<uint64_t, DiskRecord*> moved;
+  uint64_t end = sizeof(kMagic);
+  if (old.Open(path_)) {
+    for (const auto& [hash, record] : records) {
+      const size_t bytes = static_cast<size_t>(record.dims) * sizeof(float) +
+                           record.text_size;
+      if (end + sizeof(RecordHeader) + bytes > disk_budget_bytes_ / 2) {
+        break;
+      }
+      if (record.offset + bytes > old.size()) {
+        continue;
+      }
+      const char* data = old.data() + record.offset;
+      RecordHeader header{hash, Fnv1a(data, bytes), record.dims,
+                          record.text_size};
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(data, bytes);
+      auto it = kept.emplace(hash, DiskRecord{end + sizeof(header), record.dims,
+                                              record.text_size, 0});
+      moved[record.offset] = &it->second;
+      end += sizeof(header) + bytes;
+    }
+  }
+  out.close();
+  // Windows cannot replace a file that is open or mapped
+  old.Close();
+  log_.close();
+
+  std::error_code ec;
+  std::lock_guard<std::mutex> l(mtx_);
+  mapped_.Close();
+  if (!out.fail()) {
+    fs::rename(tmp_path, path_, ec);
+  }
+  if (out.fail() || ec || !mapped_.Open(path_)) {
+    LOG_WARN << "Failed to compact embedding cache " << path_
+             << ", continuing in memory only";
+    fs::remove(tmp_path, ec);
+    disk_.clear();
+    disk_bytes_ = 0;
+    return;
+  }
+  for (const auto& [hash, record] : disk_) {
+    // Lookups during the rewrite moved the tick on
+    auto it = moved.find(record.offset);
+    if (it != moved.end()) {
+      it->second->last_used = record.last_used;
+    }
+  }
+  LOG_INFO << "Compacted embedding cache " << path_ << " from "
+           << disk_.size() << " to " << kept.size() << " embeddings";
+  disk_.swap(kept);
+  disk_bytes_ = end - sizeof(kMagic);
+  disk_end_ = end;
+  log_.open(path_, std::ios::binary | std::ios::app);
+}
+}  // namespace cortex_onnx
@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "mapped_file.h"
+
+namespace cortex_onnx {
+// Embeddings keyed by the model scope and the input text. Recently used
+// vectors are kept in memory within a byte budget. With a path, every vector
+// is also appended to a log file together with its key text, which is
+// memory-mapped when the cache opens, so embeddings survive restarts. Both
+// tiers compare the text on lookup, so a hash collision is only a miss. When
+// the log would outgrow its own budget it is rewritten with the most recently
+// used half.
+class EmbeddingCache {
+ public:
+  struct Key {
+    uint64_t hash = 0;
+    // Scope and normalized input text
+    std::string text;
+    bool operator==(const Key& other) const {
+      return hash == other.hash && text == other.text;
+    }
+  };
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t memory_entries;
+    uint64_t memory_bytes;
+    uint64_t disk_entries;
+    uint64_t disk_bytes;
+  };
+
+  // An empty `path` keeps the cache in memory only
+  EmbeddingCache(size_t budget_bytes, const std::string& path,
+                 uint64_t disk_budget_bytes);
+
+  // `scope` tells apart models and pooling options. Runs of whitespace in
+  // `text` count as one space and leading or trailing whitespace is ignored,
+  // as the WordPiece tokenizer splits on whitespace anyway.
+  static Key MakeKey(std::string_view scope, std::string_view text);
+
+  bool Get(const Key& key, std::vector<float>& embedding);
+  void Put(const Key& key, const std::vector<float>& embedding);
+  Stats GetStats();
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key* key) const {
+      return static_cast<size_t>(key->hash);
+    }
+  };
+  struct KeyEqual {
+    bool operator()(const Key* a, const Key* b) const { return *a == *b; }
+  };
+  struct Entry {
+    Key key;
+    std::vector<float> embedding;
+  };
+  struct DiskRecord {
+    // Offset of the vector in the file, followed by the key text
+    uint64_t offset;
+    uint32_t dims;
+    uint32_t text_size;
+    // Tick of the last lookup or write, to keep recent records on compaction
+    uint64_t last_used;
+  };
+  // By key hash; the text stays in the file
+  using DiskRecords = std::unordered_multimap<uint64_t, DiskRecord>;
+
+  void OpenDisk();
+  // Needs log_mtx_
+  void Compact();
+  void PutMemory(const Key& key, std::vector<float> embedding);
+  // Needs mtx_
+  DiskRecord* FindDisk(const Key& key);
+  // Needs mtx_. Remaps the file if the record was appended after mapping.
+  bool Mapped(const DiskRecord& record);
+  bool ReadDisk(const DiskRecord& record, std::vector<float>& embedding);
+
+ private:
+  std::mutex mtx_;
+  size_t budget_bytes_;
+  size_t bytes_ = 0;
+  std::list<Entry> lru_;
+  // Keyed by the key held in the entry, so that the text is stored once
+  std::unordered_map<const Key*, std::list<Entry>::iterator, KeyHash, KeyEqual>
+      entries_;
+
+  std::string path_;
+  uint64_t disk_budget_bytes_;
+  MappedFile mapped_;
+  DiskRecords disk_;
+  uint64_t disk_bytes_ = 0;
+  uint64_t tick_ = 0;
+
+  // Serialises appends and compaction, so that file writes happen outside
+  // mtx_ and lookups only ever copy from the mapping
+  std::mutex log_mtx_;
+  std::ofstream log_;
+  uint64_t disk_end_ = 0;
+
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,177 @@
+#include "embedding_model.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include "json/reader.h"
+#include "pooling.h"
+#include "trantor/utils/Logger.h"
+
+namespace cortex_onnx {
+namespace {
+// One environment per process, shared with nothing else in the engine
+Ort::Env& OrtEnv() {
+  static Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "cortex.onnx");
+  return env;
+}
+
+// `do_lower_case` of tokenizer_config.json, true when absent. Accents are
+// stripped exactly when lower casing, so a `strip_accents` that says
+// otherwise is refused rather than silently producing different ids.
+bool ReadLowerCase(const std::string& path) {
+  std::ifstream file(path + "/tokenizer_config.json");
+  Json::Value config;
+  Json::CharReaderBuilder builder;
+  std::string errs;
+  if (!file.is_open() ||
+      !Json::parseFromStream(builder, file, &config, &errs)) {
+    return true;
+  }
+  auto lower_case = config.get("do_lower_case", true).asBool();
+  const auto& strip_accents = config["strip_accents"];
+  if (strip_accents.isBool() && strip_accents.asBool() != lower_case) {
+    throw std::runtime_error("Unsupported strip_accents setting in " + path);
+  }
+  return lower_case;
+}
+}  // namespace
+
+std::unique_ptr<EmbeddingModel> EmbeddingModel::Create(
+    const std::string& path, const Options& options, LoadProgress* progress) {
+  namespace fs = std::filesystem;
+  const fs::path dir(path);
+  auto model_file = dir / "model.onnx";
+  if (!fs::exists(model_file)) {
+    model_file = dir / "onnx" / "model.onnx";
+  }
+
+  auto model = std::make_unique<EmbeddingModel>();
+  model->options_ = options;
+  model->options_.batch_size = std::max<size_t>(1, options.batch_size);
+  if (progress != nullptr) {
+    progress->phase = LoadProgress::Phase::kCreatingTokenizer;
+  }
+  if (!model->tokenizer_.Load((dir / "vocab.txt").string(),
+                              ReadLowerCase(path))) {
+    throw std::runtime_error("No WordPiece vocab.txt in " + path);
+  }
+
+  if (progress != nullptr) {
+    progress->phase = LoadProgress::Phase::kCreatingSession;
+  }
+  LOG_INFO << "Creating embedding session...";
+  Ort::SessionOptions session_options;
+  session_options.SetGraphOptimizationLevel(
+      GraphOptimizationLevel::ORT_ENABLE_ALL);
+  model->session_ = std::make_unique<Ort::Session>(
+      OrtEnv(), model_file.c_str(), session_options);
+  if (progress != nullptr) {
+    progress->bytes_read = progress->bytes_total.load();
+  }
+
+  Ort::AllocatorWithDefaultOptions allocator;
+  for (size_t i = 0; i < model->session_->GetInputCount(); i++) {
+    std::string name =
+        model->session_->GetInputNameAllocated(i, allocator).get();
+    if (name != "input_ids" && name != "attention_mask" &&
+        name != "token_type_ids") {
+      throw std::runtime_error("Unsupported embedding model input: " + name);
+    }
+    model->input_names_.push_back(std::move(name));
+  }
+  // Prefer a pooled output when the export has one
+  model->output_name_ =
+      model->session_->GetOutputNameAllocated(0, allocator).get();
+  for (size_t i = 0; i < model->session_->GetOutputCount(); i++) {
+    std::string name =
+        model->session_->GetOutputNameAllocated(i, allocator).get();
+    if (name == "sentence_embedding") {
+      model->output_name_ = name;
+    }
+  }
+  return model;
+}
+
+size_t EmbeddingModel::Embed(
+    const std::vector<std::string_view>& inputs,
+    std::vector<std::vector<float>>& embeddings) const {
+  const size_t n = inputs.size();
+  std::vector<std::vector<int64_t>> ids(n);
+  size_t tokens = 0;
+  for (size_t i = 0; i < n; i++) {
+    tokenizer_.Encode(inputs[i], options_.max_length, ids[i]);
+    tokens += ids[i].size();
+  }
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&ids](size_t a, size_t b) {
+    return ids[a].size() < ids[b].size();
+  });
+
+  embeddings.assign(n, {});
+  auto memory_info =
+      Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+  std::vector<const char*> input_names;
+  for (const auto& name : input_names_) {
+    input_names.push_back(name.c_str());
+  }
+  const char* output_name = output_name_.c_str();
+  std::vector<int64_t> input_ids;
+  std::vector<int64_t> attention_mask;
+  std::vector<int64_t> token_type_ids;
+  for (size_t b = 0; b < n; b += options_.batch_size) {
+    // Sorted by length, so the last one of the batch is the longest
+    const size_t count = std::min(options_.batch_size, n - b);
+    const size_t length = ids[order[b + count - 1]].size();
+    input_ids.assign(count * length, tokenizer_.pad_id());
+    attention_mask.assign(count * length, 0);
+    token_type_ids.assign(count * length, 0);
+    for (size_t j = 0; j < count; j++) {
+      const auto& seq = ids[order[b + j]];
+      std::copy(seq.begin(), seq.end(), input_ids.begin() + j * length);
+      std::fill_n(attention_mask.begin() + j * length, seq.size(), 1);
+    }
+
+    const int64_t shape[] = {static_cast<int64_t>(count),
+                             static_cast<int64_t>(length)};
+    std::vector<Ort::Value> tensors;
+    for (const auto& name : input_names_) {
+      auto& data = name == "input_ids"        ? input_ids
+                   : name == "attention_mask" ? attention_mask
+                                              : token_type_ids;
+      tensors.push_back(Ort::Value::CreateTensor<int64_t>(
+          memory_info, data.data(), data.size(), shape, 2));
+    }
+    auto outputs =
+        session_->Run(Ort::RunOptions{nullptr}, input_names.data(),
+                      tensors.data(), tensors.size(), &output_name, 1);
+
+    auto info = outputs[0].GetTensorTypeAndShapeInfo();
+    if (info.GetElementType() != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+      throw std::runtime_error("Embedding output is not float32");
+    }
+    const auto out_shape = info.GetShape();
+    const auto dims = static_cast<size_t>(out_shape.back());
+    const float* data = outputs[0].GetTensorData<float>();
+    for (size_t j = 0; j < count; j++) {
+      auto& embedding = embeddings[order[b + j]];
+      embedding.resize(dims);
+      if (out_shape.size() == 2) {
+        // Already pooled by the model
+        std::copy_n(data + j * dims, dims, embedding.data());
+      } else if (options_.pooling == Pooling::kCls) {
+        std::copy_n(data + j * length * dims, dims, embedding.data());
+      } else {
+        MeanPool(data + j * length * dims,
+                 attention_mask.data() + j * length, length, dims,
+                 embedding.data());
+      }
+      if (options_.normalize) {
+        L2Normalize(embedding.data(), dims);
+      }
+    }
+  }
+  return tokens;
+}
+}  // namespace cortex_onnx
@@ -0,0 +1,45 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "load_progress.h"
+#include "onnxruntime_cxx_api.h"
+#include "wordpiece_tokenizer.h"
+
+namespace cortex_onnx {
+// BERT-style encoder that turns texts into sentence embeddings. GenAI only
+// drives decoders, so the encoder runs on an ORT session of its own.
+// Session::Run is thread safe, and requests embed on their own threads.
+class EmbeddingModel {
+ public:
+  enum class Pooling { kMean, kCls };
+  struct Options {
+    Pooling pooling = Pooling::kMean;
+    bool normalize = true;
+    // Longer inputs are truncated
+    size_t max_length = 512;
+    size_t batch_size = 32;
+  };
+
+  // Loads `model.onnx` (or `onnx/model.onnx`) and `vocab.txt` from `path`.
+  // Throws if either is missing or the model has inputs it cannot feed.
+  static std::unique_ptr<EmbeddingModel> Create(const std::string& path,
+                                                const Options& options,
+                                                LoadProgress* progress);
+
+  // Embeds `inputs` into `embeddings`, in order. Inputs are sorted by length
+  // and run in padded batches so that little compute goes to padding.
+  // Returns the number of tokens.
+  size_t Embed(const std::vector<std::string_view>& inputs,
+               std::vector<std::vector<float>>& embeddings) const;
+
+ private:
+  Options options_;
+  WordPieceTokenizer tokenizer_;
+  std::unique_ptr<Ort::Session> session_;
+  // Inputs the model takes, in session order
+  std::vector<std::string> input_names_;
+  std::string output_name_;
+};
+}  // namespace cortex_onnx
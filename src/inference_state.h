@@ -0,0 +1,73 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cancellation_registry.h"
+#include "chat_completion_request.h"
+#include "json/value.h"
+#include "json_validator.h"
+#include "model_instance.h"
+#include "response_cache.h"
+#include "ort_genai.h"
+#include "sse_chunk_writer.h"
+#include "stop_matcher.h"
+
+namespace cortex_onnx {
+struct PromptSetup;
+
+// Per-request generation state. Owned by the scheduler while the request is
+// in flight and only touched from the scheduler thread.
+struct InferenceState {
+  onnx::inferences::ChatCompletionRequest req;
+  std::function<void(Json::Value&&, Json::Value&&)> callback;
+  // Set when the client goes away, checked before every step
+  CancellationRegistry::Token cancelled;
+  std::string id;
+  SseChunkWriter chunk_writer;
+  // Built from `req.stop`
+  StopMatcher stop_matcher;
+  // Set for `response_format` JSON requests
+  std::unique_ptr<JsonValidator> json_validator;
+  std::string finish_reason = "stop";
+  // Setup `prompt` was rendered with, the one it is encoded with
+  std::shared_ptr<const PromptSetup> prompt_setup;
+  std::string prompt;
+  // Offsets in `prompt` where each rendered message ends. The last one is the
+  // end of the prompt, right after the assistant generation prefix.
+  std::vector<size_t> segment_ends;
+  // Estimated before tokenizing, for the scheduler's prefill budget
+  uint64_t prompt_tokens = 0;
+  // Prompt tokens plus max_tokens, counted against the queue token budget
+  uint64_t queued_tokens = 0;
+  // From `req.deadline_ms`. Requests still queued past it are dropped before
+  // prefill.
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+
+  std::vector<int32_t> input_ids;
+  std::unique_ptr<OgaGeneratorParams> params;
+  std::unique_ptr<OgaGenerator> generator;
+  // Instance the sequence started on, kept alive until it ends.
+  // `tokenizer_stream` comes from its stream pool and is dropped at the end.
+  std::shared_ptr<ModelInstance> model;
+  std::unique_ptr<OgaTokenizerStream> tokenizer_stream;
+  // Set when this request generates a response for the cache; `pieces`
+  // collects its decoded tokens
+  std::shared_ptr<ResponseCache> response_cache;
+  ResponseCache::Key response_key{};
+  std::vector<std::string> pieces;
+  // Output of a non-streaming request, sent once it finishes
+  std::string content;
+
+  std::chrono::system_clock::time_point start;
+  double generated_tokens = 0;
+  // For latency metrics
+  std::chrono::steady_clock::time_point arrived;
+  std::chrono::steady_clock::time_point enqueued;
+  std::chrono::steady_clock::time_point prefill_start;
+  std::chrono::steady_clock::time_point first_token;
+  std::chrono::steady_clock::time_point last_token;
+};
+}  // namespace cortex_onnx
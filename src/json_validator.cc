@@ -0,0 +1,230 @@
+#include "json_validator.h"
+
+namespace cortex_onnx {
+namespace {
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+bool IsHex(char c) {
+  return IsDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+}  // namespace
+
+JsonValidator::Result JsonValidator::Feed(std::string_view text,
+                                          size_t& valid_bytes) {
+  for (size_t i = 0; i < text.size(); i++) {
+    if (!Step(text[i])) {
+      valid_bytes = i;
+      return Result::kInvalid;
+    }
+    if (complete_) {
+      valid_bytes = i + 1;
+      return Result::kComplete;
+    }
+  }
+  valid_bytes = text.size();
+  return Result::kIncomplete;
+}
+
+bool JsonValidator::Step(char c) {
+  if (InNumber()) {
+    switch (state_) {
+      case State::kNumberMinus:
+        if (c == '0') {
+          state_ = State::kNumberZero;
+          return true;
+        }
+        if (IsDigit(c)) {
+          state_ = State::kNumberInt;
+          return true;
+        }
+        return false;
+      case State::kNumberDot:
+        if (IsDigit(c)) {
+          state_ = State::kNumberFraction;
+          return true;
+        }
+        return false;
+      case State::kNumberExponent:
+        if (c == '+' || c == '-') {
+          state_ = State::kNumberExponentSign;
+          return true;
+        }
+        [[fallthrough]];
+      case State::kNumberExponentSign:
+        if (IsDigit(c)) {
+          state_ = State::kNumberExponentDigits;
+          return true;
+        }
+        return false;
+      default:
+        break;
+    }
+    // The number may end here
+    if (IsDigit(c) && state_ != State::kNumberZero) {
+      return true;
+    }
+    if (c == '.' && state_ != State::kNumberFraction &&
+        state_ != State::kNumberExponentDigits) {
+      state_ = State::kNumberDot;
+      return true;
+    }
+    if ((c == 'e' || c == 'E') && state_ != State::kNumberExponentDigits) {
+      state_ = State::kNumberExponent;
+      return true;
+    }
+    // Numbers only occur inside containers, `c` follows the number there
+    EndValue();
+  }
+
+  switch (state_) {
+    case State::kValue:
+      return IsSpace(c) || Value(c);
+    case State::kValueOrEnd:
+      if (c == ']') {
+        stack_.pop_back();
+        EndValue();
+        return true;
+      }
+      return IsSpace(c) || Value(c);
+    case State::kKeyOrEnd:
+      if (c == '}') {
+        stack_.pop_back();
+        EndValue();
+        return true;
+      }
+      [[fallthrough]];
+    case State::kKey:
+      if (c == '"') {
+        state_ = State::kString;
+        string_is_key_ = true;
+        return true;
+      }
+      return IsSpace(c);
+    case State::kColon:
+      if (c == ':') {
+        state_ = State::kValue;
+        return true;
+      }
+      return IsSpace(c);
+    case State::kCommaOrEnd:
+      if (c == ',') {
+        state_ = stack_.back() ? State::kKey : State::kValue;
+        return true;
+      }
+      if (c == (stack_.back() ? '}' : ']')) {
+        stack_.pop_back();
+        EndValue();
+        return true;
+      }
+      return IsSpace(c);
+    case State::kString:
+      if (c == '"') {
+        if (string_is_key_) {
+          state_ = State::kColon;
+        } else {
+          EndValue();
+        }
+        return true;
+      }
+      if (c == '\\') {
+        state_ = State::kEscape;
+        return true;
+      }
+      return static_cast<unsigned char>(c) >= 0x20;
+    case State::kEscape:
+      if (c == 'u') {
+        state_ = State::kUnicode;
+        unicode_digits_ = 0;
+        return true;
+      }
+      if (c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' ||
+          c == 'n' || c == 'r' || c == 't') {
+        state_ = State::kString;
+        return true;
+      }
+      return false;
+    case State::kUnicode:
+      if (!IsHex(c)) {
+        return false;
+      }
+      if (++unicode_digits_ == 4) {
+        state_ = State::kString;
+      }
+      return true;
+    case State::kLiteral:
+      if (c != literal_.front()) {
+        return false;
+      }
+      literal_.remove_prefix(1);
+      if (literal_.empty()) {
+        EndValue();
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool JsonValidator::Value(char c) {
+  if (!started_) {
+    if (c != '{' && (object_only_ || c != '[')) {
+      return false;
+    }
+    started_ = true;
+  }
+  switch (c) {
+    case '{':
+      stack_.push_back(true);
+      state_ = State::kKeyOrEnd;
+      return true;
+    case '[':
+      stack_.push_back(false);
+      state_ = State::kValueOrEnd;
+      return true;
+    case '"':
+      state_ = State::kString;
+      string_is_key_ = false;
+      return true;
+    case 't':
+      literal_ = "rue";
+      state_ = State::kLiteral;
+      return true;
+    case 'f':
+      literal_ = "alse";
+      state_ = State::kLiteral;
+      return true;
+    case 'n':
+      literal_ = "ull";
+      state_ = State::kLiteral;
+      return true;
+    case '-':
+      state_ = State::kNumberMinus;
+      return true;
+    case '0':
+      state_ = State::kNumberZero;
+      return true;
+    default:
+      if (IsDigit(c)) {
+        state_ = State::kNumberInt;
+        return true;
+      }
+      return false;
+  }
+}
+
+void JsonValidator::EndValue() {
+  if (stack_.empty()) {
+    complete_ = true;
+  } else {
+    state_ = State::kCommaOrEnd;
+  }
+}
+
+bool JsonValidator::InNumber() const {
+  return state_ >= State::kNumberMinus;
+}
+}  // namespace cortex_onnx
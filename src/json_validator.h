@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace cortex_onnx {
+// Incremental JSON syntax check of generated text, one byte at a time, for
+// `response_format` requests. It tells as soon as the output can no longer be
+// valid JSON, and when the top-level value is complete, so that generation
+// stops at either point instead of running on to max_length.
+class JsonValidator {
+ public:
+  enum class Result { kIncomplete, kComplete, kInvalid };
+
+  // The top-level value must be an object, or with `object_only` false an
+  // object or an array, so that it ends on a byte of its own. Leading
+  // whitespace is accepted.
+  explicit JsonValidator(bool object_only = true)
+      : object_only_(object_only) {}
+
+  // Checks `text` as the continuation of the output so far. `valid_bytes`
+  // receives how much of `text` belongs to the value: everything on
+  // kIncomplete, up to the end of the value on kComplete and up to the
+  // offending byte on kInvalid. Must not be fed after kComplete or kInvalid.
+  Result Feed(std::string_view text, size_t& valid_bytes);
+
+ private:
+  enum class State : uint8_t {
+    kValue,
+    // After `[`: a value or `]`
+    kValueOrEnd,
+    // After `{`: a key or `}`
+    kKeyOrEnd,
+    // After `,` in an object
+    kKey,
+    kColon,
+    // After a value inside a container
+    kCommaOrEnd,
+    kString,
+    kEscape,
+    kUnicode,
+    kLiteral,
+    kNumberMinus,
+    kNumberZero,
+    kNumberInt,
+    kNumberDot,
+    kNumberFraction,
+    kNumberExponent,
+    kNumberExponentSign,
+    kNumberExponentDigits,
+  };
+
+  // Returns false if `c` cannot come next
+  bool Step(char c);
+  bool Value(char c);
+  // A value ended, go to what follows it in the enclosing container
+  void EndValue();
+  bool InNumber() const;
+
+ private:
+  bool object_only_;
+  State state_ = State::kValue;
+  // Open containers, true for objects
+  std::vector<bool> stack_;
+  bool string_is_key_ = false;
+  bool started_ = false;
+  bool complete_ = false;
+  // Rest of `true`, `false` or `null` still expected
+  std::string_view literal_;
+  int unicode_digits_ = 0;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,99 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cortex_onnx {
+// Estimated KV-cache memory of the requests in flight on one model. GenAI does
+// not report its allocations, so sizes come from the model shape in
+// genai_config.json. With a shared past/present buffer the cache of a
+// sequence is allocated for its whole max_length up front, otherwise it grows
+// with every token.
+class KvCacheAccounting {
+ public:
+  struct Request {
+    std::string id;
+    uint64_t bytes;
+    uint64_t peak_bytes;
+  };
+  struct Stats {
+    uint64_t bytes_per_token;
+    uint64_t in_use_bytes;
+    uint64_t peak_bytes;
+    // Largest high-water mark of a single request so far
+    uint64_t max_request_peak_bytes;
+    std::vector<Request> requests;
+  };
+
+  void Configure(uint64_t bytes_per_token, bool share_buffer) {
+    std::lock_guard<std::mutex> l(mtx_);
+    bytes_per_token_ = bytes_per_token;
+    share_buffer_ = share_buffer;
+  }
+
+  // Bytes held by a sequence of `length` tokens out of `max_length`
+  uint64_t SequenceBytes(size_t length, size_t max_length) const {
+    // A reload may reconfigure while sequences are running
+    std::lock_guard<std::mutex> l(mtx_);
+    return bytes_per_token_ * (share_buffer_ ? max_length : length);
+  }
+  bool share_buffer() const {
+    std::lock_guard<std::mutex> l(mtx_);
+    return share_buffer_;
+  }
+
+  // Sets the bytes held by request `id` and returns its high-water mark
+  uint64_t Update(const std::string& id, uint64_t bytes) {
+    std::lock_guard<std::mutex> l(mtx_);
+    auto& r = requests_[id];
+    in_use_bytes_ += bytes;
+    in_use_bytes_ -= r.bytes;
+    r.bytes = bytes;
+    r.peak_bytes = std::max(r.peak_bytes, bytes);
+    peak_bytes_ = std::max(peak_bytes_, in_use_bytes_);
+    max_request_peak_bytes_ = std::max(max_request_peak_bytes_, r.peak_bytes);
+    return r.peak_bytes;
+  }
+
+  // Forgets request `id` and returns its high-water mark
+  uint64_t Release(const std::string& id) {
+    std::lock_guard<std::mutex> l(mtx_);
+    auto it = requests_.find(id);
+    if (it == requests_.end()) {
+      return 0;
+    }
+    auto peak = it->second.peak_bytes;
+    in_use_bytes_ -= it->second.bytes;
+    requests_.erase(it);
+    return peak;
+  }
+
+  Stats GetStats() {
+    std::lock_guard<std::mutex> l(mtx_);
+    Stats stats{bytes_per_token_, in_use_bytes_, peak_bytes_,
+                max_request_peak_bytes_, {}};
+    stats.requests.reserve(requests_.size());
+    for (const auto& [id, r] : requests_) {
+      stats.requests.push_back(Request{id, r.bytes, r.peak_bytes});
+    }
+    return stats;
+  }
+
+ private:
+  struct Usage {
+    uint64_t bytes = 0;
+    uint64_t peak_bytes = 0;
+  };
+
+  mutable std::mutex mtx_;
+  uint64_t bytes_per_token_ = 0;
+  bool share_buffer_ = false;
+  uint64_t in_use_bytes_ = 0;
+  uint64_t peak_bytes_ = 0;
+  uint64_t max_request_peak_bytes_ = 0;
+  std::unordered_map<std::string, Usage> requests_;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,91 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace cortex_onnx {
+// Progress of a model load, written by the loader thread and read by
+// GetModelStatus.
+class LoadProgress {
+ public:
+  enum class Phase {
+    kIdle,
+    kReadingWeights,
+    kCreatingSession,
+    kCreatingTokenizer,
+    kWarmingUp,
+    kLoaded,
+    kFailed
+  };
+
+  void Start() {
+    std::lock_guard<std::mutex> l(mtx_);
+    start_ = std::chrono::steady_clock::now();
+    end_.reset();
+    error_.clear();
+    bytes_read = 0;
+    bytes_total = 0;
+    phase = Phase::kReadingWeights;
+  }
+
+  void Finish() {
+    std::lock_guard<std::mutex> l(mtx_);
+    end_ = std::chrono::steady_clock::now();
+    phase = Phase::kLoaded;
+  }
+
+  void Fail(const std::string& error) {
+    std::lock_guard<std::mutex> l(mtx_);
+    end_ = std::chrono::steady_clock::now();
+    error_ = error;
+    phase = Phase::kFailed;
+  }
+
+  std::string Error() {
+    std::lock_guard<std::mutex> l(mtx_);
+    return error_;
+  }
+
+  // How long the load has been running, or took once it ended
+  int64_t ElapsedMs() {
+    std::lock_guard<std::mutex> l(mtx_);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               end_.value_or(std::chrono::steady_clock::now()) - start_)
+        .count();
+  }
+
+  static const char* PhaseName(Phase p) {
+    switch (p) {
+      case Phase::kIdle:
+        return "idle";
+      case Phase::kReadingWeights:
+        return "reading_weights";
+      case Phase::kCreatingSession:
+        return "creating_session";
+      case Phase::kCreatingTokenizer:
+        return "creating_tokenizer";
+      case Phase::kWarmingUp:
+        return "warming_up";
+      case Phase::kLoaded:
+        return "loaded";
+      case Phase::kFailed:
+        return "failed";
+    }
+    return "unknown";
+  }
+
+ public:
+  std::atomic<Phase> phase = Phase::kIdle;
+  std::atomic<uint64_t> bytes_read = 0;
+  std::atomic<uint64_t> bytes_total = 0;
+
+ private:
+  std::mutex mtx_;
+  std::chrono::steady_clock::time_point start_;
+  std::optional<std::chrono::steady_clock::time_point> end_;
+  std::string error_;
+};
+}  // namespace cortex_onnx
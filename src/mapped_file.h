@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace cortex_onnx {
+// Read-only memory mapping of a whole file
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Returns false if the file cannot be opened or mapped. An empty file maps
+  // to nothing and succeeds.
+  bool Open(const std::string& path);
+  void Close();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#if defined(_WIN32)
+  void* file_ = nullptr;
+  void* mapping_ = nullptr;
+#endif
+};
+}  // namespace cortex_onnx
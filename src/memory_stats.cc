@@ -0,0 +1,89 @@
+#include "memory_stats.h"
+#if defined(_WIN32)
+#include <windows.h>
+#include <dxgi1_4.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#include <fstream>
+#endif
+
+namespace cortex_onnx {
+namespace {
+#if defined(_WIN32)
+uint64_t ResidentBytes() {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.WorkingSetSize;
+}
+
+// Local (dedicated) video memory this process uses, summed over adapters
+uint64_t VideoBytes() {
+  IDXGIFactory1* factory = nullptr;
+  if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1),
+                                reinterpret_cast<void**>(&factory)))) {
+    return 0;
+  }
+  uint64_t bytes = 0;
+  IDXGIAdapter1* adapter = nullptr;
+  for (UINT i = 0; factory->EnumAdapters1(i, &adapter) != DXGI_ERROR_NOT_FOUND;
+       i++) {
+    IDXGIAdapter3* adapter3 = nullptr;
+    if (SUCCEEDED(adapter->QueryInterface(
+            __uuidof(IDXGIAdapter3), reinterpret_cast<void**>(&adapter3)))) {
+      DXGI_QUERY_VIDEO_MEMORY_INFO info;
+      if (SUCCEEDED(adapter3->QueryVideoMemoryInfo(
+              0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &info))) {
+        bytes += info.CurrentUsage;
+      }
+      adapter3->Release();
+    }
+    adapter->Release();
+  }
+  factory->Release();
+  return bytes;
+}
+#elif defined(__APPLE__)
+uint64_t ResidentBytes() {
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return info.resident_size;
+}
+
+uint64_t VideoBytes() {
+  return 0;
+}
+#else
+uint64_t ResidentBytes() {
+  // Second field of statm is the resident set in pages
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0;
+  uint64_t resident = 0;
+  if (!(statm >> size >> resident)) {
+    return 0;
+  }
+  return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+uint64_t VideoBytes() {
+  return 0;
+}
+#endif
+}  // namespace
+
+ProcessMemory GetProcessMemory() {
+  ProcessMemory m;
+  m.rss_bytes = ResidentBytes();
+  m.vram_bytes = VideoBytes();
+  return m;
+}
+}  // namespace cortex_onnx
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+
+namespace cortex_onnx {
+// Memory of the whole process. Counters the platform does not provide are 0.
+struct ProcessMemory {
+  uint64_t rss_bytes = 0;
+  // Dedicated GPU memory in use by this process (DXGI, Windows only)
+  uint64_t vram_bytes = 0;
+};
+
+ProcessMemory GetProcessMemory();
+}  // namespace cortex_onnx
@@ -0,0 +1,207 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace cortex_onnx {
+namespace {
+std::vector<double> LatencyBuckets() {
+  return {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+          0.5,   1,      2.5,   5,    10,    30,   60};
+}
+
+void AppendNumber(std::string& out, double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.10g", value);
+  out += buffer;
+}
+
+void AppendHeader(std::string& out, const char* name, const char* help,
+                  const char* type) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+std::string ModelLabel(const std::string& model_id) {
+  std::string label = "model=\"";
+  for (char c : model_id) {
+    if (c == '"' || c == '\\') {
+      label += '\\';
+    }
+    if (c == '\n') {
+      label += "\\n";
+    } else {
+      label += c;
+    }
+  }
+  label += '"';
+  return label;
+}
+}  // namespace
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)),
+      counts_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+  for (size_t i = 0; i <= bounds_.size(); i++) {
+    counts_[i] = 0;
+  }
+}
+
+void Histogram::Observe(double value) {
+  auto bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+                bounds_.begin();
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  auto sum = sum_.load(std::memory_order_relaxed);
+  while (!sum_.compare_exchange_weak(sum, sum + value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::Render(std::string& out, const std::string& name,
+                       const std::string& labels) const {
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i <= bounds_.size(); i++) {
+    cumulative += counts_[i].load(std::memory_order_relaxed);
+    out += name;
+    out += "_bucket{";
+    out += labels;
+    out += ",le=\"";
+    if (i < bounds_.size()) {
+      AppendNumber(out, bounds_[i]);
+    } else {
+      out += "+Inf";
+    }
+    out += "\"} ";
+    out += std::to_string(cumulative);
+    out += '\n';
+  }
+  out += name + "_sum{" + labels + "} ";
+  AppendNumber(out, sum_.load(std::memory_order_relaxed));
+  out += '\n';
+  out += name + "_count{" + labels + "} ";
+  out += std::to_string(count_.load(std::memory_order_relaxed));
+  out += '\n';
+}
+
+ModelMetrics::ModelMetrics()
+    : queue_depth({0, 1, 2, 4, 8, 16, 32, 64, 128, 256}),
+      queue_wait_seconds(LatencyBuckets()),
+      tokenize_seconds(LatencyBuckets()),
+      prefill_seconds(LatencyBuckets()),
+      time_to_first_token_seconds(LatencyBuckets()),
+      time_per_output_token_seconds(LatencyBuckets()),
+      e2e_seconds(LatencyBuckets()),
+      tokens_per_second({1, 2, 5, 10, 20, 50, 100, 200, 500, 1000}) {}
+
+std::string RenderMetrics(const std::vector<ModelSeries>& models) {
+  struct HistogramFamily {
+    const char* name;
+    const char* help;
+    Histogram ModelMetrics::*member;
+  };
+  static const HistogramFamily kHistograms[] = {
+      {"cortex_onnx_queue_depth", "Requests already queued on arrival.",
+       &ModelMetrics::queue_depth},
+      {"cortex_onnx_queue_wait_seconds",
+       "Time from entering the queue until the request starts.",
+       &ModelMetrics::queue_wait_seconds},
+      {"cortex_onnx_tokenize_seconds", "Time to tokenize the prompt.",
+       &ModelMetrics::tokenize_seconds},
+      {"cortex_onnx_prefill_seconds",
+       "Time to process the prompt and generate the first token.",
+       &ModelMetrics::prefill_seconds},
+      {"cortex_onnx_time_to_first_token_seconds",
+       "Time from arrival until the first token.",
+       &ModelMetrics::time_to_first_token_seconds},
+      {"cortex_onnx_time_per_output_token_seconds",
+       "Time to decode each token after the first.",
+       &ModelMetrics::time_per_output_token_seconds},
+      {"cortex_onnx_e2e_seconds", "Time from arrival until the last token.",
+       &ModelMetrics::e2e_seconds},
+      {"cortex_onnx_tokens_per_second", "Decode rate of each request.",
+       &ModelMetrics::tokens_per_second},
+  };
+  struct CounterFamily {
+    const char* name;
+    const char* help;
+    std::atomic<uint64_t> ModelMetrics::*member;
+  };
+  static const CounterFamily kCounters[] = {
+      {"cortex_onnx_requests_total", "Chat completion requests accepted.",
+       &ModelMetrics::requests_total},
+      {"cortex_onnx_embedding_requests_total", "Embedding requests accepted.",
+       &ModelMetrics::embedding_requests_total},
+      {"cortex_onnx_errors_total", "Requests that ended with an error.",
+       &ModelMetrics::errors_total},
+      {"cortex_onnx_cancelled_total",
+       "Chat completions cancelled before they finished.",
+       &ModelMetrics::cancelled_total},
+      {"cortex_onnx_rejected_total",
+       "Chat completions rejected because the queue was full.",
+       &ModelMetrics::rejected_total},
+      {"cortex_onnx_deadline_missed_total",
+       "Chat completions dropped because their deadline passed in the queue.",
+       &ModelMetrics::deadline_missed_total},
+      {"cortex_onnx_generated_tokens_total", "Tokens generated.",
+       &ModelMetrics::generated_tokens_total},
+      {"cortex_onnx_embedding_cache_hits_total",
+       "Embedding inputs served from the cache.",
+       &ModelMetrics::embedding_cache_hits_total},
+      {"cortex_onnx_embedding_cache_misses_total",
+       "Embedding inputs that ran through the model.",
+       &ModelMetrics::embedding_cache_misses_total},
+      {"cortex_onnx_response_cache_hits_total",
+       "Chat completions replayed from the response cache.",
+       &ModelMetrics::response_cache_hits_total},
+      {"cortex_onnx_response_cache_misses_total",
+       "Cacheable chat completions that ran through the model.",
+       &ModelMetrics::response_cache_misses_total},
+      {"cortex_onnx_response_cache_coalesced_total",
+       "Chat completions that waited for an identical request in flight.",
+       &ModelMetrics::response_cache_coalesced_total},
+  };
+
+  std::vector<std::string> labels;
+  labels.reserve(models.size());
+  for (const auto& m : models) {
+    labels.push_back(ModelLabel(m.model_id));
+  }
+
+  std::string out;
+  for (const auto& family : kHistograms) {
+    AppendHeader(out, family.name, family.help, "histogram");
+    for (size_t i = 0; i < models.size(); i++) {
+      (models[i].metrics->*family.member).Render(out, family.name, labels[i]);
+    }
+  }
+  for (const auto& family : kCounters) {
+    AppendHeader(out, family.name, family.help, "counter");
+    for (size_t i = 0; i < models.size(); i++) {
+      out += family.name;
+      out += '{' + labels[i] + "} ";
+      out += std::to_string((models[i].metrics->*family.member).load());
+      out += '\n';
+    }
+  }
+  AppendHeader(out, "cortex_onnx_queued_requests",
+               "Requests waiting for a decode slot.", "gauge");
+  for (size_t i = 0; i < models.size(); i++) {
+    out += "cortex_onnx_queued_requests{" + labels[i] + "} " +
+           std::to_string(models[i].queued) + '\n';
+  }
+  AppendHeader(out, "cortex_onnx_active_requests",
+               "Requests being decoded.", "gauge");
+  for (size_t i = 0; i < models.size(); i++) {
+    out += "cortex_onnx_active_requests{" + labels[i] + "} " +
+           std::to_string(models[i].active) + '\n';
+  }
+  return out;
+}
+}  // namespace cortex_onnx
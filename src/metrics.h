@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cortex_onnx {
+// Cumulative histogram with fixed bucket bounds. Observing only does atomic
+// adds, so the request path never takes a lock; a concurrent render may see an
+// observation in a bucket before it shows in the count.
+class Histogram {
+ public:
+  explicit Histogram(std::vector<double> bounds);
+
+  void Observe(double value);
+  // Appends the `_bucket`, `_sum` and `_count` series of `name`
+  void Render(std::string& out, const std::string& name,
+              const std::string& labels) const;
+
+ private:
+  std::vector<double> bounds_;
+  // One per bound, plus +Inf
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<uint64_t> count_ = 0;
+  std::atomic<double> sum_ = 0;
+};
+
+// Latency and throughput metrics of one model
+struct ModelMetrics {
+  ModelMetrics();
+
+  Histogram queue_depth;
+  Histogram queue_wait_seconds;
+  Histogram tokenize_seconds;
+  Histogram prefill_seconds;
+  Histogram time_to_first_token_seconds;
+  Histogram time_per_output_token_seconds;
+  Histogram e2e_seconds;
+  Histogram tokens_per_second;
+  std::atomic<uint64_t> requests_total = 0;
+  std::atomic<uint64_t> embedding_requests_total = 0;
+  std::atomic<uint64_t> errors_total = 0;
+  std::atomic<uint64_t> cancelled_total = 0;
+  std::atomic<uint64_t> rejected_total = 0;
+  std::atomic<uint64_t> deadline_missed_total = 0;
+  std::atomic<uint64_t> generated_tokens_total = 0;
+  std::atomic<uint64_t> embedding_cache_hits_total = 0;
+  std::atomic<uint64_t> embedding_cache_misses_total = 0;
+  std::atomic<uint64_t> response_cache_hits_total = 0;
+  std::atomic<uint64_t> response_cache_misses_total = 0;
+  std::atomic<uint64_t> response_cache_coalesced_total = 0;
+};
+
+// Point in time values of one model, rendered next to its metrics
+struct ModelSeries {
+  std::string model_id;
+  const ModelMetrics* metrics;
+  uint64_t queued;
+  uint64_t active;
+};
+
+// Prometheus text exposition format, one series per model
+std::string RenderMetrics(const std::vector<ModelSeries>& models);
+
+inline double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+}  // namespace cortex_onnx
@@ -0,0 +1,146 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "batch_scheduler.h"
+#include "chat_template.h"
+#include "embedding_model.h"
+#include "json/value.h"
+#include "kv_cache_accounting.h"
+#include "load_progress.h"
+#include "metrics.h"
+#include "model_instance.h"
+#include "prompt_cache.h"
+#include "response_cache.h"
+#include "token_count_cache.h"
+
+namespace cortex_onnx {
+// What a load derives from the model files to render and encode prompts.
+// Built in full before it is published, and swapped like the model instance:
+// requests keep the one they started with while a reload replaces it.
+struct PromptSetup {
+  ChatTemplate chat_template;
+  // Tokens the tokenizer prepends to every encoded text (e.g. BOS)
+  std::vector<int32_t> bos_tokens;
+  int context_length = 0;
+  int template_overhead_tokens = 0;
+  std::unique_ptr<TokenCountCache> token_counts;
+  std::unique_ptr<PromptCache> prompt_cache;
+  // Null unless enabled with `response_cache_bytes`. Shared with the requests
+  // generating a response, which may outlive a reload.
+  std::shared_ptr<ResponseCache> response_cache;
+};
+
+// A model registered with the engine under its model id, with its own
+// scheduler queue. An entry stays registered when the model is evicted to make
+// room for another one, and is loaded again from `load_params` on demand.
+struct ModelEntry {
+  std::string id;
+  // Body of the LoadModel request that registered the model
+  Json::Value load_params;
+  // Guarded by `instance_mtx`, see Path()
+  std::string path;
+  // Settings and measurements below are rewritten by loads while requests
+  // read them
+  std::atomic<int> n_parallel = 4;
+  // Limits of the requests waiting for a slot, 0 for no limit
+  std::atomic<size_t> max_queue_depth = 0;
+  std::atomic<uint64_t> max_queued_tokens = 0;
+  // Prompt tokens prefilled per scheduler iteration while others decode, 0
+  // for no limit
+  std::atomic<uint64_t> prefill_token_budget = 0;
+  // Size of the weight files, used as the resident memory estimate
+  std::atomic<uint64_t> weight_bytes = 0;
+  // Process growth measured while creating the session and during warm-up
+  std::atomic<uint64_t> resident_bytes = 0;
+  std::atomic<uint64_t> vram_bytes = 0;
+  std::atomic<uint64_t> arena_bytes = 0;
+  KvCacheAccounting kv_cache;
+  ModelMetrics metrics;
+
+  std::atomic<uint64_t> start_time = 0;
+
+  // Published by loads, read by requests on other threads
+  std::mutex instance_mtx;
+  // Null while the model is not resident. Embedding models have an
+  // `embedding` instead.
+  std::shared_ptr<ModelInstance> instance;
+  std::shared_ptr<const PromptSetup> prompt_setup;
+  std::shared_ptr<EmbeddingModel> embedding;
+  // Embedding cache key prefix: model id, weights and pooling options
+  std::string embedding_scope;
+  std::atomic<bool> loaded = false;
+  // steady_clock ticks of the last request routed to this model
+  std::atomic<int64_t> last_used = 0;
+
+  std::mutex load_mtx;
+  std::thread load_thread;
+  std::atomic<bool> loading = false;
+  std::shared_future<bool> load_result;
+  LoadProgress load_progress;
+
+  std::thread reload_thread;
+  std::atomic<bool> reloading = false;
+  // steady_clock ticks of the last background reload
+  std::atomic<int64_t> last_reload = 0;
+
+  // Declared last so that it is destroyed first, while the state its steps
+  // use is still alive
+  std::unique_ptr<BatchScheduler> scheduler;
+
+  ~ModelEntry() {
+    // Requests still queued get an error from their next step
+    loaded = false;
+    if (load_thread.joinable()) {
+      // The load thread drops the last reference to an entry it unregistered
+      if (load_thread.get_id() == std::this_thread::get_id()) {
+        load_thread.detach();
+      } else {
+        load_thread.join();
+      }
+    }
+    if (reload_thread.joinable()) {
+      reload_thread.join();
+    }
+  }
+
+  std::shared_ptr<ModelInstance> Instance() {
+    std::lock_guard<std::mutex> l(instance_mtx);
+    return instance;
+  }
+
+  std::shared_ptr<const PromptSetup> Prompts() {
+    std::lock_guard<std::mutex> l(instance_mtx);
+    return prompt_setup;
+  }
+
+  std::shared_ptr<EmbeddingModel> Embedding() {
+    std::lock_guard<std::mutex> l(instance_mtx);
+    return embedding;
+  }
+
+  std::string EmbeddingScope() {
+    std::lock_guard<std::mutex> l(instance_mtx);
+    return embedding_scope;
+  }
+
+  std::string Path() {
+    std::lock_guard<std::mutex> l(instance_mtx);
+    return path;
+  }
+
+  void Touch() {
+    last_used = std::chrono::steady_clock::now().time_since_epoch().count();
+  }
+
+  bool Busy() {
+    return scheduler != nullptr &&
+           (scheduler->ActiveCount() > 0 || scheduler->PendingCount() > 0);
+  }
+};
+}  // namespace cortex_onnx
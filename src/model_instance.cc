@@ -0,0 +1,65 @@
+#include "model_instance.h"
+#include <filesystem>
+#include "trantor/utils/Logger.h"
+
+namespace cortex_onnx {
+namespace {
+bool IsWeightFile(const std::filesystem::path& p) {
+  auto ext = p.extension().string();
+  return ext == ".onnx" || ext == ".data";
+}
+
+}  // namespace
+
+std::shared_ptr<ModelInstance> ModelInstance::Create(const std::string& path,
+                                                     size_t n_streams,
+                                                     LoadProgress* progress) {
+  auto instance = std::make_shared<ModelInstance>();
+  if (progress != nullptr) {
+    // GenAI reads the weights itself, they count as read once it returns
+    progress->bytes_total = WeightBytes(path);
+    progress->phase = LoadProgress::Phase::kCreatingSession;
+  }
+  LOG_INFO << "Creating model...";
+  instance->model = OgaModel::Create(path.c_str());
+  if (progress != nullptr) {
+    progress->bytes_read = progress->bytes_total.load();
+    progress->phase = LoadProgress::Phase::kCreatingTokenizer;
+  }
+  LOG_INFO << "Creating tokenizer...";
+  instance->tokenizer = OgaTokenizer::Create(*instance->model);
+  instance->stream_pool =
+      std::make_unique<TokenizerStreamPool>(*instance->tokenizer, n_streams);
+  return instance;
+}
+
+uint64_t ModelInstance::WeightBytes(const std::string& path) {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  uint64_t bytes = 0;
+  for (const auto& entry : fs::directory_iterator(path, ec)) {
+    if (entry.is_regular_file() && IsWeightFile(entry.path())) {
+      bytes += entry.file_size();
+    }
+  }
+  return bytes;
+}
+
+void ModelInstance::Warmup() {
+  auto input_ids = Encode("Hello");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", input_ids.size() + 1);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size(), 1);
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->ComputeLogits();
+  generator->GenerateNextToken();
+}
+
+std::vector<int32_t> ModelInstance::Encode(const std::string& text) const {
+  auto sequences = OgaSequences::Create();
+  tokenizer->Encode(text.c_str(), *sequences);
+  const auto* data = sequences->SequenceData(0);
+  return std::vector<int32_t>(data, data + sequences->SequenceCount(0));
+}
+
+}  // namespace cortex_onnx
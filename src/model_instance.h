@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "load_progress.h"
+#include "ort_genai.h"
+#include "tokenizer_stream_pool.h"
+
+namespace cortex_onnx {
+// A loaded model with its tokenizer. Requests hold the instance they started
+// on, so a replacement can be swapped in while they finish; the old instance
+// is released once the last of them drops it.
+struct ModelInstance {
+  std::unique_ptr<OgaModel> model;
+  std::unique_ptr<OgaTokenizer> tokenizer;
+  std::unique_ptr<TokenizerStreamPool> stream_pool;
+
+  // When `progress` is given, it follows the load phase by phase; the weight
+  // bytes count as read once the session is created.
+  static std::shared_ptr<ModelInstance> Create(
+      const std::string& path, size_t n_streams,
+      LoadProgress* progress = nullptr);
+  // Total size of the weight files in `path`
+  static uint64_t WeightBytes(const std::string& path);
+
+  // Generates a single token so that lazy session initialization is paid
+  // before the instance serves requests.
+  void Warmup();
+  std::vector<int32_t> Encode(const std::string& text) const;
+};
+}  // namespace cortex_onnx
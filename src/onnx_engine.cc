@@ -1,22 +1,44 @@
 #include "onnx_engine.h"
 #include <signal.h>
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <random>
 #include <thread>
 #include <vector>
 #include "chat_completion_request.h"
+#include "json/reader.h"
 #include "json/writer.h"
+#include "memory_stats.h"
 #include "trantor/utils/Logger.h"
 
 namespace cortex_onnx {
 namespace {
 constexpr const int k200OK = 200;
+constexpr const int k202Accepted = 202;
 constexpr const int k400BadRequest = 400;
+constexpr const int k404NotFound = 404;
 constexpr const int k409Conflict = 409;
+constexpr const int k429TooManyRequests = 429;
+constexpr const int k499ClientClosedRequest = 499;
 constexpr const int k500InternalServerError = 500;
+constexpr const int k504GatewayTimeout = 504;
+
+// A sequence decoding slower than this is taken as a sign of a broken
+// session, once it has decoded enough tokens to tell
+constexpr double kMinTokensPerSecond = 1.0;
+constexpr double kMinRateTokens = 16;
+// Between two background reloads of a model
+constexpr auto kReloadCooldown = std::chrono::minutes(5);
+// Stop strings per request, as the OpenAI API allows, and bytes per string.
+// Each byte of a stop string adds a 1 KiB node to the request's matcher.
+constexpr size_t kMaxStops = 4;
+constexpr size_t kMaxStopBytes = 256;
 
 Json::Value CreateFullReturnJson(const std::string& id,
                                  const std::string& model,
@@ -54,40 +76,12 @@ Json::Value CreateFullReturnJson(const std::string& id,
   return root;
 }
 
-std::string CreateReturnJson(const std::string& id, const std::string& model,
-                             const std::string& content,
-                             Json::Value finish_reason = Json::Value()) {
-  Json::Value root;
-
-  root["id"] = id;
-  root["model"] = model;
-  root["created"] = static_cast<int>(std::time(nullptr));
-  root["object"] = "chat.completion.chunk";
-
-  Json::Value choicesArray(Json::arrayValue);
-  Json::Value choice;
-
-  choice["index"] = 0;
-  Json::Value delta;
-  delta["content"] = content;
-  choice["delta"] = delta;
-  choice["finish_reason"] = finish_reason;
-
-  choicesArray.append(choice);
-  root["choices"] = choicesArray;
-
-  Json::StreamWriterBuilder writer;
-  writer["indentation"] = "";  // This sets the indentation to an empty string,
-                               // producing compact output.
-  return Json::writeString(writer, root);
-}
-
 std::string GenerateRandomString(std::size_t length) {
-  const std::string characters =
+  static constexpr std::string_view characters =
       "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
-  std::random_device rd;
-  std::mt19937 generator(rd());
+  // Seeded once per thread
+  thread_local std::mt19937 generator(std::random_device{}());
 
   std::uniform_int_distribution<> distribution(
       0, static_cast<int>(characters.size()) - 1);
@@ -118,28 +112,268 @@ inline std::string GetModelId(const Json::Value& json_body) {
   return {};
 }
 
+// genai_config.json of the model, null if missing or invalid
+Json::Value ReadGenaiConfig(const std::string& model_path) {
+  std::ifstream file(model_path + "/genai_config.json");
+  Json::Value config;
+  Json::CharReaderBuilder builder;
+  std::string errs;
+  if (!file.is_open() ||
+      !Json::parseFromStream(builder, file, &config, &errs)) {
+    return Json::Value();
+  }
+  return config;
+}
+
+// Context window, 0 if unknown
+int ReadContextLength(const Json::Value& config) {
+  auto context_length = config["model"].get("context_length", 0).asInt();
+  if (context_length <= 0) {
+    context_length = config["search"].get("max_length", 0).asInt();
+  }
+  return context_length;
+}
+
+// Key and value bytes one token adds to the KV cache, 0 if unknown. The cache
+// is fp16 on GPU providers and fp32 on CPU.
+uint64_t ReadKvBytesPerToken(const Json::Value& config) {
+  const auto& decoder = config["model"]["decoder"];
+  uint64_t layers = decoder.get("num_hidden_layers", 0).asUInt64();
+  uint64_t kv_heads = decoder.get("num_key_value_heads", 0).asUInt64();
+  uint64_t head_size = decoder.get("head_size", 0).asUInt64();
+  uint64_t dtype_bytes = 4;
+  for (const auto& options :
+       decoder["session_options"]["provider_options"]) {
+    if (options.isMember("dml") || options.isMember("cuda")) {
+      dtype_bytes = 2;
+    }
+  }
+  return 2 * layers * kv_heads * head_size * dtype_bytes;
+}
+
+uint64_t Delta(uint64_t before, uint64_t after) {
+  return after > before ? after - before : 0;
+}
+
+// Request fields that change the generated tokens, keying the response cache
+std::string GenerationParams(
+    const onnx::inferences::ChatCompletionRequest& req) {
+  return std::to_string(req.max_tokens) + '/' + std::to_string(req.top_p) +
+         '/' + std::to_string(req.temperature) + '/' +
+         std::to_string(req.frequency_penalty) + '/' +
+         std::to_string(req.presence_penalty) + '/' +
+         req.stop.toStyledString() + req.response_format.toStyledString();
+}
+
+// GenAI has no logits hook, only the CTRL repetition penalty, which divides
+// the logits of the tokens already in the sequence. Positive OpenAI
+// frequency and presence penalties are mapped onto it: their sum clamped to
+// the OpenAI maximum of 2 gives a divisor between 1 and 2. Negative ones,
+// which encourage repetition, are ignored.
+double RepetitionPenalty(const onnx::inferences::ChatCompletionRequest& req) {
+  auto penalty = std::max(req.frequency_penalty, 0.0f) +
+                 std::max(req.presence_penalty, 0.0f);
+  return 1.0 + std::min(penalty, 2.0f) / 2;
+}
+
+// `stop` is a string or an array of strings
+std::vector<std::string> StopStrings(const Json::Value& stop) {
+  std::vector<std::string> stops;
+  if (stop.isString()) {
+    stops.push_back(stop.asString());
+  } else if (stop.isArray()) {
+    for (const auto& s : stop) {
+      if (s.isString()) {
+        stops.push_back(s.asString());
+      }
+    }
+  }
+  return stops;
+}
+
+bool StopsWithinLimits(const std::vector<std::string>& stops) {
+  return stops.size() <= kMaxStops &&
+         std::all_of(stops.begin(), stops.end(), [](const std::string& s) {
+           return s.size() <= kMaxStopBytes;
+         });
+}
+
+// Whether `response_format` asks for JSON output. A `json_schema` is not
+// compiled, the output is only checked to be a JSON object.
+bool WantsJson(const Json::Value& response_format) {
+  auto type = response_format.get("type", "text").asString();
+  if (type == "json_schema") {
+    LOG_WARN << "json_schema is not enforced, checking for any JSON object";
+  }
+  return type == "json_object" || type == "json_schema";
+}
+
+// Runs the decoded text of a token through the stop strings and the JSON
+// check. `text` receives what may be sent. Returns true once generation must
+// end, with `finish_reason` set if it is not a plain stop. `done` tells that
+// this was the last token.
+bool FilterToken(std::string_view decoded, bool done,
+                 StopMatcher& stop_matcher, JsonValidator* json_validator,
+                 std::string& text, std::string& finish_reason) {
+  bool stopped = stop_matcher.Feed(decoded, text);
+  if (!stopped && done) {
+    stop_matcher.Flush(text);
+  }
+  if (json_validator == nullptr) {
+    return stopped;
+  }
+  size_t valid_bytes = 0;
+  auto result = json_validator->Feed(text, valid_bytes);
+  text.resize(valid_bytes);
+  if (result == JsonValidator::Result::kComplete) {
+    return true;
+  }
+  // Invalid, or cut short before the value closed
+  if (result == JsonValidator::Result::kInvalid || stopped || done) {
+    finish_reason = "invalid_json";
+    return true;
+  }
+  return false;
+}
+
+// True once the client of a request went away. A request generating a
+// cached response that identical requests wait for keeps going for them.
+bool IsCancelled(const CancellationRegistry::Token& cancelled,
+                 ResponseCache* response_cache,
+                 const ResponseCache::Key& response_key) {
+  return *cancelled && (response_cache == nullptr ||
+                        response_cache->AbandonIfUnwaited(response_key));
+}
+
+// Sends a cached response the way the request would have been answered by
+// the model: one chunk per token when streaming
+void ReplayResponse(
+    const ResponseCache::Response& response, bool stream,
+    const std::function<void(Json::Value&&, Json::Value&&)>& callback) {
+  auto id = GenerateRandomString(20);
+  if (!stream) {
+    std::string content;
+    for (const auto& piece : response.pieces) {
+      content += piece;
+    }
+    auto resp_data = CreateFullReturnJson(
+        id, "_", content, "_", response.prompt_tokens,
+        response.completion_tokens, response.finish_reason);
+    Json::Value status;
+    status["is_done"] = true;
+    status["has_error"] = false;
+    status["is_stream"] = false;
+    status["status_code"] = k200OK;
+    callback(std::move(status), std::move(resp_data));
+    return;
+  }
+  SseChunkWriter chunk_writer;
+  chunk_writer.Init(id, "_");
+  for (const auto& piece : response.pieces) {
+    Json::Value resp_data;
+    resp_data["data"] = chunk_writer.Write(piece);
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = false;
+    status["is_stream"] = true;
+    status["status_code"] = k200OK;
+    callback(std::move(status), std::move(resp_data));
+  }
+  Json::Value resp_data;
+  resp_data["data"] = chunk_writer.WriteDone(response.finish_reason);
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = false;
+  status["is_stream"] = true;
+  status["status_code"] = k200OK;
+  callback(std::move(status), std::move(resp_data));
+}
+
+Json::Value MemoryJson(ModelEntry& entry) {
+  auto process = GetProcessMemory();
+  auto kv = entry.kv_cache.GetStats();
+  Json::Value kv_cache;
+  kv_cache["bytes_per_token"] = Json::UInt64(kv.bytes_per_token);
+  kv_cache["in_use_bytes"] = Json::UInt64(kv.in_use_bytes);
+  kv_cache["peak_bytes"] = Json::UInt64(kv.peak_bytes);
+  kv_cache["max_request_peak_bytes"] = Json::UInt64(kv.max_request_peak_bytes);
+  Json::Value requests(Json::arrayValue);
+  for (const auto& r : kv.requests) {
+    Json::Value request;
+    request["id"] = r.id;
+    request["bytes"] = Json::UInt64(r.bytes);
+    request["peak_bytes"] = Json::UInt64(r.peak_bytes);
+    requests.append(request);
+  }
+  kv_cache["requests"] = requests;
+
+  Json::Value memory;
+  memory["weight_bytes"] = Json::UInt64(entry.weight_bytes);
+  memory["resident_bytes"] = Json::UInt64(entry.resident_bytes);
+  memory["vram_bytes"] = Json::UInt64(entry.vram_bytes);
+  memory["arena_bytes"] = Json::UInt64(entry.arena_bytes);
+  memory["kv_cache"] = kv_cache;
+  memory["process_rss_bytes"] = Json::UInt64(process.rss_bytes);
+  memory["process_vram_bytes"] = Json::UInt64(process.vram_bytes);
+  return memory;
+}
+
 }  // namespace
 
 OnnxEngine::OnnxEngine() {
   handle_ = std::make_unique<OgaHandle>();
 }
 
+OnnxEngine::~OnnxEngine() = default;
+
 void OnnxEngine::LoadModel(
     std::shared_ptr<Json::Value> json_body,
     std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
-  path_ = json_body->get("model_path", "").asString();
-  user_prompt_ = json_body->get("user_prompt", "USER: ").asString();
-  ai_prompt_ = json_body->get("ai_prompt", "ASSISTANT: ").asString();
-  system_prompt_ =
-      json_body->get("system_prompt", "ASSISTANT's RULE: ").asString();
-  pre_prompt_ = json_body->get("pre_prompt", "").asString();
-  max_history_chat_ = json_body->get("max_history_chat", 2).asInt();
-  try {
-    std::cout << "Creating model..." << std::endl;
-    oga_model_ = OgaModel::Create(path_.c_str());
-    std::cout << "Creating tokenizer..." << std::endl;
-    tokenizer_ = OgaTokenizer::Create(*oga_model_);
-    tokenizer_stream_ = OgaTokenizerStream::Create(*tokenizer_);
+  if (json_body->isMember("memory_budget_bytes")) {
+    memory_budget_bytes_ = (*json_body)["memory_budget_bytes"].asUInt64();
+  }
+  auto model_id = GetModelId(*json_body);
+  std::shared_ptr<ModelEntry> entry;
+  {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    auto& e = models_[model_id];
+    if (e == nullptr) {
+      e = std::make_shared<ModelEntry>();
+      e->id = model_id;
+    }
+    entry = e;
+  }
+  if (!StartLoad(*entry, json_body.get())) {
+    Json::Value json_resp;
+    json_resp["message"] = "A model is already being loaded";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k409Conflict;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+
+  // Async loads report their progress through GetModelStatus
+  if (json_body->get("async", false).asBool()) {
+    Json::Value json_resp;
+    json_resp["message"] = "Model is loading";
+    Json::Value status;
+    status["is_done"] = true;
+    status["has_error"] = false;
+    status["is_stream"] = false;
+    status["status_code"] = k202Accepted;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+
+  std::shared_future<bool> loaded;
+  {
+    std::lock_guard<std::mutex> l(entry->load_mtx);
+    loaded = entry->load_result;
+  }
+  if (loaded.get()) {
     Json::Value json_resp;
     json_resp["message"] = "Model loaded successfully";
     Json::Value status;
@@ -148,20 +382,7 @@ void OnnxEngine::LoadModel(
     status["is_stream"] = false;
     status["status_code"] = k200OK;
     callback(std::move(status), std::move(json_resp));
-    model_id_ = GetModelId(*json_body);
-    LOG_INFO << "Model loaded successfully: " << path_
-             << ", model_id: " << model_id_;
-    model_loaded_ = true;
-    start_time_ = std::chrono::system_clock::now().time_since_epoch() /
-                  std::chrono::milliseconds(1);
-    if (q_ == nullptr) {
-      q_ = std::make_unique<trantor::ConcurrentTaskQueue>(1, model_id_);
-    }
-  } catch (const std::exception& e) {
-    std::cout << "Failed to load model: " << e.what() << std::endl;
-    oga_model_.reset();
-    tokenizer_.reset();
-    tokenizer_stream_.reset();
+  } else {
     Json::Value json_resp;
     json_resp["message"] = "Failed to load model";
     Json::Value status;
@@ -173,288 +394,1419 @@ void OnnxEngine::LoadModel(
   }
 }
 
-void OnnxEngine::HandleChatCompletion(
-    std::shared_ptr<Json::Value> json_body,
-    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
-  if (!CheckModelLoaded(callback))
-    return;
-  auto req = onnx::inferences::fromJson(json_body);
-  auto is_stream = json_body->get("stream", false).asBool();
-
-  std::string formatted_output = pre_prompt_;
-
-  int history_max = max_history_chat_ * 2;  // both user and assistant
-  int index = 0;
-  for (const auto& message : req.messages) {
-    std::string input_role = message["role"].asString();
-    std::string role;
-    if (input_role == "user") {
-      role = user_prompt_;
-      std::string content = message["content"].asString();
-      if (index > static_cast<int>(req.messages.size()) - history_max) {
-        formatted_output += role + content;
-      }
-    } else if (input_role == "assistant") {
-      role = ai_prompt_;
-      std::string content = message["content"].asString();
-      if (index > static_cast<int>(req.messages.size()) - history_max) {
-        formatted_output += role + content;
-      }
-    } else if (input_role == "system") {
-      role = system_prompt_;
-      std::string content = message["content"].asString();
-      formatted_output = role + content + formatted_output;
-    } else {
-      role = input_role;
-      std::string content = message["content"].asString();
-      formatted_output += role + content;
-      LOG_WARN << "Should specify input_role";
+std::shared_ptr<ModelEntry> OnnxEngine::FindModel(
+    const std::string& model_id,
+    std::function<void(Json::Value&&, Json::Value&&)>& callback) {
+  {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    auto it = models_.find(model_id);
+    if (it != models_.end()) {
+      return it->second;
+    }
+    if (models_.size() == 1) {
+      return models_.begin()->second;
     }
-    index++;
   }
-  formatted_output += ai_prompt_;
+  LOG_WARN << "Error: model is not loaded yet: " << model_id;
+  Json::Value json_resp;
+  json_resp["message"] =
+      "Model has not been loaded, please load model into cortex.onnx";
+  Json::Value status;
+  status["is_done"] = false;
+  status["has_error"] = true;
+  status["is_stream"] = false;
+  status["status_code"] = k409Conflict;
+  callback(std::move(status), std::move(json_resp));
+  return nullptr;
+}
 
-  // LOG_DEBUG << formatted_output;
-  q_->runTaskInQueue([this, cb = std::move(callback),
-                      fo = std::move(formatted_output), req] {
-    try {
-      if (req.stream) {
-        auto sequences = OgaSequences::Create();
-        tokenizer_->Encode(fo.c_str(), *sequences);
-
-        auto params = OgaGeneratorParams::Create(*oga_model_);
-        // TODO(sang)
-        params->SetSearchOption("max_length", req.max_tokens);
-        params->SetSearchOption("top_p", req.top_p);
-        params->SetSearchOption("temperature", req.temperature);
-        // params->SetSearchOption("repetition_penalty", 0.95);
-        params->SetInputSequences(*sequences);
-
-        auto generator = OgaGenerator::Create(*oga_model_, *params);
-        auto start = std::chrono::system_clock::now();
-        double generated_tokens = 0;
-        while (!generator->IsDone() && model_loaded_) {
-          generator->ComputeLogits();
-          generator->GenerateNextToken();
-
-          const int32_t num_tokens = generator->GetSequenceCount(0);
-          int32_t new_token = generator->GetSequenceData(0)[num_tokens - 1];
-          auto out_string = tokenizer_stream_->Decode(new_token);
-          // std::cout << out_string;
-          const std::string str =
-              "data: " +
-              CreateReturnJson(GenerateRandomString(20), "_", out_string) +
-              "\n\n";
-          Json::Value resp_data;
-          resp_data["data"] = str;
-          Json::Value status;
-          status["is_done"] = false;
-          status["has_error"] = false;
-          status["is_stream"] = true;
-          status["status_code"] = k200OK;
-          cb(std::move(status), std::move(resp_data));
-          generated_tokens++;
+bool OnnxEngine::StartLoad(ModelEntry& entry,
+                           const Json::Value* load_params) {
+  std::lock_guard<std::mutex> l(entry.load_mtx);
+  if (entry.loading) {
+    return false;
+  }
+  auto previous_params = entry.load_params;
+  if (load_params != nullptr) {
+    entry.load_params = *load_params;
+  }
+  if (entry.load_thread.joinable()) {
+    entry.load_thread.join();
+  }
+  entry.loading = true;
+  entry.load_progress.Start();
+  auto done = std::make_shared<std::promise<bool>>();
+  entry.load_result = done->get_future().share();
+  entry.load_thread = std::thread(
+      [this, &entry, done, previous_params = std::move(previous_params)] {
+        auto ok = LoadModelImpl(entry);
+        // Keeps an unregistered entry alive until the thread is done with it
+        std::shared_ptr<ModelEntry> unregistered;
+        if (!ok) {
+          unregistered = RollBackLoad(entry, previous_params);
         }
+        entry.loading = false;
+        done->set_value(ok);
+      });
+  return true;
+}
 
-        if (!model_loaded_) {
-          LOG_WARN << "Model unloaded during inference";
-          Json::Value respData;
-          respData["data"] = std::string();
-          Json::Value status;
-          status["is_done"] = false;
-          status["has_error"] = true;
-          status["is_stream"] = true;
-          status["status_code"] = k200OK;
-          cb(std::move(status), std::move(respData));
-          return;
-        }
-        auto end = std::chrono::system_clock::now();
-        auto duration_ms =
-            std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
-                .count();
-        std::cout << "Generated tokens per second: "
-                 << generated_tokens / duration_ms * 1000 << std::endl;
-        if ((generated_tokens / duration_ms * 1000) < 1.0f) {
-          max_history_chat_ = std::max(1, max_history_chat_ / 2);
-          tokenizer_stream_.reset();
-          tokenizer_.reset();
-          oga_model_.reset();
-          generator.reset();
-          params.reset();
-          sequences.reset();
-          model_loaded_ = false;          
-          LOG_WARN << "Something wrong happened, restart model and try again";
-          LOG_INFO << "Creating model...";
-          oga_model_ = OgaModel::Create(path_.c_str());
-          LOG_INFO << "Creating tokenizer...";
-          tokenizer_ = OgaTokenizer::Create(*oga_model_);
-          tokenizer_stream_ = OgaTokenizerStream::Create(*tokenizer_);
-          LOG_INFO << "Model loaded successfully: " << path_
-                   << ", model_id: " << model_id_;
-          model_loaded_ = true;
-          start_time_ = std::chrono::system_clock::now().time_since_epoch() /
-                        std::chrono::milliseconds(1);
-          if (q_ == nullptr) {
-            q_ = std::make_unique<trantor::ConcurrentTaskQueue>(1, model_id_);
-          }
-        }
+std::shared_ptr<ModelEntry> OnnxEngine::RollBackLoad(
+    ModelEntry& entry, const Json::Value& previous_params) {
+  if (entry.start_time != 0) {
+    // Loaded before: it keeps serving, or is loaded again on demand, with the
+    // parameters that worked
+    std::lock_guard<std::mutex> l(entry.load_mtx);
+    entry.load_params = previous_params;
+    return nullptr;
+  }
+  // Never loaded: requests must not be routed to it, nor the lone-model
+  // fallback of FindModel blocked by it
+  std::lock_guard<std::mutex> l(models_mtx_);
+  auto it = models_.find(entry.id);
+  if (it == models_.end() || it->second.get() != &entry) {
+    return nullptr;
+  }
+  auto unregistered = std::move(it->second);
+  models_.erase(it);
+  return unregistered;
+}
 
-        LOG_INFO << "End of result";
-        Json::Value resp_data;
-        const std::string str =
-            "data: " +
-            CreateReturnJson(GenerateRandomString(20), "_", "", "stop") +
-            "\n\n" + "data: [DONE]" + "\n\n";
-        resp_data["data"] = str;
-        Json::Value status;
-        status["is_done"] = true;
-        status["has_error"] = false;
-        status["is_stream"] = true;
-        status["status_code"] = k200OK;
-        cb(std::move(status), std::move(resp_data));
+bool OnnxEngine::EnsureLoaded(ModelEntry& entry) {
+  if (entry.loaded) {
+    return true;
+  }
+  // Evicted models are idle, a failed load is not retried implicitly
+  if (!entry.loading &&
+      entry.load_progress.phase == LoadProgress::Phase::kIdle) {
+    LOG_INFO << "Loading evicted model on demand: " << entry.id;
+    StartLoad(entry);
+  }
+  std::shared_future<bool> loaded;
+  {
+    std::lock_guard<std::mutex> l(entry.load_mtx);
+    loaded = entry.load_result;
+  }
+  return loaded.valid() && loaded.get() && entry.loaded;
+}
 
-      } else {
-        auto sequences = OgaSequences::Create();
-        tokenizer_->Encode(fo.c_str(), *sequences);
-
-        auto params = OgaGeneratorParams::Create(*oga_model_);
-        params->SetSearchOption("max_length", req.max_tokens);
-        params->SetSearchOption("top_p", req.top_p);
-        params->SetSearchOption("temperature", req.temperature);
-        // params->SetSearchOption("repetition_penalty", req.frequency_penalty);
-        params->SetInputSequences(*sequences);
-
-        auto start = std::chrono::system_clock::now();
-        auto output_sequences = oga_model_->Generate(*params);
-        const auto output_sequence_length =
-            output_sequences->SequenceCount(0) - sequences->SequenceCount(0);
-        const auto* output_sequence_data =
-            output_sequences->SequenceData(0) + sequences->SequenceCount(0);
-        auto out_string =
-            tokenizer_->Decode(output_sequence_data, output_sequence_length);
-
-        // std::cout << "Output: " << std::endl << out_string << std::endl;
-        auto end = std::chrono::system_clock::now();
-        auto duration_ms =
-            std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
-                .count();
-        LOG_DEBUG << "Generated tokens per second: "
-                  << static_cast<double>(output_sequence_length) / duration_ms *
-                         1000;
-
-        std::string to_send = out_string.p_;
-        auto resp_data = CreateFullReturnJson(GenerateRandomString(20), "_",
-                                              to_send, "_", 0, 0);
-        Json::Value status;
-        status["is_done"] = true;
-        status["has_error"] = false;
-        status["is_stream"] = false;
-        status["status_code"] = k200OK;
-        cb(std::move(status), std::move(resp_data));        
-      }
-    } catch (const std::exception& e) {
-      tokenizer_stream_.reset();
-      tokenizer_.reset();
-      oga_model_.reset();
-      std::cout << "Error during inference: " << e.what() << std::endl;
-      Json::Value json_resp;
-      json_resp["message"] = "Error during inference";
-      Json::Value status;
-      status["is_done"] = false;
-      status["has_error"] = true;
-      status["is_stream"] = false;
-      status["status_code"] = k500InternalServerError;
-      cb(std::move(status), std::move(json_resp));
+bool OnnxEngine::LoadModelImpl(ModelEntry& entry) {
+  const auto& json_body = entry.load_params;
+  auto path = json_body.get("model_path", "").asString();
+  if (json_body.get("embedding", false).asBool()) {
+    return LoadEmbeddingModel(entry, path);
+  }
+  auto user_prompt = json_body.get("user_prompt", "USER: ").asString();
+  auto ai_prompt = json_body.get("ai_prompt", "ASSISTANT: ").asString();
+  auto system_prompt =
+      json_body.get("system_prompt", "ASSISTANT's RULE: ").asString();
+  auto pre_prompt = json_body.get("pre_prompt", "").asString();
+  // Prompts given in the request take precedence over the model's template
+  bool has_prompts = json_body.isMember("user_prompt") ||
+                     json_body.isMember("ai_prompt") ||
+                     json_body.isMember("system_prompt");
+  auto n_parallel = json_body.get("n_parallel", 4).asInt();
+  // Verifying draft tokens needs the target logits of several positions and
+  // a KV-cache rewind, which the GenAI generator does not expose
+  if (json_body.isMember("draft_model_path")) {
+    LOG_WARN << "Speculative decoding is not supported by this engine, "
+                "draft_model_path is ignored";
+  }
+  // A failed reload leaves the model as it was
+  const auto previous_weight_bytes = entry.weight_bytes.load();
+  try {
+    entry.weight_bytes = ModelInstance::WeightBytes(path);
+    MakeRoom(entry);
+    // Measured as the growth of the process, so concurrent loads and
+    // requests blur the numbers
+    auto before = GetProcessMemory();
+    auto model = ModelInstance::Create(path, n_parallel, &entry.load_progress);
+    auto created = GetProcessMemory();
+    // Requests may still be using the current setup, the new one is only
+    // published with the new instance
+    auto setup = std::make_shared<PromptSetup>();
+    setup->bos_tokens = model->Encode("");
+    if (has_prompts ||
+        !ChatTemplate::FromModelPath(path, pre_prompt,
+                                     setup->bos_tokens.empty(),
+                                     setup->chat_template)) {
+      setup->chat_template = ChatTemplate::FromPrompts(
+          system_prompt, user_prompt, ai_prompt, pre_prompt);
     }
-  });
+    LOG_INFO << "Chat template: " << setup->chat_template.name();
+    auto genai_config = ReadGenaiConfig(path);
+    setup->context_length = ReadContextLength(genai_config);
+    setup->token_counts = std::make_unique<TokenCountCache>(8192);
+    setup->template_overhead_tokens = static_cast<int>(
+        model->Encode(setup->chat_template.Overhead()).size());
+    LOG_INFO << "Context length: " << setup->context_length;
+    setup->prompt_cache = std::make_unique<PromptCache>(
+        json_body.get("prompt_cache_bytes", 64 * 1024 * 1024).asUInt64());
+    auto response_cache_bytes =
+        json_body.get("response_cache_bytes", 0).asUInt64();
+    if (response_cache_bytes > 0) {
+      setup->response_cache =
+          std::make_shared<ResponseCache>(response_cache_bytes);
+    }
+
+    entry.load_progress.phase = LoadProgress::Phase::kWarmingUp;
+    model->Warmup();
+    // The first run is where ORT sizes its memory arena, on the device the
+    // session lives on
+    auto warm = GetProcessMemory();
+    {
+      std::lock_guard<std::mutex> l(entry.instance_mtx);
+      entry.path = path;
+      entry.instance = std::move(model);
+      entry.prompt_setup = std::move(setup);
+      entry.embedding.reset();
+    }
+    entry.n_parallel = n_parallel;
+    entry.max_queue_depth = json_body.get("max_queue_depth", 0).asUInt64();
+    entry.max_queued_tokens = json_body.get("max_queued_tokens", 0).asUInt64();
+    entry.prefill_token_budget =
+        json_body.get("prefill_token_budget", 0).asUInt64();
+    entry.resident_bytes = Delta(before.rss_bytes, created.rss_bytes);
+    entry.vram_bytes = Delta(before.vram_bytes, created.vram_bytes);
+    entry.arena_bytes = entry.vram_bytes > 0
+                            ? Delta(created.vram_bytes, warm.vram_bytes)
+                            : Delta(created.rss_bytes, warm.rss_bytes);
+    entry.kv_cache.Configure(
+        ReadKvBytesPerToken(genai_config),
+        genai_config["search"].get("past_present_share_buffer", true)
+            .asBool());
+    LOG_INFO << "Model loaded successfully: " << path
+             << ", model_id: " << entry.id << ", took "
+             << entry.load_progress.ElapsedMs() << " ms";
+    entry.start_time = std::chrono::system_clock::now().time_since_epoch() /
+                       std::chrono::milliseconds(1);
+    if (entry.scheduler == nullptr) {
+      entry.scheduler = std::make_unique<BatchScheduler>(
+          entry.n_parallel,
+          [this, &entry](InferenceState& s) { return StepSequence(entry, s); },
+          [this, &entry](InferenceState& s) {
+            return ExpireSequence(entry, s);
+          },
+          entry.id);
+    } else {
+      entry.scheduler->SetMaxActive(entry.n_parallel);
+    }
+    entry.scheduler->SetPrefillBudget(entry.prefill_token_budget);
+    entry.Touch();
+    entry.loaded = true;
+    entry.load_progress.Finish();
+    return true;
+  } catch (const std::exception& e) {
+    LOG_ERROR << "Failed to load model: " << e.what();
+    entry.weight_bytes = previous_weight_bytes;
+    entry.load_progress.Fail(e.what());
+    return false;
+  }
 }
 
-void OnnxEngine::HandleEmbedding(
-    std::shared_ptr<Json::Value> json_body,
-    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
-  LOG_WARN << "Engine does not support embedding yet";
+bool OnnxEngine::LoadEmbeddingModel(ModelEntry& entry,
+                                    const std::string& path) {
+  const auto& json_body = entry.load_params;
+  EmbeddingModel::Options options;
+  if (json_body.get("pooling", "mean").asString() == "cls") {
+    options.pooling = EmbeddingModel::Pooling::kCls;
+  }
+  options.normalize = json_body.get("normalize", true).asBool();
+  options.max_length = json_body.get("max_sequence_length", 512).asUInt();
+  options.batch_size = json_body.get("embedding_batch_size", 32).asUInt();
+  // Cached vectors are only valid for the same weights and pooling
+  auto embedding_scope =
+      entry.id + '\n' + path + '\n' +
+      json_body.get("pooling", "mean").asString() +
+      (options.normalize ? "/l2/" : "/raw/") +
+      std::to_string(options.max_length);
+  {
+    std::lock_guard<std::mutex> l(embedding_cache_mtx_);
+    auto budget =
+        json_body.get("embedding_cache_bytes", 64 * 1024 * 1024).asUInt64();
+    auto path = json_body.get("embedding_cache_path", "").asString();
+    auto disk_budget =
+        json_body.get("embedding_cache_disk_bytes", 1024 * 1024 * 1024)
+            .asUInt64();
+    if (embedding_cache_ == nullptr && (budget > 0 || !path.empty())) {
+      embedding_cache_ =
+          std::make_shared<EmbeddingCache>(budget, path, disk_budget);
+    }
+  }
+  const auto previous_weight_bytes = entry.weight_bytes.load();
+  try {
+    entry.weight_bytes = ModelInstance::WeightBytes(path) +
+                         ModelInstance::WeightBytes(path + "/onnx");
+    entry.load_progress.bytes_total = entry.weight_bytes.load();
+    MakeRoom(entry);
+    auto before = GetProcessMemory();
+    std::shared_ptr<EmbeddingModel> model =
+        EmbeddingModel::Create(path, options, &entry.load_progress);
+    auto created = GetProcessMemory();
+    {
+      std::lock_guard<std::mutex> l(entry.instance_mtx);
+      entry.path = path;
+      entry.embedding = std::move(model);
+      entry.embedding_scope = std::move(embedding_scope);
+      entry.instance.reset();
+      entry.prompt_setup.reset();
+    }
+    entry.resident_bytes = Delta(before.rss_bytes, created.rss_bytes);
+    LOG_INFO << "Embedding model loaded successfully: " << path
+             << ", model_id: " << entry.id << ", took "
+             << entry.load_progress.ElapsedMs() << " ms";
+    entry.start_time = std::chrono::system_clock::now().time_since_epoch() /
+                       std::chrono::milliseconds(1);
+    entry.Touch();
+    entry.loaded = true;
+    entry.load_progress.Finish();
+    return true;
+  } catch (const std::exception& e) {
+    LOG_ERROR << "Failed to load embedding model: " << e.what();
+    entry.weight_bytes = previous_weight_bytes;
+    entry.load_progress.Fail(e.what());
+    return false;
+  }
 }
 
-void OnnxEngine::UnloadModel(
-    std::shared_ptr<Json::Value> json_body,
-    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
-  if (!CheckModelLoaded(callback))
+void OnnxEngine::MakeRoom(const ModelEntry& incoming) {
+  auto budget = memory_budget_bytes_.load();
+  if (budget == 0) {
     return;
-  oga_model_.reset();
-  tokenizer_.reset();
-  tokenizer_stream_.reset();
-  model_loaded_ = false;
+  }
+  std::lock_guard<std::mutex> residency(residency_mtx_);
+  uint64_t used = incoming.weight_bytes;
+  std::vector<std::shared_ptr<ModelEntry>> resident;
+  {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    for (const auto& [id, e] : models_) {
+      if (e.get() == &incoming || !(e->loaded || e->loading)) {
+        continue;
+      }
+      used += e->weight_bytes * (e->reloading ? 2 : 1);
+      if (e->loaded) {
+        resident.push_back(e);
+      }
+    }
+  }
+  std::sort(resident.begin(), resident.end(),
+            [](const auto& a, const auto& b) {
+              return a->last_used < b->last_used;
+            });
+  for (const auto& e : resident) {
+    if (used <= budget) {
+      break;
+    }
+    if (e->Busy()) {
+      continue;
+    }
+    LOG_INFO << "Evicting model " << e->id << " to load " << incoming.id;
+    Evict(*e);
+    used -= e->weight_bytes;
+  }
+  if (used > budget) {
+    LOG_WARN << "Loading " << incoming.id << " exceeds the memory budget: "
+             << used << " > " << budget << " bytes";
+  }
+}
 
-  Json::Value json_resp;
-  json_resp["message"] = "Model unloaded successfully";
-  Json::Value status;
-  status["is_done"] = true;
-  status["has_error"] = false;
-  status["is_stream"] = false;
-  status["status_code"] = k200OK;
-  callback(std::move(status), std::move(json_resp));
-  LOG_INFO << "Model unloaded sucessfully";
+uint64_t OnnxEngine::ResidentBytes() {
+  uint64_t used = 0;
+  std::lock_guard<std::mutex> l(models_mtx_);
+  for (const auto& [id, e] : models_) {
+    if (e->loaded || e->loading) {
+      used += e->weight_bytes * (e->reloading ? 2 : 1);
+    }
+  }
+  return used;
 }
-void OnnxEngine::GetModelStatus(
-    std::shared_ptr<Json::Value> json_body,
-    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
-  Json::Value json_resp;
-  json_resp["message"] = "Engine does not support get model status method yet";
-  Json::Value status;
-  status["is_done"] = false;
-  status["has_error"] = true;
-  status["is_stream"] = false;
-  status["status_code"] = k409Conflict;
-  callback(std::move(status), std::move(json_resp));
-  LOG_WARN << "Engine does not support get model status method yet";
+
+void OnnxEngine::Evict(ModelEntry& entry) {
+  entry.loaded = false;
+  entry.load_progress.phase = LoadProgress::Phase::kIdle;
+  std::lock_guard<std::mutex> l(entry.instance_mtx);
+  entry.instance.reset();
+  entry.prompt_setup.reset();
+  entry.embedding.reset();
 }
 
-// API to get running models.
-void OnnxEngine::GetModels(
+void OnnxEngine::HandleChatCompletion(
     std::shared_ptr<Json::Value> json_body,
     std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
-  Json::Value json_resp;
-  Json::Value model_array = Json::arrayValue;
-
-  if (model_loaded_) {
-    Json::Value val;
-    val["id"] = model_id_;
-    val["engine"] = "cortex.onnx";
-    val["start_time"] = start_time_;
-    val["vram"] = "-";
-    val["ram"] = "-";
-    val["object"] = "model";
-    model_array.append(val);
+  auto arrived = std::chrono::steady_clock::now();
+  auto req = onnx::inferences::fromJson(json_body);
+  auto stops = StopStrings(req.stop);
+  if (!StopsWithinLimits(stops)) {
+    Json::Value json_resp;
+    json_resp["message"] = "At most " + std::to_string(kMaxStops) +
+                           " stop strings of up to " +
+                           std::to_string(kMaxStopBytes) + " bytes each";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(json_resp));
+    return;
   }
-
-  json_resp["object"] = "list";
-  json_resp["data"] = model_array;
-
-  Json::Value status;
-  status["is_done"] = true;
-  status["has_error"] = false;
-  status["is_stream"] = false;
-  status["status_code"] = k200OK;
-  callback(std::move(status), std::move(json_resp));
-  LOG_INFO << "Running models responded";
-}
-
-bool OnnxEngine::CheckModelLoaded(
-    std::function<void(Json::Value&&, Json::Value&&)>& callback) {
-  if (!model_loaded_) {
-    LOG_WARN << "Error: model is not loaded yet";
+  auto cancelled =
+      cancellations_.Register(json_body->get("request_id", "").asString());
+  if (cancelled == nullptr) {
     Json::Value json_resp;
-    json_resp["message"] =
-        "Model has not been loaded, please load model into cortex.onnx";
+    json_resp["message"] = "A request with this request_id is still running";
     Json::Value status;
     status["is_done"] = false;
     status["has_error"] = true;
     status["is_stream"] = false;
     status["status_code"] = k409Conflict;
     callback(std::move(status), std::move(json_resp));
-    return false;
+    return;
   }
-  return true;
+  // The caller wants a first reply with the queue position once queued
+  auto report_queue = json_body->get("report_queue", false).asBool();
+  // Same limitation as draft_model_path: no multi-token verification
+  if (json_body->isMember("speculative")) {
+    LOG_WARN << "Prompt-lookup speculative decoding is not supported, "
+                "decoding one token per step";
+  }
+  // Needs the logits between ComputeLogits and GenerateNextToken
+  if (json_body->isMember("logit_bias")) {
+    LOG_WARN << "logit_bias is not supported and is ignored";
+  }
+  auto entry = FindModel(req.model_id, callback);
+  if (entry == nullptr)
+    return;
+  if (!EnsureLoaded(*entry)) {
+    Json::Value json_resp;
+    json_resp["message"] = "Failed to load model";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k500InternalServerError;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  if (entry->Embedding() != nullptr) {
+    Json::Value json_resp;
+    json_resp["message"] = "Model was loaded for embeddings";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  auto model = entry->Instance();
+  auto setup = entry->Prompts();
+  if (model == nullptr || setup == nullptr) {
+    // Unloaded since it was loaded above
+    Json::Value json_resp;
+    json_resp["message"] = "Model has been unloaded";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k409Conflict;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  auto is_stream = json_body->get("stream", false).asBool();
+
+  std::vector<const Json::Value*> messages;
+  for (const auto& message : req.messages) {
+    std::string input_role = message["role"].asString();
+    if (input_role != "user" && input_role != "assistant" &&
+        input_role != "system") {
+      LOG_WARN << "Should specify input_role";
+    }
+    messages.push_back(&message);
+  }
+  int prompt_tokens = 0;
+  if (!FitContext(*setup, *model, req.max_tokens, messages, prompt_tokens)) {
+    Json::Value json_resp;
+    json_resp["message"] = "Prompt does not fit in the model context window";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+
+  std::string formatted_output;
+  std::vector<size_t> segment_ends;
+  setup->chat_template.Render(messages, formatted_output, segment_ends);
+
+  // Only greedy decoding gives the same answer every time
+  std::shared_ptr<ResponseCache> response_cache;
+  ResponseCache::Key response_key{};
+  if (setup->response_cache != nullptr && req.temperature <= 0) {
+    response_key =
+        ResponseCache::MakeKey(formatted_output, GenerationParams(req));
+    std::shared_ptr<const ResponseCache::Response> cached;
+    auto lookup = setup->response_cache->Acquire(
+        response_key, cached,
+        [callback, stream = req.stream](
+            std::shared_ptr<const ResponseCache::Response> response,
+            const ResponseCache::Failure& failure) {
+          if (response != nullptr) {
+            ReplayResponse(*response, stream, callback);
+            return;
+          }
+          // Nothing was sent to this client yet, answer as the request it
+          // waited for was answered
+          Json::Value json_resp;
+          json_resp["message"] = failure.message;
+          Json::Value status;
+          status["is_done"] = false;
+          status["has_error"] = true;
+          status["is_stream"] = false;
+          status["status_code"] = failure.status_code;
+          if (failure.retry_after_s > 0) {
+            status["retry_after_s"] = failure.retry_after_s;
+          }
+          callback(std::move(status), std::move(json_resp));
+        });
+    if (lookup == ResponseCache::Lookup::kLead) {
+      entry->metrics.response_cache_misses_total++;
+      response_cache = setup->response_cache;
+    } else {
+      entry->Touch();
+      entry->metrics.requests_total++;
+      if (lookup == ResponseCache::Lookup::kJoined) {
+        // Answered when the identical request in flight completes
+        entry->metrics.response_cache_coalesced_total++;
+        return;
+      }
+      entry->metrics.response_cache_hits_total++;
+      ReplayResponse(*cached, req.stream, callback);
+      entry->metrics.e2e_seconds.Observe(SecondsSince(arrived));
+      return;
+    }
+  }
+
+  // Queued under the residency lock, so the model cannot be evicted until
+  // the request is done
+  std::lock_guard<std::mutex> residency(residency_mtx_);
+  if (!entry->loaded) {
+    if (response_cache != nullptr) {
+      response_cache->Abandon(response_key,
+                              {k409Conflict, "Model has been unloaded"});
+    }
+    Json::Value json_resp;
+    json_resp["message"] = "Model has been unloaded";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k409Conflict;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  entry->Touch();
+  entry->metrics.requests_total++;
+  entry->metrics.queue_depth.Observe(
+      static_cast<double>(entry->scheduler->PendingCount()));
+  // LOG_DEBUG << formatted_output;
+  // Streaming or not, requests are stepped by the scheduler; non-streaming
+  // ones buffer their output
+  auto state = std::make_shared<InferenceState>();
+  state->req = std::move(req);
+  state->callback = std::move(callback);
+  state->cancelled = std::move(cancelled);
+  state->prompt_setup = std::move(setup);
+  state->prompt = std::move(formatted_output);
+  state->segment_ends = std::move(segment_ends);
+  state->response_cache = std::move(response_cache);
+  state->response_key = std::move(response_key);
+  state->stop_matcher = StopMatcher(stops);
+  if (WantsJson(state->req.response_format)) {
+    state->json_validator = std::make_unique<JsonValidator>();
+  }
+  state->arrived = arrived;
+  state->enqueued = std::chrono::steady_clock::now();
+  if (state->req.deadline_ms > 0) {
+    state->deadline =
+        arrived + std::chrono::milliseconds(state->req.deadline_ms);
+  }
+  // Without a context window there is no token count, about 4 bytes a token
+  state->prompt_tokens =
+      prompt_tokens > 0 ? prompt_tokens : state->prompt.size() / 4;
+  state->queued_tokens =
+      state->prompt_tokens + std::max(state->req.max_tokens, 0);
+  // Admitted and queued under the residency lock, like every request
+  auto admission = entry->scheduler->Admit(*state, entry->max_queue_depth,
+                                           entry->max_queued_tokens);
+  if (!admission.admitted) {
+    // Rejected before any prefill was spent on it
+    LOG_WARN << "Queue of " << entry->id << " is full, rejecting request";
+    entry->metrics.rejected_total++;
+    // Until the requests queued now are decoded, at least a second
+    auto retry_after = std::max(1.0, std::ceil(admission.estimated_wait_s));
+    if (state->response_cache != nullptr) {
+      state->response_cache->Abandon(
+          state->response_key, {k429TooManyRequests,
+                                "Too many requests queued, retry later",
+                                static_cast<int>(retry_after)});
+    }
+    Json::Value json_resp;
+    json_resp["message"] = "Too many requests queued, retry later";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k429TooManyRequests;
+    status["retry_after_s"] = static_cast<int>(retry_after);
+    state->callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  if (report_queue) {
+    Json::Value json_resp;
+    json_resp["queue_position"] = Json::UInt64(admission.position);
+    if (admission.estimated_wait_s >= 0) {
+      json_resp["estimated_wait_ms"] =
+          Json::Int64(admission.estimated_wait_s * 1000);
+    }
+    Json::Value status;
+    status["is_queued"] = true;
+    status["is_done"] = false;
+    status["has_error"] = false;
+    status["is_stream"] = state->req.stream;
+    status["status_code"] = k202Accepted;
+    state->callback(std::move(status), std::move(json_resp));
+  }
+  entry->scheduler->Enqueue(std::move(state));
+}
+
+bool OnnxEngine::FitContext(const PromptSetup& setup,
+                            const ModelInstance& model,
+                            int max_tokens,
+                            std::vector<const Json::Value*>& messages,
+                            int& prompt_tokens) {
+  prompt_tokens = 0;
+  if (setup.context_length <= 0) {
+    return true;
+  }
+  std::vector<int> counts;
+  counts.reserve(messages.size());
+  int total = setup.template_overhead_tokens;
+  std::string rendered;
+  for (const auto* message : messages) {
+    setup.chat_template.RenderMessage(*message, rendered);
+    counts.push_back(CountTokens(setup, model, rendered));
+    total += counts.back();
+  }
+
+  // Drop the oldest turns until the prompt leaves room for `max_tokens`.
+  // System messages and the latest message are always kept.
+  const int budget = setup.context_length - max_tokens;
+  std::vector<const Json::Value*> kept;
+  kept.reserve(messages.size());
+  for (size_t i = 0; i < messages.size(); i++) {
+    if (total > budget && i + 1 < messages.size() &&
+        (*messages[i])["role"].asString() != "system") {
+      total -= counts[i];
+      continue;
+    }
+    kept.push_back(messages[i]);
+  }
+  if (kept.size() < messages.size()) {
+    LOG_DEBUG << "Dropped " << messages.size() - kept.size()
+              << " messages to fit " << total << " prompt tokens";
+  }
+  messages = std::move(kept);
+  prompt_tokens = total;
+  // The prompt alone must fit, a shorter answer is acceptable
+  return total < setup.context_length;
+}
+
+int OnnxEngine::CountTokens(const PromptSetup& setup,
+                            const ModelInstance& model,
+                            const std::string& text) {
+  auto key = Fnv1a(text.data(), text.size());
+  int count = 0;
+  if (!setup.token_counts->Get(key, count)) {
+    count = static_cast<int>(EncodeText(setup, model, text, true).size());
+    setup.token_counts->Put(key, count);
+  }
+  return count;
+}
+
+int OnnxEngine::MaxLength(const PromptSetup& setup, size_t prompt_tokens,
+                          int max_tokens) const {
+  auto max_length = static_cast<int>(prompt_tokens) + max_tokens;
+  if (setup.context_length > 0) {
+    max_length = std::min(max_length, setup.context_length);
+  }
+  return max_length;
+}
+
+std::vector<int32_t> OnnxEngine::EncodeText(const PromptSetup& setup,
+                                            const ModelInstance& model,
+                                            const std::string& text,
+                                            bool strip_bos) {
+  auto tokens = model.Encode(text);
+  const auto& bos = setup.bos_tokens;
+  if (strip_bos && !bos.empty() && tokens.size() >= bos.size() &&
+      std::equal(bos.begin(), bos.end(), tokens.begin())) {
+    tokens.erase(tokens.begin(), tokens.begin() + bos.size());
+  }
+  return tokens;
+}
+
+std::vector<int32_t> OnnxEngine::EncodePrompt(
+    const PromptSetup& setup, const ModelInstance& model,
+    const std::string& prompt, const std::vector<size_t>& segment_ends) {
+  // Rendered messages, then the generation prefix. The generation prefix
+  // turns into a full assistant message on the next turn, so it is never
+  // cached.
+  std::vector<std::string_view> segments;
+  size_t pos = 0;
+  for (auto end : segment_ends) {
+    segments.emplace_back(prompt.data() + pos, end - pos);
+    pos = end;
+  }
+  auto segment_start = [&](size_t i) {
+    return i == 0 ? 0 : segment_ends[i - 1];
+  };
+
+  std::vector<int32_t> tokens;
+  auto match = setup.prompt_cache->Lookup(segments, tokens);
+  auto matched = match.segments;
+  if (matched > 0) {
+    LOG_DEBUG << "Prompt cache hit: " << matched << "/" << segments.size()
+              << " segments, " << tokens.size() << " tokens";
+  }
+  // The new segments are checked together with the last cached one, so that
+  // the boundary between cached and new tokens is checked too
+  size_t context = matched > 0 ? matched - 1 : 0;
+  auto context_tokens = tokens.size() - match.last_tokens;
+  if (match.joins_previous) {
+    // Known not to split there, no need to check again
+    tokens.resize(context_tokens);
+    auto rest = EncodeText(setup, model, prompt.substr(segment_start(context)),
+                           context > 0);
+    tokens.insert(tokens.end(), rest.begin(), rest.end());
+    return tokens;
+  }
+
+  // Only the segments past the cached path need tokenizing
+  std::vector<std::vector<int32_t>> appended;
+  std::vector<int32_t> split(tokens.begin() + context_tokens, tokens.end());
+  for (size_t i = matched; i < segments.size(); i++) {
+    appended.push_back(
+        EncodeText(setup, model, std::string(segments[i]), i > 0));
+    split.insert(split.end(), appended.back().begin(), appended.back().end());
+  }
+  // Segments are only cached if they tokenize the same way on their own as
+  // inside the prompt
+  auto joined = EncodeText(setup, model, prompt.substr(segment_start(context)),
+                           context > 0);
+  tokens.resize(context_tokens);
+  tokens.insert(tokens.end(), joined.begin(), joined.end());
+  if (joined == split) {
+    appended.pop_back();
+    setup.prompt_cache->Insert(segments, matched, std::move(appended));
+    return tokens;
+  }
+
+  // Segments up to the first one whose tokens differ are still cached, and
+  // that one is marked so that it is encoded with its predecessor next time
+  auto diverged = static_cast<size_t>(
+      std::mismatch(joined.begin(), joined.end(), split.begin(), split.end())
+          .first -
+      joined.begin());
+  auto unstable = segments.size() - 1;
+  size_t end = match.last_tokens;
+  if (matched > 0 && end > diverged) {
+    // The cached segment merges with the first new one
+    unstable = matched;
+  } else {
+    for (size_t i = 0; i < appended.size(); i++) {
+      end += appended[i].size();
+      if (end > diverged) {
+        unstable = matched + i;
+        break;
+      }
+    }
+  }
+  LOG_DEBUG << "Prompt segment " << unstable
+            << " does not tokenize on its own";
+  appended.resize(unstable - matched);
+  setup.prompt_cache->Insert(segments, matched, std::move(appended));
+  setup.prompt_cache->MarkJoined(segments, unstable);
+  return tokens;
+}
+
+bool OnnxEngine::StepSequence(ModelEntry& entry, InferenceState& s) {
+  auto& cb = s.callback;
+  try {
+    if (!entry.loaded) {
+      LOG_WARN << "Model unloaded during inference";
+      entry.kv_cache.Release(s.id);
+      if (s.response_cache != nullptr) {
+        s.response_cache->Abandon(s.response_key,
+                                  {k409Conflict, "Model has been unloaded"});
+      }
+      // Streams only end, their status line is already sent
+      Json::Value json_resp;
+      json_resp["message"] = "Model has been unloaded";
+      Json::Value status;
+      status["is_done"] = false;
+      status["has_error"] = true;
+      status["is_stream"] = s.req.stream;
+      status["status_code"] = k409Conflict;
+      cb(std::move(status), std::move(json_resp));
+      return false;
+    }
+
+    if (IsCancelled(s.cancelled, s.response_cache.get(), s.response_key)) {
+      // Pending requests are dropped before prefill, running ones free their
+      // generator and KV cache right away
+      LOG_INFO << "Request cancelled after " << s.generated_tokens
+               << " tokens";
+      entry.metrics.cancelled_total++;
+      entry.kv_cache.Release(s.id);
+      s.generator.reset();
+      s.params.reset();
+      s.model.reset();
+      Json::Value json_resp;
+      json_resp["message"] = "Request cancelled";
+      Json::Value status;
+      status["is_done"] = false;
+      status["has_error"] = true;
+      status["is_stream"] = s.req.stream;
+      status["status_code"] = k499ClientClosedRequest;
+      cb(std::move(status), std::move(json_resp));
+      return false;
+    }
+
+    if (!s.generator && s.deadline < std::chrono::steady_clock::now() &&
+        ExpireSequence(entry, s)) {
+      // Too late to start, dropped before spending prefill on it
+      return false;
+    }
+
+    if (!s.generator) {
+      // First step of this sequence: prefill
+      entry.metrics.queue_wait_seconds.Observe(SecondsSince(s.enqueued));
+      s.model = entry.Instance();
+      if (s.model == nullptr) {
+        throw std::runtime_error("Model unloaded before inference");
+      }
+      auto tokenize_start = std::chrono::steady_clock::now();
+      s.input_ids = EncodePrompt(*s.prompt_setup, *s.model, s.prompt,
+                                 s.segment_ends);
+      s.prefill_start = std::chrono::steady_clock::now();
+      entry.metrics.tokenize_seconds.Observe(
+          std::chrono::duration<double>(s.prefill_start - tokenize_start)
+              .count());
+
+      s.params = OgaGeneratorParams::Create(*s.model->model);
+      auto max_length =
+          MaxLength(*s.prompt_setup, s.input_ids.size(), s.req.max_tokens);
+      // TODO(sang)
+      s.params->SetSearchOption("max_length", max_length);
+      s.params->SetSearchOption("top_p", s.req.top_p);
+      s.params->SetSearchOption("temperature", s.req.temperature);
+      if (auto penalty = RepetitionPenalty(s.req); penalty > 1.0) {
+        s.params->SetSearchOption("repetition_penalty", penalty);
+      }
+      s.params->SetInputIDs(s.input_ids.data(), s.input_ids.size(),
+                            s.input_ids.size(), 1);
+
+      s.generator = OgaGenerator::Create(*s.model->model, *s.params);
+      s.tokenizer_stream = s.model->stream_pool->Acquire();
+      s.id = GenerateRandomString(20);
+      entry.kv_cache.Update(
+          s.id, entry.kv_cache.SequenceBytes(s.input_ids.size(), max_length));
+      s.chunk_writer.Init(s.id, "_");
+      s.start = std::chrono::system_clock::now();
+    }
+
+    bool stopped = false;
+    if (!s.generator->IsDone()) {
+      s.generator->ComputeLogits();
+      s.generator->GenerateNextToken();
+
+      const int32_t num_tokens = s.generator->GetSequenceCount(0);
+      int32_t new_token = s.generator->GetSequenceData(0)[num_tokens - 1];
+      if (!entry.kv_cache.share_buffer()) {
+        entry.kv_cache.Update(s.id,
+                              entry.kv_cache.SequenceBytes(num_tokens, 0));
+      }
+      // Text that may be the start of a stop string is held back
+      std::string text;
+      stopped = FilterToken(s.tokenizer_stream->Decode(new_token),
+                            s.generator->IsDone(), s.stop_matcher,
+                            s.json_validator.get(), text, s.finish_reason);
+      auto now = std::chrono::steady_clock::now();
+      if (s.generated_tokens == 0) {
+        s.first_token = now;
+        entry.metrics.prefill_seconds.Observe(
+            std::chrono::duration<double>(now - s.prefill_start).count());
+        entry.metrics.time_to_first_token_seconds.Observe(
+            std::chrono::duration<double>(now - s.arrived).count());
+      } else {
+        entry.metrics.time_per_output_token_seconds.Observe(
+            std::chrono::duration<double>(now - s.last_token).count());
+      }
+      s.last_token = now;
+      // std::cout << out_string;
+      if (!text.empty()) {
+        if (s.req.stream) {
+          Json::Value resp_data;
+          resp_data["data"] = s.chunk_writer.Write(text);
+          Json::Value status;
+          status["is_done"] = false;
+          status["has_error"] = false;
+          status["is_stream"] = true;
+          status["status_code"] = k200OK;
+          cb(std::move(status), std::move(resp_data));
+        } else {
+          s.content += text;
+        }
+        if (s.response_cache != nullptr) {
+          s.pieces.push_back(std::move(text));
+        }
+      }
+      s.generated_tokens++;
+    }
+
+    if (stopped || s.generator->IsDone()) {
+      FinishSequence(entry, s);
+      return false;
+    }
+    return true;
+  } catch (const std::exception& e) {
+    LOG_ERROR << "Error during inference: " << e.what();
+    entry.metrics.errors_total++;
+    entry.kv_cache.Release(s.id);
+    if (s.response_cache != nullptr) {
+      s.response_cache->Abandon(
+          s.response_key, {k500InternalServerError, "Error during inference"});
+    }
+    s.generator.reset();
+    s.model.reset();
+    ReloadModelAsync(entry);
+    Json::Value json_resp;
+    json_resp["message"] = "Error during inference";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = s.req.stream;
+    status["status_code"] = k500InternalServerError;
+    cb(std::move(status), std::move(json_resp));
+    return false;
+  }
+}
+
+bool OnnxEngine::ExpireSequence(ModelEntry& entry, InferenceState& s) {
+  // Still wanted if it generates a response others wait for
+  if (s.response_cache != nullptr &&
+      !s.response_cache->AbandonIfUnwaited(s.response_key)) {
+    return false;
+  }
+  entry.metrics.deadline_missed_total++;
+  Json::Value json_resp;
+  json_resp["message"] = "Deadline passed before the request started";
+  Json::Value status;
+  status["is_done"] = false;
+  status["has_error"] = true;
+  status["is_stream"] = s.req.stream;
+  status["status_code"] = k504GatewayTimeout;
+  s.callback(std::move(status), std::move(json_resp));
+  return true;
+}
+
+void OnnxEngine::FinishSequence(ModelEntry& entry, InferenceState& s) {
+  auto end = std::chrono::system_clock::now();
+  auto duration_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - s.start)
+          .count();
+  auto tokens_per_second = s.generated_tokens / duration_ms * 1000;
+  LOG_DEBUG << "Generated tokens per second: " << tokens_per_second;
+  entry.metrics.e2e_seconds.Observe(SecondsSince(s.arrived));
+  if (duration_ms > 0) {
+    entry.metrics.tokens_per_second.Observe(tokens_per_second);
+  }
+  entry.metrics.generated_tokens_total +=
+      static_cast<uint64_t>(s.generated_tokens);
+  LOG_DEBUG << "KV cache high-water mark of " << s.id << ": "
+            << entry.kv_cache.Release(s.id) << " bytes";
+  auto prompt_tokens = static_cast<int>(s.input_ids.size());
+  s.generator.reset();
+  s.params.reset();
+  s.input_ids.clear();
+  // A used stream may hold a partial character, the pool gets a fresh one
+  // between two iterations
+  s.tokenizer_stream.reset();
+  entry.scheduler->RunTask(
+      [model = std::move(s.model)] { model->stream_pool->Refill(); });
+  // Decode rate from the first token on, so that queue wait and prefill do
+  // not count. Sequences share the worker, so judge the aggregate rate.
+  if (s.generated_tokens >= kMinRateTokens) {
+    auto decode_s =
+        std::chrono::duration<double>(s.last_token - s.first_token).count();
+    auto aggregate_tps = (s.generated_tokens - 1) / decode_s *
+                         std::max<size_t>(1, entry.scheduler->ActiveCount());
+    if (decode_s > 0 && aggregate_tps < kMinTokensPerSecond) {
+      LOG_WARN << "Something wrong happened, restart model in the background";
+      ReloadModelAsync(entry);
+    }
+  }
+
+  LOG_INFO << "End of result";
+  Json::Value resp_data;
+  if (s.req.stream) {
+    resp_data["data"] = s.chunk_writer.WriteDone(s.finish_reason);
+  } else {
+    resp_data = CreateFullReturnJson(
+        s.id, "_", s.content, "_", prompt_tokens,
+        static_cast<int>(s.generated_tokens), s.finish_reason);
+  }
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = false;
+  status["is_stream"] = s.req.stream;
+  status["status_code"] = k200OK;
+  s.callback(std::move(status), std::move(resp_data));
+
+  if (s.response_cache != nullptr) {
+    auto response = std::make_shared<ResponseCache::Response>();
+    response->pieces = std::move(s.pieces);
+    response->finish_reason = s.finish_reason;
+    response->prompt_tokens = prompt_tokens;
+    response->completion_tokens = static_cast<int>(s.generated_tokens);
+    s.response_cache->Complete(s.response_key, std::move(response));
+    s.response_cache.reset();
+  }
+}
+
+void OnnxEngine::ReloadModelAsync(ModelEntry& entry) {
+  auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+  auto cooldown =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          kReloadCooldown)
+          .count();
+  if (!entry.loaded ||
+      (entry.last_reload != 0 && now - entry.last_reload < cooldown) ||
+      entry.reloading.exchange(true)) {
+    return;
+  }
+  // The new instance is loaded next to the current one, and is counted as
+  // resident while `reloading` is set
+  auto budget = memory_budget_bytes_.load();
+  if (budget > 0 && ResidentBytes() > budget) {
+    LOG_WARN << "Not reloading " << entry.id
+             << ", a second instance does not fit in the memory budget";
+    entry.reloading = false;
+    return;
+  }
+  entry.last_reload = now;
+  if (entry.reload_thread.joinable()) {
+    entry.reload_thread.join();
+  }
+  entry.reload_thread = std::thread([&entry, path = entry.Path()] {
+    try {
+      auto model = ModelInstance::Create(path, entry.n_parallel);
+      model->Warmup();
+      {
+        std::lock_guard<std::mutex> l(entry.instance_mtx);
+        // Do not resurrect a model that was unloaded or replaced meanwhile
+        if (entry.loaded && path == entry.path) {
+          entry.instance = std::move(model);
+          entry.start_time =
+              std::chrono::system_clock::now().time_since_epoch() /
+              std::chrono::milliseconds(1);
+          LOG_INFO << "Model reloaded successfully: " << path
+                   << ", model_id: " << entry.id;
+        }
+      }
+    } catch (const std::exception& e) {
+      LOG_ERROR << "Failed to reload model: " << e.what();
+    }
+    entry.reloading = false;
+  });
+}
+
+void OnnxEngine::HandleEmbedding(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  auto arrived = std::chrono::steady_clock::now();
+  auto entry = FindModel(json_body->get("model", "").asString(), callback);
+  if (entry == nullptr)
+    return;
+  if (!EnsureLoaded(*entry)) {
+    Json::Value json_resp;
+    json_resp["message"] = "Failed to load model";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k500InternalServerError;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  auto model = entry->Embedding();
+  auto embedding_scope = entry->EmbeddingScope();
+
+  // `input` is a string or an array of strings
+  const auto& input = (*json_body)["input"];
+  std::vector<std::string_view> inputs;
+  const char* begin = nullptr;
+  const char* end = nullptr;
+  if (input.isString() && input.getString(&begin, &end)) {
+    inputs.emplace_back(begin, end - begin);
+  } else if (input.isArray()) {
+    for (const auto& item : input) {
+      if (!item.isString() || !item.getString(&begin, &end)) {
+        inputs.clear();
+        break;
+      }
+      inputs.emplace_back(begin, end - begin);
+    }
+  }
+  if (model == nullptr || inputs.empty()) {
+    Json::Value json_resp;
+    json_resp["message"] = model == nullptr
+                               ? "Model was not loaded for embeddings"
+                               : "`input` must be a string or an array of "
+                                 "strings";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k400BadRequest;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  entry->Touch();
+  entry->metrics.embedding_requests_total++;
+
+  std::shared_ptr<EmbeddingCache> cache;
+  {
+    std::lock_guard<std::mutex> l(embedding_cache_mtx_);
+    cache = embedding_cache_;
+  }
+  try {
+    std::vector<std::vector<float>> embeddings(inputs.size());
+    std::vector<EmbeddingCache::Key> keys;
+    // Inputs to run through the model, and where their results go
+    std::vector<std::string_view> misses;
+    std::vector<size_t> miss_index;
+    for (size_t i = 0; i < inputs.size(); i++) {
+      if (cache != nullptr) {
+        keys.push_back(
+            EmbeddingCache::MakeKey(embedding_scope, inputs[i]));
+        if (cache->Get(keys.back(), embeddings[i])) {
+          continue;
+        }
+      }
+      misses.push_back(inputs[i]);
+      miss_index.push_back(i);
+    }
+    if (cache != nullptr) {
+      entry->metrics.embedding_cache_hits_total +=
+          inputs.size() - misses.size();
+      entry->metrics.embedding_cache_misses_total += misses.size();
+    }
+
+    // Usage counts the tokens that went through the model
+    size_t tokens = 0;
+    if (!misses.empty()) {
+      std::vector<std::vector<float>> computed;
+      tokens = model->Embed(misses, computed);
+      for (size_t j = 0; j < computed.size(); j++) {
+        auto i = miss_index[j];
+        if (cache != nullptr) {
+          cache->Put(keys[i], computed[j]);
+        }
+        embeddings[i] = std::move(computed[j]);
+      }
+    }
+
+    Json::Value data(Json::arrayValue);
+    for (size_t i = 0; i < embeddings.size(); i++) {
+      Json::Value values(Json::arrayValue);
+      for (float v : embeddings[i]) {
+        values.append(v);
+      }
+      Json::Value item;
+      item["object"] = "embedding";
+      item["index"] = static_cast<int>(i);
+      item["embedding"] = std::move(values);
+      data.append(std::move(item));
+    }
+    Json::Value json_resp;
+    json_resp["object"] = "list";
+    json_resp["data"] = std::move(data);
+    json_resp["model"] = entry->id;
+    Json::Value usage;
+    usage["prompt_tokens"] = static_cast<int>(tokens);
+    usage["total_tokens"] = static_cast<int>(tokens);
+    json_resp["usage"] = usage;
+    entry->metrics.e2e_seconds.Observe(SecondsSince(arrived));
+
+    Json::Value status;
+    status["is_done"] = true;
+    status["has_error"] = false;
+    status["is_stream"] = false;
+    status["status_code"] = k200OK;
+    callback(std::move(status), std::move(json_resp));
+  } catch (const std::exception& e) {
+    LOG_ERROR << "Error during embedding: " << e.what();
+    entry->metrics.errors_total++;
+    Json::Value json_resp;
+    json_resp["message"] = "Error during embedding";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k500InternalServerError;
+    callback(std::move(status), std::move(json_resp));
+  }
+}
+
+void OnnxEngine::UnloadModel(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  // Unloads the given model, or every model when none is given
+  std::vector<std::shared_ptr<ModelEntry>> unloaded;
+  auto model_id = GetModelId(*json_body);
+  if (model_id.empty()) {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    for (auto& [id, e] : models_) {
+      unloaded.push_back(std::move(e));
+    }
+    models_.clear();
+  } else if (auto entry = FindModel(model_id, callback)) {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    models_.erase(entry->id);
+    unloaded.push_back(std::move(entry));
+  } else {
+    return;
+  }
+  if (unloaded.empty()) {
+    Json::Value json_resp;
+    json_resp["message"] =
+        "Model has not been loaded, please load model into cortex.onnx";
+    Json::Value status;
+    status["is_done"] = false;
+    status["has_error"] = true;
+    status["is_stream"] = false;
+    status["status_code"] = k409Conflict;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+  for (auto& entry : unloaded) {
+    Evict(*entry);
+    LOG_INFO << "Model unloaded sucessfully: " << entry->id;
+  }
+
+  Json::Value json_resp;
+  json_resp["message"] = "Model unloaded successfully";
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = false;
+  status["is_stream"] = false;
+  status["status_code"] = k200OK;
+  callback(std::move(status), std::move(json_resp));
+}
+
+void OnnxEngine::GetModelStatus(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  auto entry = FindModel(GetModelId(*json_body), callback);
+  if (entry == nullptr)
+    return;
+  auto& progress = entry->load_progress;
+  auto phase = progress.phase.load();
+  Json::Value load;
+  load["phase"] = LoadProgress::PhaseName(phase);
+  load["bytes_read"] = Json::UInt64(progress.bytes_read);
+  load["bytes_total"] = Json::UInt64(progress.bytes_total);
+  load["elapsed_ms"] = Json::Int64(progress.ElapsedMs());
+  if (phase == LoadProgress::Phase::kFailed) {
+    load["error"] = progress.Error();
+  }
+  // Still loading, the last load failed, or evicted (idle)
+  if (!entry->loaded) {
+    Json::Value json_resp;
+    json_resp["model_loaded"] = false;
+    json_resp["model_id"] = entry->id;
+    json_resp["load"] = load;
+    Json::Value status;
+    status["is_done"] = true;
+    status["has_error"] = false;
+    status["is_stream"] = false;
+    status["status_code"] = k200OK;
+    callback(std::move(status), std::move(json_resp));
+    return;
+  }
+
+  Json::Value json_resp;
+  json_resp["model_loaded"] = true;
+  json_resp["model_id"] = entry->id;
+  json_resp["load"] = load;
+  json_resp["memory"] = MemoryJson(*entry);
+  if (entry->scheduler != nullptr) {
+    Json::Value queue;
+    queue["pending"] = Json::UInt64(entry->scheduler->PendingCount());
+    queue["active"] = Json::UInt64(entry->scheduler->ActiveCount());
+    queue["pending_tokens"] = Json::UInt64(entry->scheduler->PendingTokens());
+    queue["max_queue_depth"] = Json::UInt64(entry->max_queue_depth);
+    queue["max_queued_tokens"] = Json::UInt64(entry->max_queued_tokens);
+    queue["prefill_token_budget"] = Json::UInt64(entry->prefill_token_budget);
+    queue["tokens_per_second"] = entry->scheduler->TokensPerSecond();
+    queue["prefill_tokens_per_second"] =
+        entry->scheduler->PrefillTokensPerSecond();
+    json_resp["queue"] = queue;
+  }
+
+  std::shared_ptr<EmbeddingCache> embedding_cache;
+  {
+    std::lock_guard<std::mutex> l(embedding_cache_mtx_);
+    embedding_cache = embedding_cache_;
+  }
+  if (entry->Embedding() != nullptr && embedding_cache != nullptr) {
+    auto stats = embedding_cache->GetStats();
+    Json::Value cache;
+    cache["hits"] = Json::UInt64(stats.hits);
+    cache["misses"] = Json::UInt64(stats.misses);
+    auto lookups = stats.hits + stats.misses;
+    cache["hit_rate"] =
+        lookups == 0 ? 0.0 : static_cast<double>(stats.hits) / lookups;
+    cache["memory_entries"] = Json::UInt64(stats.memory_entries);
+    cache["memory_bytes"] = Json::UInt64(stats.memory_bytes);
+    cache["disk_entries"] = Json::UInt64(stats.disk_entries);
+    cache["disk_bytes"] = Json::UInt64(stats.disk_bytes);
+    json_resp["embedding_cache"] = cache;
+  }
+  auto setup = entry->Prompts();
+  if (setup != nullptr) {
+    auto stats = setup->prompt_cache->GetStats();
+    Json::Value prompt_cache;
+    prompt_cache["lookups"] = Json::UInt64(stats.lookups);
+    prompt_cache["hits"] = Json::UInt64(stats.hits);
+    prompt_cache["hit_rate"] =
+        stats.lookups == 0 ? 0.0
+                           : static_cast<double>(stats.hits) / stats.lookups;
+    prompt_cache["reused_tokens"] = Json::UInt64(stats.reused_tokens);
+    prompt_cache["evictions"] = Json::UInt64(stats.evictions);
+    prompt_cache["nodes"] = Json::UInt64(stats.nodes);
+    prompt_cache["bytes"] = Json::UInt64(stats.bytes);
+    prompt_cache["budget_bytes"] = Json::UInt64(stats.budget_bytes);
+    json_resp["prompt_cache"] = prompt_cache;
+  }
+  if (setup != nullptr && setup->response_cache != nullptr) {
+    auto stats = setup->response_cache->GetStats();
+    Json::Value response_cache;
+    response_cache["hits"] = Json::UInt64(stats.hits);
+    response_cache["misses"] = Json::UInt64(stats.misses);
+    response_cache["coalesced"] = Json::UInt64(stats.coalesced);
+    response_cache["entries"] = Json::UInt64(stats.entries);
+    response_cache["bytes"] = Json::UInt64(stats.bytes);
+    response_cache["budget_bytes"] = Json::UInt64(stats.budget_bytes);
+    json_resp["response_cache"] = response_cache;
+  }
+
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = false;
+  status["is_stream"] = false;
+  status["status_code"] = k200OK;
+  callback(std::move(status), std::move(json_resp));
+}
+
+// API to get running models.
+void OnnxEngine::GetModels(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  Json::Value json_resp;
+  Json::Value model_array = Json::arrayValue;
+
+  {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    for (const auto& [id, entry] : models_) {
+      if (!entry->loaded) {
+        continue;
+      }
+      Json::Value val;
+      val["id"] = id;
+      val["engine"] = "cortex.onnx";
+      val["start_time"] = Json::UInt64(entry->start_time);
+      // Arena and KV cache live with the session, in VRAM on GPU providers
+      auto session_bytes =
+          entry->arena_bytes + entry->kv_cache.GetStats().in_use_bytes;
+      bool on_gpu = entry->vram_bytes > 0;
+      val["vram"] =
+          Json::UInt64(on_gpu ? entry->vram_bytes + session_bytes : 0);
+      val["ram"] = Json::UInt64(entry->resident_bytes +
+                                (on_gpu ? 0 : session_bytes));
+      val["object"] = "model";
+      model_array.append(val);
+    }
+  }
+
+  json_resp["object"] = "list";
+  json_resp["data"] = model_array;
+
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = false;
+  status["is_stream"] = false;
+  status["status_code"] = k200OK;
+  callback(std::move(status), std::move(json_resp));
+  LOG_INFO << "Running models responded";
+}
+
+void OnnxEngine::GetMetrics(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  std::vector<std::shared_ptr<ModelEntry>> entries;
+  {
+    std::lock_guard<std::mutex> l(models_mtx_);
+    for (const auto& [id, entry] : models_) {
+      entries.push_back(entry);
+    }
+  }
+  std::vector<ModelSeries> series;
+  for (const auto& entry : entries) {
+    bool running = entry->loaded && entry->scheduler != nullptr;
+    series.push_back(ModelSeries{
+        entry->id, &entry->metrics,
+        running ? entry->scheduler->PendingCount() : 0,
+        running ? entry->scheduler->ActiveCount() : 0});
+  }
+
+  Json::Value json_resp;
+  json_resp["data"] = RenderMetrics(series);
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = false;
+  status["is_stream"] = false;
+  status["status_code"] = k200OK;
+  callback(std::move(status), std::move(json_resp));
+}
+
+void OnnxEngine::CancelRequest(
+    std::shared_ptr<Json::Value> json_body,
+    std::function<void(Json::Value&&, Json::Value&&)>&& callback) {
+  auto request_id = json_body->get("request_id", "").asString();
+  bool cancelled = cancellations_.Cancel(request_id);
+  Json::Value json_resp;
+  json_resp["message"] =
+      cancelled ? "Request cancelled" : "No running request with this id";
+  Json::Value status;
+  status["is_done"] = true;
+  status["has_error"] = !cancelled;
+  status["is_stream"] = false;
+  status["status_code"] = cancelled ? k200OK : k404NotFound;
+  callback(std::move(status), std::move(json_resp));
 }
 
 }  // namespace cortex_onnx
@@ -1,17 +1,24 @@
 #pragma once
 #include <memory.h>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include "cancellation_registry.h"
 #include "cortex-common/enginei.h"
+#include "embedding_cache.h"
+#include "model_entry.h"
 #include "json/value.h"
 #include "ort_genai.h"
 #include "ort_genai_c.h"
-#include "trantor/utils/ConcurrentTaskQueue.h"
 
 namespace cortex_onnx {
 class OnnxEngine : public EngineI {
  public:
   OnnxEngine();
+  ~OnnxEngine();
   void HandleChatCompletion(
       std::shared_ptr<Json::Value> json_body,
       std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
@@ -33,24 +40,84 @@ class OnnxEngine : public EngineI {
       std::shared_ptr<Json::Value> json_body,
       std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
 
+  void GetMetrics(
+      std::shared_ptr<Json::Value> json_body,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
+  void CancelRequest(
+      std::shared_ptr<Json::Value> json_body,
+      std::function<void(Json::Value&&, Json::Value&&)>&& callback) final;
+
  private:
-  bool CheckModelLoaded(
+  // Model `model_id` routes to. When it is not registered and exactly one
+  // model is, that one is used. Replies 409 and returns null if none.
+  std::shared_ptr<ModelEntry> FindModel(
+      const std::string& model_id,
       std::function<void(Json::Value&&, Json::Value&&)>& callback);
+  // Starts loading `entry` on its loader thread, from `load_params` if given
+  // or else from the parameters it was last loaded with. Returns false if a
+  // load of that model is already running.
+  bool StartLoad(ModelEntry& entry, const Json::Value* load_params = nullptr);
+  // Loads an evicted model again and waits for it. Returns false if the model
+  // is not resident and cannot be loaded.
+  bool EnsureLoaded(ModelEntry& entry);
+  // Run on the loader thread
+  bool LoadModelImpl(ModelEntry& entry);
+  // After a failed load: a model that never loaded is unregistered and
+  // returned, one that did gets its previous load parameters back
+  std::shared_ptr<ModelEntry> RollBackLoad(ModelEntry& entry,
+                                           const Json::Value& previous_params);
+  bool LoadEmbeddingModel(ModelEntry& entry, const std::string& path);
+  // Evicts least recently used idle models until `incoming` fits in the
+  // memory budget.
+  void MakeRoom(const ModelEntry& incoming);
+  // Estimated bytes of the resident and loading models
+  uint64_t ResidentBytes();
+  void Evict(ModelEntry& entry);
+
+  // Drops old turns from `messages` so that the prompt plus `max_tokens` fits
+  // in the context window. Returns false if the prompt cannot fit at all.
+  // `prompt_tokens` receives the prompt size, 0 if the model has no known
+  // context window.
+  bool FitContext(const PromptSetup& setup, const ModelInstance& model,
+                  int max_tokens, std::vector<const Json::Value*>& messages,
+                  int& prompt_tokens);
+  int CountTokens(const PromptSetup& setup, const ModelInstance& model,
+                  const std::string& text);
+  int MaxLength(const PromptSetup& setup, size_t prompt_tokens,
+                int max_tokens) const;
+  std::vector<int32_t> EncodeText(const PromptSetup& setup,
+                                  const ModelInstance& model,
+                                  const std::string& text, bool strip_bos);
+  std::vector<int32_t> EncodePrompt(const PromptSetup& setup,
+                                    const ModelInstance& model,
+                                    const std::string& prompt,
+                                    const std::vector<size_t>& segment_ends);
+
+  // Loads and warms up a fresh instance in the background, then swaps it in.
+  // In-flight requests finish on the instance they started on. Skipped within
+  // the cooldown of the last reload, and when the second instance does not
+  // fit in the memory budget.
+  void ReloadModelAsync(ModelEntry& entry);
+
+  // Run on the model's scheduler thread, see BatchScheduler::StepFn and
+  // BatchScheduler::ExpireFn
+  bool StepSequence(ModelEntry& entry, InferenceState& s);
+  bool ExpireSequence(ModelEntry& entry, InferenceState& s);
+  void FinishSequence(ModelEntry& entry, InferenceState& s);
 
  private:
   std::unique_ptr<OgaHandle> handle_;
-  std::unique_ptr<OgaModel> oga_model_ = nullptr;
-  std::unique_ptr<OgaTokenizer> tokenizer_ = nullptr;
-  std::unique_ptr<OgaTokenizerStream> tokenizer_stream_ = nullptr;
-  std::atomic<bool> model_loaded_;
-  std::string user_prompt_;
-  std::string ai_prompt_;
-  std::string system_prompt_;
-  std::string pre_prompt_;
-  std::string model_id_;
-  uint64_t start_time_;
-  int max_history_chat_;
-  std::unique_ptr<trantor::ConcurrentTaskQueue> q_;
-  std::string path_; 
+  std::mutex models_mtx_;
+  std::unordered_map<std::string, std::shared_ptr<ModelEntry>> models_;
+  // Held while a request is queued on a model and while idle models are
+  // evicted, so that a model is never evicted under a queued request
+  std::mutex residency_mtx_;
+  // Estimated bytes all resident models may use, 0 for no limit
+  std::atomic<uint64_t> memory_budget_bytes_ = 0;
+  // Shared by all embedding models, created by the first one loaded
+  std::mutex embedding_cache_mtx_;
+  std::shared_ptr<EmbeddingCache> embedding_cache_;
+  // Chat completions sent with a `request_id`
+  CancellationRegistry cancellations_;
 };
-}  // namespace cortex_onnx
\ No newline at end of file
+}  // namespace cortex_onnx
@@ -0,0 +1,86 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CORTEX_ONNX_SSE2
+#endif
+
+namespace cortex_onnx {
+// Pooling kernels for embeddings. Four lanes at a time with SSE2 where the
+// target has it (every x86-64 target does), scalar otherwise and for the tail.
+
+// out[i] += row[i]
+inline void AddRow(const float* row, size_t n, float* out) {
+  size_t i = 0;
+#ifdef CORTEX_ONNX_SSE2
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i,
+                  _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(row + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] += row[i];
+  }
+}
+
+inline void Scale(float* v, size_t n, float s) {
+  size_t i = 0;
+#ifdef CORTEX_ONNX_SSE2
+  const auto factor = _mm_set1_ps(s);
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(v + i, _mm_mul_ps(_mm_loadu_ps(v + i), factor));
+  }
+#endif
+  for (; i < n; i++) {
+    v[i] *= s;
+  }
+}
+
+inline float SquaredNorm(const float* v, size_t n) {
+  size_t i = 0;
+  float sum = 0;
+#ifdef CORTEX_ONNX_SSE2
+  auto acc = _mm_setzero_ps();
+  for (; i + 4 <= n; i += 4) {
+    auto x = _mm_loadu_ps(v + i);
+    acc = _mm_add_ps(acc, _mm_mul_ps(x, x));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < n; i++) {
+    sum += v[i] * v[i];
+  }
+  return sum;
+}
+
+// Average of the `hidden` rows whose `mask` is set. `hidden` holds `tokens`
+// rows of `dims` floats.
+inline void MeanPool(const float* hidden, const int64_t* mask, size_t tokens,
+                     size_t dims, float* out) {
+  for (size_t i = 0; i < dims; i++) {
+    out[i] = 0;
+  }
+  size_t count = 0;
+  for (size_t t = 0; t < tokens; t++) {
+    if (mask[t] != 0) {
+      AddRow(hidden + t * dims, dims, out);
+      count++;
+    }
+  }
+  if (count > 0) {
+    Scale(out, dims, 1.0f / count);
+  }
+}
+
+inline void L2Normalize(float* v, size_t n) {
+  auto norm = std::sqrt(SquaredNorm(v, n));
+  if (norm > 0) {
+    Scale(v, n, 1.0f / norm);
+  }
+}
+}  // namespace cortex_onnx
@@ -0,0 +1,162 @@
+#include "prompt_cache.h"
+
+namespace cortex_onnx {
+
+PromptCache::PromptCache(size_t budget_bytes) : budget_bytes_(budget_bytes) {
+  stats_.budget_bytes = budget_bytes;
+}
+
+PromptCache::Match PromptCache::Lookup(
+    const std::vector<std::string_view>& segments,
+    std::vector<int32_t>& tokens) {
+  std::lock_guard<std::mutex> l(mtx_);
+  stats_.lookups++;
+  Node* node = &root_;
+  Match match;
+  for (size_t i = 0; i < segments.size(); i++) {
+    auto* child = FindChild(node, segments[i]);
+    if (child == nullptr) {
+      break;
+    }
+    if (child->joins_previous) {
+      match.joins_previous = true;
+      node = child;
+      break;
+    }
+    if (i + 1 == segments.size()) {
+      break;
+    }
+    tokens.insert(tokens.end(), child->tokens.begin(), child->tokens.end());
+    stats_.reused_tokens += child->tokens.size();
+    match.last_tokens = child->tokens.size();
+    node = child;
+    match.segments++;
+  }
+  if (match.segments > 0) {
+    stats_.hits++;
+  }
+  if (node != &root_) {
+    Touch(node);
+  }
+  return match;
+}
+
+void PromptCache::Insert(const std::vector<std::string_view>& segments,
+                         size_t matched,
+                         std::vector<std::vector<int32_t>> tokens) {
+  if (budget_bytes_ == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> l(mtx_);
+  Node* node = FindPath(segments, matched);
+  // Evicted since the lookup
+  if (node == nullptr) {
+    return;
+  }
+
+  for (size_t i = matched; i < matched + tokens.size(); i++) {
+    const auto& segment = segments[i];
+    auto* child = FindChild(node, segment);
+    if (child != nullptr && child->joins_previous) {
+      break;
+    }
+    if (child == nullptr) {
+      child = AddChild(node, segment, std::move(tokens[i - matched]));
+    }
+    node = child;
+  }
+  if (node != &root_) {
+    Touch(node);
+  }
+  EvictToBudget();
+}
+
+void PromptCache::MarkJoined(const std::vector<std::string_view>& segments,
+                             size_t index) {
+  if (budget_bytes_ == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> l(mtx_);
+  Node* node = FindPath(segments, index);
+  if (node == nullptr || FindChild(node, segments[index]) != nullptr) {
+    return;
+  }
+  auto* child = AddChild(node, segments[index], {});
+  child->joins_previous = true;
+  Touch(child);
+  EvictToBudget();
+}
+
+void PromptCache::Clear() {
+  std::lock_guard<std::mutex> l(mtx_);
+  root_.children.clear();
+  lru_.clear();
+  stats_.nodes = 0;
+  stats_.bytes = 0;
+}
+
+PromptCache::Stats PromptCache::GetStats() {
+  std::lock_guard<std::mutex> l(mtx_);
+  return stats_;
+}
+
+PromptCache::Node* PromptCache::FindChild(Node* node,
+                                          std::string_view segment) {
+  auto it = node->children.find(segment);
+  if (it == node->children.end()) {
+    return nullptr;
+  }
+  return it->second.get();
+}
+
+PromptCache::Node* PromptCache::AddChild(Node* node, std::string_view segment,
+                                         std::vector<int32_t> tokens) {
+  auto child = std::make_unique<Node>();
+  child->parent = node;
+  child->text = segment;
+  child->tokens = std::move(tokens);
+  child->lru_it = lru_.insert(lru_.end(), child.get());
+  stats_.bytes += NodeBytes(*child);
+  stats_.nodes++;
+  auto* added = child.get();
+  node->children.emplace(added->text, std::move(child));
+  return added;
+}
+
+PromptCache::Node* PromptCache::FindPath(
+    const std::vector<std::string_view>& segments, size_t count) {
+  Node* node = &root_;
+  for (size_t i = 0; i < count && node != nullptr; i++) {
+    node = FindChild(node, segments[i]);
+    if (node != nullptr && node->joins_previous) {
+      return nullptr;
+    }
+  }
+  return node;
+}
+
+void PromptCache::Touch(Node* node) {
+  for (; node != &root_; node = node->parent) {
+    lru_.splice(lru_.begin(), lru_, node->lru_it);
+  }
+}
+
+void PromptCache::EvictToBudget() {
+  while (stats_.bytes > budget_bytes_ && !lru_.empty()) {
+    Node* victim = lru_.back();
+    lru_.pop_back();
+    stats_.bytes -= NodeBytes(*victim);
+    stats_.nodes--;
+    stats_.evictions++;
+    // `victim` is a leaf, erasing it from its parent frees it
+    auto& siblings = victim->parent->children;
+    siblings.erase(siblings.find(victim->text));
+  }
+}
+
+size_t PromptCache::NodeBytes(const Node& node) {
+  return sizeof(Node) + node.text.size() +
+         node.tokens.size() * sizeof(int32_t);
+}
+
+}  // namespace cortex_onnx
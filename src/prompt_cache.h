@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cortex_onnx {
+// 64-bit FNV-1a
+inline uint64_t Fnv1a(const char* data, size_t size,
+                      uint64_t seed = 14695981039346656037ull) {
+  uint64_t h = seed;
+  for (size_t i = 0; i < size; i++) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Radix tree of tokenized prompt segments, shared by every request of a model.
+// Each edge is one rendered message (system prompt, user turn, ...) and each
+// node holds the tokens of that message, so a long system prompt used by many
+// conversations is tokenized and stored once. A segment that tokenizes
+// differently on its own than after the segments before it is marked, so that
+// later prompts encode it together with its predecessor instead of checking
+// again. Least-recently-used leaves are evicted when the tree grows over its
+// byte budget.
+class PromptCache {
+ public:
+  struct Match {
+    // Leading segments whose tokens were appended
+    size_t segments = 0;
+    // Tokens of the last matched segment, at the end of the appended ones
+    size_t last_tokens = 0;
+    // The segment after the matched ones is marked: it must be encoded
+    // together with the last matched segment, or with the whole prompt if
+    // none matched
+    bool joins_previous = false;
+  };
+  struct Stats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t reused_tokens = 0;
+    uint64_t evictions = 0;
+    size_t nodes = 0;
+    size_t bytes = 0;
+    size_t budget_bytes = 0;
+  };
+
+  explicit PromptCache(size_t budget_bytes);
+
+  // Follows `segments` from the root as far as they are cached and appends
+  // the tokens of the matched segments to `tokens`. The last segment, the
+  // generation prefix, is never cached itself but may be marked.
+  Match Lookup(const std::vector<std::string_view>& segments,
+               std::vector<int32_t>& tokens);
+  // Adds `tokens.size()` segments from `segments[matched]` under the path of
+  // the first `matched` ones. `tokens[i]` holds the tokens of
+  // `segments[matched + i]`.
+  void Insert(const std::vector<std::string_view>& segments, size_t matched,
+              std::vector<std::vector<int32_t>> tokens);
+  // Marks `segments[index]`, under the path of the ones before it, as not
+  // tokenizing on its own
+  void MarkJoined(const std::vector<std::string_view>& segments,
+                  size_t index);
+  void Clear();
+  Stats GetStats();
+
+ private:
+  struct Node {
+    Node* parent = nullptr;
+    // Text of the segment, compared in full so that a segment can never
+    // return the tokens of another one
+    std::string text;
+    std::vector<int32_t> tokens;
+    // Marked by MarkJoined, holds no tokens and no children
+    bool joins_previous = false;
+    // Keyed by the `text` of the child
+    std::unordered_map<std::string_view, std::unique_ptr<Node>> children;
+    std::list<Node*>::iterator lru_it;
+  };
+
+  Node* FindChild(Node* node, std::string_view segment);
+  Node* AddChild(Node* node, std::string_view segment,
+                 std::vector<int32_t> tokens);
+  // Node of `segments[0..count)`, null if not cached
+  Node* FindPath(const std::vector<std::string_view>& segments, size_t count);
+  // Marks `node` and its ancestors as most recently used. Ancestors always
+  // stay ahead of their descendants, so the back of the list is a leaf.
+  void Touch(Node* node);
+  void EvictToBudget();
+  static size_t NodeBytes(const Node& node);
+
+ private:
+  size_t budget_bytes_;
+  std::mutex mtx_;
+  Node root_;
+  // Most recently used at the front, root excluded
+  std::list<Node*> lru_;
+  Stats stats_;
+};
+}  // namespace cortex_onnx
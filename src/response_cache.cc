@@ -0,0 +1,108 @@
+#include "response_cache.h"
+#include "prompt_cache.h"
+
+namespace cortex_onnx {
+namespace {
+// Bookkeeping per entry and per piece, on top of the text itself
+constexpr size_t kEntryOverhead = 96;
+constexpr size_t kPieceOverhead = sizeof(std::string);
+}  // namespace
+
+ResponseCache::Key ResponseCache::MakeKey(std::string_view prompt,
+                                          std::string_view params) {
+  std::string text(params);
+  text += '\0';
+  text += prompt;
+  auto hash = Fnv1a(text.data(), text.size());
+  return Key{hash, std::move(text)};
+}
+
+ResponseCache::Lookup ResponseCache::Acquire(
+    const Key& key, std::shared_ptr<const Response>& response,
+    Waiter waiter) {
+  std::lock_guard<std::mutex> l(mtx_);
+  auto it = entries_.find(&key);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    response = it->second->response;
+    hits_++;
+    return Lookup::kHit;
+  }
+  auto in_flight = in_flight_.find(key);
+  if (in_flight != in_flight_.end()) {
+    in_flight->second.push_back(std::move(waiter));
+    coalesced_++;
+    return Lookup::kJoined;
+  }
+  in_flight_.emplace(key, std::vector<Waiter>());
+  misses_++;
+  return Lookup::kLead;
+}
+
+void ResponseCache::Complete(const Key& key,
+                             std::shared_ptr<const Response> response) {
+  size_t bytes = kEntryOverhead + key.text.size();
+  for (const auto& piece : response->pieces) {
+    bytes += piece.size() + kPieceOverhead;
+  }
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> l(mtx_);
+    auto it = in_flight_.find(key);
+    if (it != in_flight_.end()) {
+      waiters = std::move(it->second);
+      in_flight_.erase(it);
+    }
+    if (bytes <= budget_bytes_ && entries_.count(&key) == 0) {
+      while (bytes_ + bytes > budget_bytes_ && !lru_.empty()) {
+        bytes_ -= lru_.back().bytes;
+        entries_.erase(&lru_.back().key);
+        lru_.pop_back();
+      }
+      lru_.push_front(Entry{key, response, bytes});
+      entries_.emplace(&lru_.front().key, lru_.begin());
+      bytes_ += bytes;
+    }
+  }
+  // Outside the lock, waiters reply to their clients
+  for (auto& waiter : waiters) {
+    waiter(response, Failure{});
+  }
+}
+
+void ResponseCache::Abandon(const Key& key, const Failure& failure) {
+  for (auto& waiter : TakeWaiters(key)) {
+    waiter(nullptr, failure);
+  }
+}
+
+bool ResponseCache::AbandonIfUnwaited(const Key& key) {
+  std::lock_guard<std::mutex> l(mtx_);
+  auto it = in_flight_.find(key);
+  if (it != in_flight_.end()) {
+    if (!it->second.empty()) {
+      return false;
+    }
+    in_flight_.erase(it);
+  }
+  return true;
+}
+
+std::vector<ResponseCache::Waiter> ResponseCache::TakeWaiters(
+    const Key& key) {
+  std::lock_guard<std::mutex> l(mtx_);
+  auto it = in_flight_.find(key);
+  if (it == in_flight_.end()) {
+    return {};
+  }
+  auto waiters = std::move(it->second);
+  in_flight_.erase(it);
+  return waiters;
+}
+
+ResponseCache::Stats ResponseCache::GetStats() {
+  std::lock_guard<std::mutex> l(mtx_);
+  return Stats{hits_,  misses_, coalesced_, entries_.size(),
+               bytes_, budget_bytes_};
+}
+}  // namespace cortex_onnx
@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cortex_onnx {
+// Completions of deterministic requests keyed by the rendered prompt and the
+// generation parameters, so that repeated requests
+// (evals, CI) are answered without running the model. Identical requests that
+// arrive while the first one is still generating wait for its result instead
+// of generating it again. Least-recently-used responses are evicted when the
+// cache grows over its byte budget.
+class ResponseCache {
+ public:
+  // The whole canonical request is compared, so that a hash collision can
+  // never answer with the response of another prompt
+  struct Key {
+    uint64_t hash = 0;
+    std::string text;
+    bool operator==(const Key& other) const {
+      return hash == other.hash && text == other.text;
+    }
+  };
+  struct Response {
+    // Decoded text of every generated token, so that a stream is replayed
+    // chunk by chunk
+    std::vector<std::string> pieces;
+    std::string finish_reason = "stop";
+    int prompt_tokens = 0;
+    int completion_tokens = 0;
+  };
+  // Why the request generating a response gave up, passed on to the
+  // requests that waited for it
+  struct Failure {
+    int status_code;
+    std::string message;
+    // Only set for 429 Too Many Requests
+    int retry_after_s = 0;
+  };
+  // Called with the response once the request generating it completes, or
+  // with null and the failure if it did not
+  using Waiter = std::function<void(std::shared_ptr<const Response>,
+                                    const Failure& failure)>;
+  enum class Lookup {
+    // `response` is set
+    kHit,
+    // Another request is generating this response, `waiter` will be called
+    kJoined,
+    // The caller generates the response and must `Complete` or `Abandon` it
+    kLead,
+  };
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t budget_bytes;
+  };
+
+  explicit ResponseCache(size_t budget_bytes) : budget_bytes_(budget_bytes) {}
+
+  // `params` holds every request field that changes the generated tokens
+  static Key MakeKey(std::string_view prompt, std::string_view params);
+
+  Lookup Acquire(const Key& key, std::shared_ptr<const Response>& response,
+                 Waiter waiter);
+  // Stores the response of a `kLead` lookup and hands it to the waiters
+  void Complete(const Key& key, std::shared_ptr<const Response> response);
+  // Fails the waiters of a `kLead` lookup, the next request generates again
+  void Abandon(const Key& key, const Failure& failure);
+  // Abandons a `kLead` lookup nobody waits for. Returns false, leaving it in
+  // flight, if another request waits for the response.
+  bool AbandonIfUnwaited(const Key& key);
+  Stats GetStats();
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return static_cast<size_t>(key.hash);
+    }
+    size_t operator()(const Key* key) const {
+      return static_cast<size_t>(key->hash);
+    }
+  };
+  struct KeyEqual {
+    bool operator()(const Key* a, const Key* b) const { return *a == *b; }
+  };
+  struct Entry {
+    Key key;
+    std::shared_ptr<const Response> response;
+    size_t bytes;
+  };
+
+  std::vector<Waiter> TakeWaiters(const Key& key);
+
+ private:
+  std::mutex mtx_;
+  size_t budget_bytes_;
+  size_t bytes_ = 0;
+  std::list<Entry> lru_;
+  // Keyed by the key held in the entry, so that the text is stored once
+  std::unordered_map<const Key*, std::list<Entry>::iterator, KeyHash, KeyEqual>
+      entries_;
+  // Responses being generated, with the requests waiting for them
+  std::unordered_map<Key, std::vector<Waiter>, KeyHash> in_flight_;
+
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t coalesced_ = 0;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,80 @@
+#pragma once
+#include <ctime>
+#include <string>
+#include <string_view>
+
+namespace cortex_onnx {
+// Renders OpenAI `chat.completion.chunk` server-sent events for one streaming
+// request. Everything but the delta content is rendered once, and each token
+// only JSON-escapes its content into a reused buffer.
+class SseChunkWriter {
+ public:
+  void Init(const std::string& id, const std::string& model) {
+    prefix_ = "data: {\"choices\":[{\"delta\":{\"content\":\"";
+    suffix_ = "\"},\"finish_reason\":null,\"index\":0}],";
+    tail_ = "\"created\":" + std::to_string(std::time(nullptr)) +
+            ",\"id\":\"" + id + "\",\"model\":\"" + model +
+            "\",\"object\":\"chat.completion.chunk\"}\n\n";
+    buffer_.reserve(prefix_.size() + suffix_.size() + tail_.size() + 64);
+  }
+
+  // The returned reference stays valid until the next call
+  const std::string& Write(std::string_view content) {
+    buffer_.clear();
+    buffer_ += prefix_;
+    AppendEscaped(content);
+    buffer_ += suffix_;
+    buffer_ += tail_;
+    return buffer_;
+  }
+
+  const std::string& WriteDone(std::string_view finish_reason) {
+    buffer_.clear();
+    buffer_ += prefix_;
+    buffer_ += "\"},\"finish_reason\":\"";
+    AppendEscaped(finish_reason);
+    buffer_ += "\",\"index\":0}],";
+    buffer_ += tail_;
+    buffer_ += "data: [DONE]\n\n";
+    return buffer_;
+  }
+
+ private:
+  void AppendEscaped(std::string_view s) {
+    static constexpr char kHex[] = "0123456789abcdef";
+    for (char c : s) {
+      switch (c) {
+        case '"':
+          buffer_ += "\\\"";
+          break;
+        case '\\':
+          buffer_ += "\\\\";
+          break;
+        case '\n':
+          buffer_ += "\\n";
+          break;
+        case '\r':
+          buffer_ += "\\r";
+          break;
+        case '\t':
+          buffer_ += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            buffer_ += "\\u00";
+            buffer_ += kHex[(c >> 4) & 0xF];
+            buffer_ += kHex[c & 0xF];
+          } else {
+            buffer_ += c;
+          }
+      }
+    }
+  }
+
+ private:
+  std::string prefix_;
+  std::string suffix_;
+  std::string tail_;
+  std::string buffer_;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,89 @@
+#include "stop_matcher.h"
+#include <algorithm>
+#include <queue>
+
+namespace cortex_onnx {
+StopMatcher::StopMatcher(const std::vector<std::string>& stops) {
+  bool any = std::any_of(stops.begin(), stops.end(),
+                         [](const std::string& s) { return !s.empty(); });
+  if (!any) {
+    return;
+  }
+  // Trie of the stop strings, -1 for missing edges
+  nodes_.emplace_back();
+  nodes_[0].next.fill(-1);
+  for (const auto& stop : stops) {
+    int32_t node = 0;
+    for (unsigned char c : stop) {
+      if (nodes_[node].next[c] < 0) {
+        nodes_[node].next[c] = static_cast<int32_t>(nodes_.size());
+        Node child;
+        child.next.fill(-1);
+        child.depth = nodes_[node].depth + 1;
+        nodes_.push_back(child);
+      }
+      node = nodes_[node].next[c];
+    }
+    if (!stop.empty()) {
+      nodes_[node].match = nodes_[node].depth;
+    }
+  }
+
+  // Breadth-first, resolve missing edges through the failure links so that
+  // matching is one table lookup per byte
+  std::vector<int32_t> fail(nodes_.size(), 0);
+  std::queue<int32_t> queue;
+  for (auto& child : nodes_[0].next) {
+    if (child < 0) {
+      child = 0;
+    } else {
+      queue.push(child);
+    }
+  }
+  while (!queue.empty()) {
+    auto node = queue.front();
+    queue.pop();
+    auto& n = nodes_[node];
+    n.match = std::max(n.match, nodes_[fail[node]].match);
+    for (int c = 0; c < 256; c++) {
+      auto child = n.next[c];
+      if (child < 0) {
+        n.next[c] = nodes_[fail[node]].next[c];
+      } else {
+        fail[child] = nodes_[fail[node]].next[c];
+        queue.push(child);
+      }
+    }
+  }
+}
+
+bool StopMatcher::Feed(std::string_view text, std::string& out) {
+  if (nodes_.empty()) {
+    out += text;
+    return false;
+  }
+  for (unsigned char c : text) {
+    held_ += static_cast<char>(c);
+    state_ = nodes_[state_].next[c];
+    const auto& node = nodes_[state_];
+    if (node.match > 0) {
+      out.append(held_, 0, held_.size() - node.match);
+      held_.clear();
+      return true;
+    }
+    // Only the part that may still grow into a stop string stays held
+    if (held_.size() > node.depth) {
+      auto released = held_.size() - node.depth;
+      out.append(held_, 0, released);
+      held_.erase(0, released);
+    }
+  }
+  return false;
+}
+
+void StopMatcher::Flush(std::string& out) {
+  out += held_;
+  held_.clear();
+  state_ = 0;
+}
+}  // namespace cortex_onnx
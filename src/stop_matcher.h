@@ -0,0 +1,42 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cortex_onnx {
+// Finds the first occurrence of any stop string in streamed text, with an
+// Aho-Corasick automaton compiled into a byte transition table. Text that may
+// still turn out to be the start of a stop string is held back, so a client
+// never receives part of a stop string.
+class StopMatcher {
+ public:
+  StopMatcher() = default;
+  // Empty strings are ignored
+  explicit StopMatcher(const std::vector<std::string>& stops);
+
+  bool empty() const { return nodes_.empty(); }
+
+  // Appends to `out` the text, `text` included, that can no longer be part
+  // of a stop string. Returns true once a stop string completes; `out` then
+  // ends right before it and the matcher must not be fed again.
+  bool Feed(std::string_view text, std::string& out);
+  // Appends the text held back at the end of the stream
+  void Flush(std::string& out);
+
+ private:
+  struct Node {
+    std::array<int32_t, 256> next;
+    // Length of the stop string prefix this node stands for
+    uint32_t depth = 0;
+    // Length of the longest stop string ending at this node, 0 if none
+    uint32_t match = 0;
+  };
+
+  std::vector<Node> nodes_;
+  int32_t state_ = 0;
+  // Suffix of the stream that is a prefix of some stop string
+  std::string held_;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace cortex_onnx {
+// Token counts of rendered messages keyed by a hash of their text, so that the
+// history of a conversation is not re-tokenized on every turn just to check
+// that it fits in the context window. Least-recently-used entries are evicted.
+class TokenCountCache {
+ public:
+  explicit TokenCountCache(size_t capacity) : capacity_(capacity) {}
+
+  bool Get(uint64_t key, int& count) {
+    std::lock_guard<std::mutex> l(mtx_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    count = it->second.count;
+    return true;
+  }
+
+  void Put(uint64_t key, int count) {
+    std::lock_guard<std::mutex> l(mtx_);
+    if (entries_.count(key) > 0 || capacity_ == 0) {
+      return;
+    }
+    if (entries_.size() >= capacity_) {
+      entries_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.push_front(key);
+    entries_.emplace(key, Entry{count, lru_.begin()});
+  }
+
+ private:
+  struct Entry {
+    int count;
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  size_t capacity_;
+  std::mutex mtx_;
+  std::list<uint64_t> lru_;
+  std::unordered_map<uint64_t, Entry> entries_;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,53 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ort_genai.h"
+
+namespace cortex_onnx {
+// Pre-created streaming detokenizers. A stream keeps detokenizer state
+// between tokens (an incomplete UTF-8 sequence, SentencePiece's leading space)
+// that cannot be reset, so every in-flight sequence takes a fresh one and
+// drops it when done. `Refill` replaces the streams taken, off the hot path.
+class TokenizerStreamPool {
+ public:
+  TokenizerStreamPool(const OgaTokenizer& tokenizer, size_t size)
+      : tokenizer_(tokenizer), size_(size) {
+    Refill();
+  }
+
+  std::unique_ptr<OgaTokenizerStream> Acquire() {
+    {
+      std::lock_guard<std::mutex> l(mtx_);
+      if (!streams_.empty()) {
+        auto stream = std::move(streams_.back());
+        streams_.pop_back();
+        return stream;
+      }
+    }
+    // More sequences in flight than pre-created streams
+    return OgaTokenizerStream::Create(tokenizer_);
+  }
+
+  // Creates streams until the pool is back to its size
+  void Refill() {
+    while (true) {
+      {
+        std::lock_guard<std::mutex> l(mtx_);
+        if (streams_.size() >= size_) {
+          return;
+        }
+      }
+      auto stream = OgaTokenizerStream::Create(tokenizer_);
+      std::lock_guard<std::mutex> l(mtx_);
+      streams_.push_back(std::move(stream));
+    }
+  }
+
+ private:
+  const OgaTokenizer& tokenizer_;
+  const size_t size_;
+  std::mutex mtx_;
+  std::vector<std::unique_ptr<OgaTokenizerStream>> streams_;
+};
+}  // namespace cortex_onnx
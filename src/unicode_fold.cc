@@ -0,0 +1,1132 @@
+// Generated by scripts/gen_unicode_fold.py from Unicode 14.0.0, do not edit.
+#include "unicode_fold.h"
+#include <algorithm>
+#include <iterator>
+
+namespace cortex_onnx {
+namespace {
+struct CodePointRange {
+  uint32_t first;
+  uint32_t last;
+};
+
+struct Fold {
+  uint32_t code_point;
+  uint32_t folded;
+};
+
+struct Expansion {
+  uint32_t code_point;
+  const char* utf8;
+};
+
+// Space separators (Zs), tab and line breaks
+constexpr CodePointRange kSpaces[] = {
+    {0x0009, 0x000A}, {0x000D, 0x000D}, {0x0020, 0x0020}, {0x00A0, 0x00A0},
+    {0x1680, 0x1680}, {0x2000, 0x200A}, {0x202F, 0x202F}, {0x205F, 0x205F},
+    {0x3000, 0x3000},
+};
+
+// Control (Cc) and format (Cf) characters but tab and line breaks
+constexpr CodePointRange kControls[] = {
+    {0x0000, 0x0008}, {0x000B, 0x000C}, {0x000E, 0x001F}, {0x007F, 0x009F},
+    {0x00AD, 0x00AD}, {0x0600, 0x0605}, {0x061C, 0x061C}, {0x06DD, 0x06DD},
+    {0x070F, 0x070F}, {0x0890, 0x0891}, {0x08E2, 0x08E2}, {0x180E, 0x180E},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x2066, 0x206F},
+    {0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB}, {0x110BD, 0x110BD}, {0x110CD, 0x110CD},
+    {0x13430, 0x13438}, {0x1BCA0, 0x1BCA3}, {0x1D173, 0x1D17A},
+    {0xE0001, 0xE0001}, {0xE0020, 0xE007F},
+};
+
+// Punctuation (P*) and non-alphanumeric ASCII
+constexpr CodePointRange kPunctuation[] = {
+    {0x0021, 0x002F}, {0x003A, 0x0040}, {0x005B, 0x0060}, {0x007B, 0x007E},
+    {0x00A1, 0x00A1}, {0x00A7, 0x00A7}, {0x00AB, 0x00AB}, {0x00B6, 0x00B7},
+    {0x00BB, 0x00BB}, {0x00BF, 0x00BF}, {0x037E, 0x037E}, {0x0387, 0x0387},
+    {0x055A, 0x055F}, {0x0589, 0x058A}, {0x05BE, 0x05BE}, {0x05C0, 0x05C0},
+    {0x05C3, 0x05C3}, {0x05C6, 0x05C6}, {0x05F3, 0x05F4}, {0x0609, 0x060A},
+    {0x060C, 0x060D}, {0x061B, 0x061B}, {0x061D, 0x061F}, {0x066A, 0x066D},
+    {0x06D4, 0x06D4}, {0x0700, 0x070D}, {0x07F7, 0x07F9}, {0x0830, 0x083E},
+    {0x085E, 0x085E}, {0x0964, 0x0965}, {0x0970, 0x0970}, {0x09FD, 0x09FD},
+    {0x0A76, 0x0A76}, {0x0AF0, 0x0AF0}, {0x0C77, 0x0C77}, {0x0C84, 0x0C84},
+    {0x0DF4, 0x0DF4}, {0x0E4F, 0x0E4F}, {0x0E5A, 0x0E5B}, {0x0F04, 0x0F12},
+    {0x0F14, 0x0F14}, {0x0F3A, 0x0F3D}, {0x0F85, 0x0F85}, {0x0FD0, 0x0FD4},
+    {0x0FD9, 0x0FDA}, {0x104A, 0x104F}, {0x10FB, 0x10FB}, {0x1360, 0x1368},
+    {0x1400, 0x1400}, {0x166E, 0x166E}, {0x169B, 0x169C}, {0x16EB, 0x16ED},
+    {0x1735, 0x1736}, {0x17D4, 0x17D6}, {0x17D8, 0x17DA}, {0x1800, 0x180A},
+    {0x1944, 0x1945}, {0x1A1E, 0x1A1F}, {0x1AA0, 0x1AA6}, {0x1AA8, 0x1AAD},
+    {0x1B5A, 0x1B60}, {0x1B7D, 0x1B7E}, {0x1BFC, 0x1BFF}, {0x1C3B, 0x1C3F},
+    {0x1C7E, 0x1C7F}, {0x1CC0, 0x1CC7}, {0x1CD3, 0x1CD3}, {0x2010, 0x2027},
+    {0x2030, 0x2043}, {0x2045, 0x2051}, {0x2053, 0x205E}, {0x207D, 0x207E},
+    {0x208D, 0x208E}, {0x2308, 0x230B}, {0x2329, 0x232A}, {0x2768, 0x2775},
+    {0x27C5, 0x27C6}, {0x27E6, 0x27EF}, {0x2983, 0x2998}, {0x29D8, 0x29DB},
+    {0x29FC, 0x29FD}, {0x2CF9, 0x2CFC}, {0x2CFE, 0x2CFF}, {0x2D70, 0x2D70},
+    {0x2E00, 0x2E2E}, {0x2E30, 0x2E4F}, {0x2E52, 0x2E5D}, {0x3001, 0x3003},
+    {0x3008, 0x3011}, {0x3014, 0x301F}, {0x3030, 0x3030}, {0x303D, 0x303D},
+    {0x30A0, 0x30A0}, {0x30FB, 0x30FB}, {0xA4FE, 0xA4FF}, {0xA60D, 0xA60F},
+    {0xA673, 0xA673}, {0xA67E, 0xA67E}, {0xA6F2, 0xA6F7}, {0xA874, 0xA877},
+    {0xA8CE, 0xA8CF}, {0xA8F8, 0xA8FA}, {0xA8FC, 0xA8FC}, {0xA92E, 0xA92F},
+    {0xA95F, 0xA95F}, {0xA9C1, 0xA9CD}, {0xA9DE, 0xA9DF}, {0xAA5C, 0xAA5F},
+    {0xAADE, 0xAADF}, {0xAAF0, 0xAAF1}, {0xABEB, 0xABEB}, {0xFD3E, 0xFD3F},
+    {0xFE10, 0xFE19}, {0xFE30, 0xFE52}, {0xFE54, 0xFE61}, {0xFE63, 0xFE63},
+    {0xFE68, 0xFE68}, {0xFE6A, 0xFE6B}, {0xFF01, 0xFF03}, {0xFF05, 0xFF0A},
+    {0xFF0C, 0xFF0F}, {0xFF1A, 0xFF1B}, {0xFF1F, 0xFF20}, {0xFF3B, 0xFF3D},
+    {0xFF3F, 0xFF3F}, {0xFF5B, 0xFF5B}, {0xFF5D, 0xFF5D}, {0xFF5F, 0xFF65},
+    {0x10100, 0x10102}, {0x1039F, 0x1039F}, {0x103D0, 0x103D0},
+    {0x1056F, 0x1056F}, {0x10857, 0x10857}, {0x1091F, 0x1091F},
+    {0x1093F, 0x1093F}, {0x10A50, 0x10A58}, {0x10A7F, 0x10A7F},
+    {0x10AF0, 0x10AF6}, {0x10B39, 0x10B3F}, {0x10B99, 0x10B9C},
+    {0x10EAD, 0x10EAD}, {0x10F55, 0x10F59}, {0x10F86, 0x10F89},
+    {0x11047, 0x1104D}, {0x110BB, 0x110BC}, {0x110BE, 0x110C1},
+    {0x11140, 0x11143}, {0x11174, 0x11175}, {0x111C5, 0x111C8},
+    {0x111CD, 0x111CD}, {0x111DB, 0x111DB}, {0x111DD, 0x111DF},
+    {0x11238, 0x1123D}, {0x112A9, 0x112A9}, {0x1144B, 0x1144F},
+    {0x1145A, 0x1145B}, {0x1145D, 0x1145D}, {0x114C6, 0x114C6},
+    {0x115C1, 0x115D7}, {0x11641, 0x11643}, {0x11660, 0x1166C},
+    {0x116B9, 0x116B9}, {0x1173C, 0x1173E}, {0x1183B, 0x1183B},
+    {0x11944, 0x11946}, {0x119E2, 0x119E2}, {0x11A3F, 0x11A46},
+    {0x11A9A, 0x11A9C}, {0x11A9E, 0x11AA2}, {0x11C41, 0x11C45},
+    {0x11C70, 0x11C71}, {0x11EF7, 0x11EF8}, {0x11FFF, 0x11FFF},
+    {0x12470, 0x12474}, {0x12FF1, 0x12FF2}, {0x16A6E, 0x16A6F},
+    {0x16AF5, 0x16AF5}, {0x16B37, 0x16B3B}, {0x16B44, 0x16B44},
+    {0x16E97, 0x16E9A}, {0x16FE2, 0x16FE2}, {0x1BC9F, 0x1BC9F},
+    {0x1DA87, 0x1DA8B}, {0x1E95E, 0x1E95F},
+};
+
+// Nonspacing marks (Mn), dropped
+constexpr CodePointRange kMarks[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0487}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+    {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x07FD, 0x07FD}, {0x0816, 0x0819},
+    {0x081B, 0x0823}, {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B},
+    {0x0898, 0x089F}, {0x08CA, 0x08E1}, {0x08E3, 0x0902}, {0x093A, 0x093A},
+    {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4},
+    {0x09CD, 0x09CD}, {0x09E2, 0x09E3}, {0x09FE, 0x09FE}, {0x0A01, 0x0A02},
+    {0x0A3C, 0x0A3C}, {0x0A41, 0x0A42}, {0x0A47, 0x0A48}, {0x0A4B, 0x0A4D},
+    {0x0A51, 0x0A51}, {0x0A70, 0x0A71}, {0x0A75, 0x0A75}, {0x0A81, 0x0A82},
+    {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC5}, {0x0AC7, 0x0AC8}, {0x0ACD, 0x0ACD},
+    {0x0AE2, 0x0AE3}, {0x0AFA, 0x0AFF}, {0x0B01, 0x0B01}, {0x0B3C, 0x0B3C},
+    {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B4D}, {0x0B55, 0x0B56},
+    {0x0B62, 0x0B63}, {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD},
+    {0x0C00, 0x0C00}, {0x0C04, 0x0C04}, {0x0C3C, 0x0C3C}, {0x0C3E, 0x0C40},
+    {0x0C46, 0x0C48}, {0x0C4A, 0x0C4D}, {0x0C55, 0x0C56}, {0x0C62, 0x0C63},
+    {0x0C81, 0x0C81}, {0x0CBC, 0x0CBC}, {0x0CBF, 0x0CBF}, {0x0CC6, 0x0CC6},
+    {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01}, {0x0D3B, 0x0D3C},
+    {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D}, {0x0D62, 0x0D63}, {0x0D81, 0x0D81},
+    {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD4}, {0x0DD6, 0x0DD6}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC},
+    {0x0EC8, 0x0ECD}, {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39}, {0x0F71, 0x0F7E}, {0x0F80, 0x0F84}, {0x0F86, 0x0F87},
+    {0x0F8D, 0x0F97}, {0x0F99, 0x0FBC}, {0x0FC6, 0x0FC6}, {0x102D, 0x1030},
+    {0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059},
+    {0x105E, 0x1060}, {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086},
+    {0x108D, 0x108D}, {0x109D, 0x109D}, {0x135D, 0x135F}, {0x1712, 0x1714},
+    {0x1732, 0x1733}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD},
+    {0x180B, 0x180D}, {0x180F, 0x180F}, {0x1885, 0x1886}, {0x18A9, 0x18A9},
+    {0x1920, 0x1922}, {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B},
+    {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B}, {0x1A56, 0x1A56}, {0x1A58, 0x1A5E},
+    {0x1A60, 0x1A60}, {0x1A62, 0x1A62}, {0x1A65, 0x1A6C}, {0x1A73, 0x1A7C},
+    {0x1A7F, 0x1A7F}, {0x1AB0, 0x1ABD}, {0x1ABF, 0x1ACE}, {0x1B00, 0x1B03},
+    {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42},
+    {0x1B6B, 0x1B73}, {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5}, {0x1BA8, 0x1BA9},
+    {0x1BAB, 0x1BAD}, {0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9}, {0x1BED, 0x1BED},
+    {0x1BEF, 0x1BF1}, {0x1C2C, 0x1C33}, {0x1C36, 0x1C37}, {0x1CD0, 0x1CD2},
+    {0x1CD4, 0x1CE0}, {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED}, {0x1CF4, 0x1CF4},
+    {0x1CF8, 0x1CF9}, {0x1DC0, 0x1DFF}, {0x20D0, 0x20DC}, {0x20E1, 0x20E1},
+    {0x20E5, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F}, {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA66F}, {0xA674, 0xA67D},
+    {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806},
+    {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xA82C, 0xA82C}, {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1}, {0xA8FF, 0xA8FF}, {0xA926, 0xA92D}, {0xA947, 0xA951},
+    {0xA980, 0xA982}, {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BD},
+    {0xA9E5, 0xA9E5}, {0xAA29, 0xAA2E}, {0xAA31, 0xAA32}, {0xAA35, 0xAA36},
+    {0xAA43, 0xAA43}, {0xAA4C, 0xAA4C}, {0xAA7C, 0xAA7C}, {0xAAB0, 0xAAB0},
+    {0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF}, {0xAAC1, 0xAAC1},
+    {0xAAEC, 0xAAED}, {0xAAF6, 0xAAF6}, {0xABE5, 0xABE5}, {0xABE8, 0xABE8},
+    {0xABED, 0xABED}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0x101FD, 0x101FD}, {0x102E0, 0x102E0}, {0x10376, 0x1037A},
+    {0x10A01, 0x10A03}, {0x10A05, 0x10A06}, {0x10A0C, 0x10A0F},
+    {0x10A38, 0x10A3A}, {0x10A3F, 0x10A3F}, {0x10AE5, 0x10AE6},
+    {0x10D24, 0x10D27}, {0x10EAB, 0x10EAC}, {0x10F46, 0x10F50},
+    {0x10F82, 0x10F85}, {0x11001, 0x11001}, {0x11038, 0x11046},
+    {0x11070, 0x11070}, {0x11073, 0x11074}, {0x1107F, 0x11081},
+    {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x110C2, 0x110C2},
+    {0x11100, 0x11102}, {0x11127, 0x1112B}, {0x1112D, 0x11134},
+    {0x11173, 0x11173}, {0x11180, 0x11181}, {0x111B6, 0x111BE},
+    {0x111C9, 0x111CC}, {0x111CF, 0x111CF}, {0x1122F, 0x11231},
+    {0x11234, 0x11234}, {0x11236, 0x11237}, {0x1123E, 0x1123E},
+    {0x112DF, 0x112DF}, {0x112E3, 0x112EA}, {0x11300, 0x11301},
+    {0x1133B, 0x1133C}, {0x11340, 0x11340}, {0x11366, 0x1136C},
+    {0x11370, 0x11374}, {0x11438, 0x1143F}, {0x11442, 0x11444},
+    {0x11446, 0x11446}, {0x1145E, 0x1145E}, {0x114B3, 0x114B8},
+    {0x114BA, 0x114BA}, {0x114BF, 0x114C0}, {0x114C2, 0x114C3},
+    {0x115B2, 0x115B5}, {0x115BC, 0x115BD}, {0x115BF, 0x115C0},
+    {0x115DC, 0x115DD}, {0x11633, 0x1163A}, {0x1163D, 0x1163D},
+    {0x1163F, 0x11640}, {0x116AB, 0x116AB}, {0x116AD, 0x116AD},
+    {0x116B0, 0x116B5}, {0x116B7, 0x116B7}, {0x1171D, 0x1171F},
+    {0x11722, 0x11725}, {0x11727, 0x1172B}, {0x1182F, 0x11837},
+    {0x11839, 0x1183A}, {0x1193B, 0x1193C}, {0x1193E, 0x1193E},
+    {0x11943, 0x11943}, {0x119D4, 0x119D7}, {0x119DA, 0x119DB},
+    {0x119E0, 0x119E0}, {0x11A01, 0x11A0A}, {0x11A33, 0x11A38},
+    {0x11A3B, 0x11A3E}, {0x11A47, 0x11A47}, {0x11A51, 0x11A56},
+    {0x11A59, 0x11A5B}, {0x11A8A, 0x11A96}, {0x11A98, 0x11A99},
+    {0x11C30, 0x11C36}, {0x11C38, 0x11C3D}, {0x11C3F, 0x11C3F},
+    {0x11C92, 0x11CA7}, {0x11CAA, 0x11CB0}, {0x11CB2, 0x11CB3},
+    {0x11CB5, 0x11CB6}, {0x11D31, 0x11D36}, {0x11D3A, 0x11D3A},
+    {0x11D3C, 0x11D3D}, {0x11D3F, 0x11D45}, {0x11D47, 0x11D47},
+    {0x11D90, 0x11D91}, {0x11D95, 0x11D95}, {0x11D97, 0x11D97},
+    {0x11EF3, 0x11EF4}, {0x16AF0, 0x16AF4}, {0x16B30, 0x16B36},
+    {0x16F4F, 0x16F4F}, {0x16F8F, 0x16F92}, {0x16FE4, 0x16FE4},
+    {0x1BC9D, 0x1BC9E}, {0x1CF00, 0x1CF2D}, {0x1CF30, 0x1CF46},
+    {0x1D167, 0x1D169}, {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B},
+    {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244}, {0x1DA00, 0x1DA36},
+    {0x1DA3B, 0x1DA6C}, {0x1DA75, 0x1DA75}, {0x1DA84, 0x1DA84},
+    {0x1DA9B, 0x1DA9F}, {0x1DAA1, 0x1DAAF}, {0x1E000, 0x1E006},
+    {0x1E008, 0x1E018}, {0x1E01B, 0x1E021}, {0x1E023, 0x1E024},
+    {0x1E026, 0x1E02A}, {0x1E130, 0x1E136}, {0x1E2AE, 0x1E2AE},
+    {0x1E2EC, 0x1E2EF}, {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A},
+    {0xE0100, 0xE01EF},
+};
+
+// Code points that fold to a single other one
+constexpr Fold kFolds[] = {
+    {0x0041, 0x0061}, {0x0042, 0x0062}, {0x0043, 0x0063}, {0x0044, 0x0064},
+    {0x0045, 0x0065}, {0x0046, 0x0066}, {0x0047, 0x0067}, {0x0048, 0x0068},
+    {0x0049, 0x0069}, {0x004A, 0x006A}, {0x004B, 0x006B}, {0x004C, 0x006C},
+    {0x004D, 0x006D}, {0x004E, 0x006E}, {0x004F, 0x006F}, {0x0050, 0x0070},
+    {0x0051, 0x0071}, {0x0052, 0x0072}, {0x0053, 0x0073}, {0x0054, 0x0074},
+    {0x0055, 0x0075}, {0x0056, 0x0076}, {0x0057, 0x0077}, {0x0058, 0x0078},
+    {0x0059, 0x0079}, {0x005A, 0x007A}, {0x00C0, 0x0061}, {0x00C1, 0x0061},
+    {0x00C2, 0x0061}, {0x00C3, 0x0061}, {0x00C4, 0x0061}, {0x00C5, 0x0061},
+    {0x00C6, 0x00E6}, {0x00C7, 0x0063}, {0x00C8, 0x0065}, {0x00C9, 0x0065},
+    {0x00CA, 0x0065}, {0x00CB, 0x0065}, {0x00CC, 0x0069}, {0x00CD, 0x0069},
+    {0x00CE, 0x0069}, {0x00CF, 0x0069}, {0x00D0, 0x00F0}, {0x00D1, 0x006E},
+    {0x00D2, 0x006F}, {0x00D3, 0x006F}, {0x00D4, 0x006F}, {0x00D5, 0x006F},
+    {0x00D6, 0x006F}, {0x00D8, 0x00F8}, {0x00D9, 0x0075}, {0x00DA, 0x0075},
+    {0x00DB, 0x0075}, {0x00DC, 0x0075}, {0x00DD, 0x0079}, {0x00DE, 0x00FE},
+    {0x00E0, 0x0061}, {0x00E1, 0x0061}, {0x00E2, 0x0061}, {0x00E3, 0x0061},
+    {0x00E4, 0x0061}, {0x00E5, 0x0061}, {0x00E7, 0x0063}, {0x00E8, 0x0065},
+    {0x00E9, 0x0065}, {0x00EA, 0x0065}, {0x00EB, 0x0065}, {0x00EC, 0x0069},
+    {0x00ED, 0x0069}, {0x00EE, 0x0069}, {0x00EF, 0x0069}, {0x00F1, 0x006E},
+    {0x00F2, 0x006F}, {0x00F3, 0x006F}, {0x00F4, 0x006F}, {0x00F5, 0x006F},
+    {0x00F6, 0x006F}, {0x00F9, 0x0075}, {0x00FA, 0x0075}, {0x00FB, 0x0075},
+    {0x00FC, 0x0075}, {0x00FD, 0x0079}, {0x00FF, 0x0079}, {0x0100, 0x0061},
+    {0x0101, 0x0061}, {0x0102, 0x0061}, {0x0103, 0x0061}, {0x0104, 0x0061},
+    {0x0105, 0x0061}, {0x0106, 0x0063}, {0x0107, 0x0063}, {0x0108, 0x0063},
+    {0x0109, 0x0063}, {0x010A, 0x0063}, {0x010B, 0x0063}, {0x010C, 0x0063},
+    {0x010D, 0x0063}, {0x010E, 0x0064}, {0x010F, 0x0064}, {0x0110, 0x0111},
+    {0x0112, 0x0065}, {0x0113, 0x0065}, {0x0114, 0x0065}, {0x0115, 0x0065},
+    {0x0116, 0x0065}, {0x0117, 0x0065}, {0x0118, 0x0065}, {0x0119, 0x0065},
+    {0x011A, 0x0065}, {0x011B, 0x0065}, {0x011C, 0x0067}, {0x011D, 0x0067},
+    {0x011E, 0x0067}, {0x011F, 0x0067}, {0x0120, 0x0067}, {0x0121, 0x0067},
+    {0x0122, 0x0067}, {0x0123, 0x0067}, {0x0124, 0x0068}, {0x0125, 0x0068},
+    {0x0126, 0x0127}, {0x0128, 0x0069}, {0x0129, 0x0069}, {0x012A, 0x0069},
+    {0x012B, 0x0069}, {0x012C, 0x0069}, {0x012D, 0x0069}, {0x012E, 0x0069},
+    {0x012F, 0x0069}, {0x0130, 0x0069}, {0x0132, 0x0133}, {0x0134, 0x006A},
+    {0x0135, 0x006A}, {0x0136, 0x006B}, {0x0137, 0x006B}, {0x0139, 0x006C},
+    {0x013A, 0x006C}, {0x013B, 0x006C}, {0x013C, 0x006C}, {0x013D, 0x006C},
+    {0x013E, 0x006C}, {0x013F, 0x0140}, {0x0141, 0x0142}, {0x0143, 0x006E},
+    {0x0144, 0x006E}, {0x0145, 0x006E}, {0x0146, 0x006E}, {0x0147, 0x006E},
+    {0x0148, 0x006E}, {0x014A, 0x014B}, {0x014C, 0x006F}, {0x014D, 0x006F},
+    {0x014E, 0x006F}, {0x014F, 0x006F}, {0x0150, 0x006F}, {0x0151, 0x006F},
+    {0x0152, 0x0153}, {0x0154, 0x0072}, {0x0155, 0x0072}, {0x0156, 0x0072},
+    {0x0157, 0x0072}, {0x0158, 0x0072}, {0x0159, 0x0072}, {0x015A, 0x0073},
+    {0x015B, 0x0073}, {0x015C, 0x0073}, {0x015D, 0x0073}, {0x015E, 0x0073},
+    {0x015F, 0x0073}, {0x0160, 0x0073}, {0x0161, 0x0073}, {0x0162, 0x0074},
+    {0x0163, 0x0074}, {0x0164, 0x0074}, {0x0165, 0x0074}, {0x0166, 0x0167},
+    {0x0168, 0x0075}, {0x0169, 0x0075}, {0x016A, 0x0075}, {0x016B, 0x0075},
+    {0x016C, 0x0075}, {0x016D, 0x0075}, {0x016E, 0x0075}, {0x016F, 0x0075},
+    {0x0170, 0x0075}, {0x0171, 0x0075}, {0x0172, 0x0075}, {0x0173, 0x0075},
+    {0x0174, 0x0077}, {0x0175, 0x0077}, {0x0176, 0x0079}, {0x0177, 0x0079},
+    {0x0178, 0x0079}, {0x0179, 0x007A}, {0x017A, 0x007A}, {0x017B, 0x007A},
+    {0x017C, 0x007A}, {0x017D, 0x007A}, {0x017E, 0x007A}, {0x0181, 0x0253},
+    {0x0182, 0x0183}, {0x0184, 0x0185}, {0x0186, 0x0254}, {0x0187, 0x0188},
+    {0x0189, 0x0256}, {0x018A, 0x0257}, {0x018B, 0x018C}, {0x018E, 0x01DD},
+    {0x018F, 0x0259}, {0x0190, 0x025B}, {0x0191, 0x0192}, {0x0193, 0x0260},
+    {0x0194, 0x0263}, {0x0196, 0x0269}, {0x0197, 0x0268}, {0x0198, 0x0199},
+    {0x019C, 0x026F}, {0x019D, 0x0272}, {0x019F, 0x0275}, {0x01A0, 0x006F},
+    {0x01A1, 0x006F}, {0x01A2, 0x01A3}, {0x01A4, 0x01A5}, {0x01A6, 0x0280},
+    {0x01A7, 0x01A8}, {0x01A9, 0x0283}, {0x01AC, 0x01AD}, {0x01AE, 0x0288},
+    {0x01AF, 0x0075}, {0x01B0, 0x0075}, {0x01B1, 0x028A}, {0x01B2, 0x028B},
+    {0x01B3, 0x01B4}, {0x01B5, 0x01B6}, {0x01B7, 0x0292}, {0x01B8, 0x01B9},
+    {0x01BC, 0x01BD}, {0x01C4, 0x01C6}, {0x01C5, 0x01C6}, {0x01C7, 0x01C9},
+    {0x01C8, 0x01C9}, {0x01CA, 0x01CC}, {0x01CB, 0x01CC}, {0x01CD, 0x0061},
+    {0x01CE, 0x0061}, {0x01CF, 0x0069}, {0x01D0, 0x0069}, {0x01D1, 0x006F},
+    {0x01D2, 0x006F}, {0x01D3, 0x0075}, {0x01D4, 0x0075}, {0x01D5, 0x0075},
+    {0x01D6, 0x0075}, {0x01D7, 0x0075}, {0x01D8, 0x0075}, {0x01D9, 0x0075},
+    {0x01DA, 0x0075}, {0x01DB, 0x0075}, {0x01DC, 0x0075}, {0x01DE, 0x0061},
+    {0x01DF, 0x0061}, {0x01E0, 0x0061}, {0x01E1, 0x0061}, {0x01E2, 0x00E6},
+    {0x01E3, 0x00E6}, {0x01E4, 0x01E5}, {0x01E6, 0x0067}, {0x01E7, 0x0067},
+    {0x01E8, 0x006B}, {0x01E9, 0x006B}, {0x01EA, 0x006F}, {0x01EB, 0x006F},
+    {0x01EC, 0x006F}, {0x01ED, 0x006F}, {0x01EE, 0x0292}, {0x01EF, 0x0292},
+    {0x01F0, 0x006A}, {0x01F1, 0x01F3}, {0x01F2, 0x01F3}, {0x01F4, 0x0067},
+    {0x01F5, 0x0067}, {0x01F6, 0x0195}, {0x01F7, 0x01BF}, {0x01F8, 0x006E},
+    {0x01F9, 0x006E}, {0x01FA, 0x0061}, {0x01FB, 0x0061}, {0x01FC, 0x00E6},
+    {0x01FD, 0x00E6}, {0x01FE, 0x00F8}, {0x01FF, 0x00F8}, {0x0200, 0x0061},
+    {0x0201, 0x0061}, {0x0202, 0x0061}, {0x0203, 0x0061}, {0x0204, 0x0065},
+    {0x0205, 0x0065}, {0x0206, 0x0065}, {0x0207, 0x0065}, {0x0208, 0x0069},
+    {0x0209, 0x0069}, {0x020A, 0x0069}, {0x020B, 0x0069}, {0x020C, 0x006F},
+    {0x020D, 0x006F}, {0x020E, 0x006F}, {0x020F, 0x006F}, {0x0210, 0x0072},
+    {0x0211, 0x0072}, {0x0212, 0x0072}, {0x0213, 0x0072}, {0x0214, 0x0075},
+    {0x0215, 0x0075}, {0x0216, 0x0075}, {0x0217, 0x0075}, {0x0218, 0x0073},
+    {0x0219, 0x0073}, {0x021A, 0x0074}, {0x021B, 0x0074}, {0x021C, 0x021D},
+    {0x021E, 0x0068}, {0x021F, 0x0068}, {0x0220, 0x019E}, {0x0222, 0x0223},
+    {0x0224, 0x0225}, {0x0226, 0x0061}, {0x0227, 0x0061}, {0x0228, 0x0065},
+    {0x0229, 0x0065}, {0x022A, 0x006F}, {0x022B, 0x006F}, {0x022C, 0x006F},
+    {0x022D, 0x006F}, {0x022E, 0x006F}, {0x022F, 0x006F}, {0x0230, 0x006F},
+    {0x0231, 0x006F}, {0x0232, 0x0079}, {0x0233, 0x0079}, {0x023A, 0x2C65},
+    {0x023B, 0x023C}, {0x023D, 0x019A}, {0x023E, 0x2C66}, {0x0241, 0x0242},
+    {0x0243, 0x0180}, {0x0244, 0x0289}, {0x0245, 0x028C}, {0x0246, 0x0247},
+    {0x0248, 0x0249}, {0x024A, 0x024B}, {0x024C, 0x024D}, {0x024E, 0x024F},
+    {0x0370, 0x0371}, {0x0372, 0x0373}, {0x0374, 0x02B9}, {0x0376, 0x0377},
+    {0x037E, 0x003B}, {0x037F, 0x03F3}, {0x0385, 0x00A8}, {0x0386, 0x03B1},
+    {0x0387, 0x00B7}, {0x0388, 0x03B5}, {0x0389, 0x03B7}, {0x038A, 0x03B9},
+    {0x038C, 0x03BF}, {0x038E, 0x03C5}, {0x038F, 0x03C9}, {0x0390, 0x03B9},
+    {0x0391, 0x03B1}, {0x0392, 0x03B2}, {0x0393, 0x03B3}, {0x0394, 0x03B4},
+    {0x0395, 0x03B5}, {0x0396, 0x03B6}, {0x0397, 0x03B7}, {0x0398, 0x03B8},
+    {0x0399, 0x03B9}, {0x039A, 0x03BA}, {0x039B, 0x03BB}, {0x039C, 0x03BC},
+    {0x039D, 0x03BD}, {0x039E, 0x03BE}, {0x039F, 0x03BF}, {0x03A0, 0x03C0},
+    {0x03A1, 0x03C1}, {0x03A3, 0x03C3}, {0x03A4, 0x03C4}, {0x03A5, 0x03C5},
+    {0x03A6, 0x03C6}, {0x03A7, 0x03C7}, {0x03A8, 0x03C8}, {0x03A9, 0x03C9},
+    {0x03AA, 0x03B9}, {0x03AB, 0x03C5}, {0x03AC, 0x03B1}, {0x03AD, 0x03B5},
+    {0x03AE, 0x03B7}, {0x03AF, 0x03B9}, {0x03B0, 0x03C5}, {0x03CA, 0x03B9},
+    {0x03CB, 0x03C5}, {0x03CC, 0x03BF}, {0x03CD, 0x03C5}, {0x03CE, 0x03C9},
+    {0x03CF, 0x03D7}, {0x03D3, 0x03D2}, {0x03D4, 0x03D2}, {0x03D8, 0x03D9},
+    {0x03DA, 0x03DB}, {0x03DC, 0x03DD}, {0x03DE, 0x03DF}, {0x03E0, 0x03E1},
+    {0x03E2, 0x03E3}, {0x03E4, 0x03E5}, {0x03E6, 0x03E7}, {0x03E8, 0x03E9},
+    {0x03EA, 0x03EB}, {0x03EC, 0x03ED}, {0x03EE, 0x03EF}, {0x03F4, 0x03B8},
+    {0x03F7, 0x03F8}, {0x03F9, 0x03F2}, {0x03FA, 0x03FB}, {0x03FD, 0x037B},
+    {0x03FE, 0x037C}, {0x03FF, 0x037D}, {0x0400, 0x0435}, {0x0401, 0x0435},
+    {0x0402, 0x0452}, {0x0403, 0x0433}, {0x0404, 0x0454}, {0x0405, 0x0455},
+    {0x0406, 0x0456}, {0x0407, 0x0456}, {0x0408, 0x0458}, {0x0409, 0x0459},
+    {0x040A, 0x045A}, {0x040B, 0x045B}, {0x040C, 0x043A}, {0x040D, 0x0438},
+    {0x040E, 0x0443}, {0x040F, 0x045F}, {0x0410, 0x0430}, {0x0411, 0x0431},
+    {0x0412, 0x0432}, {0x0413, 0x0433}, {0x0414, 0x0434}, {0x0415, 0x0435},
+    {0x0416, 0x0436}, {0x0417, 0x0437}, {0x0418, 0x0438}, {0x0419, 0x0438},
+    {0x041A, 0x043A}, {0x041B, 0x043B}, {0x041C, 0x043C}, {0x041D, 0x043D},
+    {0x041E, 0x043E}, {0x041F, 0x043F}, {0x0420, 0x0440}, {0x0421, 0x0441},
+    {0x0422, 0x0442}, {0x0423, 0x0443}, {0x0424, 0x0444}, {0x0425, 0x0445},
+    {0x0426, 0x0446}, {0x0427, 0x0447}, {0x0428, 0x0448}, {0x0429, 0x0449},
+    {0x042A, 0x044A}, {0x042B, 0x044B}, {0x042C, 0x044C}, {0x042D, 0x044D},
+    {0x042E, 0x044E}, {0x042F, 0x044F}, {0x0439, 0x0438}, {0x0450, 0x0435},
+    {0x0451, 0x0435}, {0x0453, 0x0433}, {0x0457, 0x0456}, {0x045C, 0x043A},
+    {0x045D, 0x0438}, {0x045E, 0x0443}, {0x0460, 0x0461}, {0x0462, 0x0463},
+    {0x0464, 0x0465}, {0x0466, 0x0467}, {0x0468, 0x0469}, {0x046A, 0x046B},
+    {0x046C, 0x046D}, {0x046E, 0x046F}, {0x0470, 0x0471}, {0x0472, 0x0473},
+    {0x0474, 0x0475}, {0x0476, 0x0475}, {0x0477, 0x0475}, {0x0478, 0x0479},
+    {0x047A, 0x047B}, {0x047C, 0x047D}, {0x047E, 0x047F}, {0x0480, 0x0481},
+    {0x048A, 0x048B}, {0x048C, 0x048D}, {0x048E, 0x048F}, {0x0490, 0x0491},
+    {0x0492, 0x0493}, {0x0494, 0x0495}, {0x0496, 0x0497}, {0x0498, 0x0499},
+    {0x049A, 0x049B}, {0x049C, 0x049D}, {0x049E, 0x049F}, {0x04A0, 0x04A1},
+    {0x04A2, 0x04A3}, {0x04A4, 0x04A5}, {0x04A6, 0x04A7}, {0x04A8, 0x04A9},
+    {0x04AA, 0x04AB}, {0x04AC, 0x04AD}, {0x04AE, 0x04AF}, {0x04B0, 0x04B1},
+    {0x04B2, 0x04B3}, {0x04B4, 0x04B5}, {0x04B6, 0x04B7}, {0x04B8, 0x04B9},
+    {0x04BA, 0x04BB}, {0x04BC, 0x04BD}, {0x04BE, 0x04BF}, {0x04C0, 0x04CF},
+    {0x04C1, 0x0436}, {0x04C2, 0x0436}, {0x04C3, 0x04C4}, {0x04C5, 0x04C6},
+    {0x04C7, 0x04C8}, {0x04C9, 0x04CA}, {0x04CB, 0x04CC}, {0x04CD, 0x04CE},
+    {0x04D0, 0x0430}, {0x04D1, 0x0430}, {0x04D2, 0x0430}, {0x04D3, 0x0430},
+    {0x04D4, 0x04D5}, {0x04D6, 0x0435}, {0x04D7, 0x0435}, {0x04D8, 0x04D9},
+    {0x04DA, 0x04D9}, {0x04DB, 0x04D9}, {0x04DC, 0x0436}, {0x04DD, 0x0436},
+    {0x04DE, 0x0437}, {0x04DF, 0x0437}, {0x04E0, 0x04E1}, {0x04E2, 0x0438},
+    {0x04E3, 0x0438}, {0x04E4, 0x0438}, {0x04E5, 0x0438}, {0x04E6, 0x043E},
+    {0x04E7, 0x043E}, {0x04E8, 0x04E9}, {0x04EA, 0x04E9}, {0x04EB, 0x04E9},
+    {0x04EC, 0x044D}, {0x04ED, 0x044D}, {0x04EE, 0x0443}, {0x04EF, 0x0443},
+    {0x04F0, 0x0443}, {0x04F1, 0x0443}, {0x04F2, 0x0443}, {0x04F3, 0x0443},
+    {0x04F4, 0x0447}, {0x04F5, 0x0447}, {0x04F6, 0x04F7}, {0x04F8, 0x044B},
+    {0x04F9, 0x044B}, {0x04FA, 0x04FB}, {0x04FC, 0x04FD}, {0x04FE, 0x04FF},
+    {0x0500, 0x0501}, {0x0502, 0x0503}, {0x0504, 0x0505}, {0x0506, 0x0507},
+    {0x0508, 0x0509}, {0x050A, 0x050B}, {0x050C, 0x050D}, {0x050E, 0x050F},
+    {0x0510, 0x0511}, {0x0512, 0x0513}, {0x0514, 0x0515}, {0x0516, 0x0517},
+    {0x0518, 0x0519}, {0x051A, 0x051B}, {0x051C, 0x051D}, {0x051E, 0x051F},
+    {0x0520, 0x0521}, {0x0522, 0x0523}, {0x0524, 0x0525}, {0x0526, 0x0527},
+    {0x0528, 0x0529}, {0x052A, 0x052B}, {0x052C, 0x052D}, {0x052E, 0x052F},
+    {0x0531, 0x0561}, {0x0532, 0x0562}, {0x0533, 0x0563}, {0x0534, 0x0564},
+    {0x0535, 0x0565}, {0x0536, 0x0566}, {0x0537, 0x0567}, {0x0538, 0x0568},
+    {0x0539, 0x0569}, {0x053A, 0x056A}, {0x053B, 0x056B}, {0x053C, 0x056C},
+    {0x053D, 0x056D}, {0x053E, 0x056E}, {0x053F, 0x056F}, {0x0540, 0x0570},
+    {0x0541, 0x0571}, {0x0542, 0x0572}, {0x0543, 0x0573}, {0x0544, 0x0574},
+    {0x0545, 0x0575}, {0x0546, 0x0576}, {0x0547, 0x0577}, {0x0548, 0x0578},
+    {0x0549, 0x0579}, {0x054A, 0x057A}, {0x054B, 0x057B}, {0x054C, 0x057C},
+    {0x054D, 0x057D}, {0x054E, 0x057E}, {0x054F, 0x057F}, {0x0550, 0x0580},
+    {0x0551, 0x0581}, {0x0552, 0x0582}, {0x0553, 0x0583}, {0x0554, 0x0584},
+    {0x0555, 0x0585}, {0x0556, 0x0586}, {0x0622, 0x0627}, {0x0623, 0x0627},
+    {0x0624, 0x0648}, {0x0625, 0x0627}, {0x0626, 0x064A}, {0x06C0, 0x06D5},
+    {0x06C2, 0x06C1}, {0x06D3, 0x06D2}, {0x0929, 0x0928}, {0x0931, 0x0930},
+    {0x0934, 0x0933}, {0x0958, 0x0915}, {0x0959, 0x0916}, {0x095A, 0x0917},
+    {0x095B, 0x091C}, {0x095C, 0x0921}, {0x095D, 0x0922}, {0x095E, 0x092B},
+    {0x095F, 0x092F}, {0x09DC, 0x09A1}, {0x09DD, 0x09A2}, {0x09DF, 0x09AF},
+    {0x0A33, 0x0A32}, {0x0A36, 0x0A38}, {0x0A59, 0x0A16}, {0x0A5A, 0x0A17},
+    {0x0A5B, 0x0A1C}, {0x0A5E, 0x0A2B}, {0x0B48, 0x0B47}, {0x0B5C, 0x0B21},
+    {0x0B5D, 0x0B22}, {0x0CC0, 0x0CD5}, {0x0CC7, 0x0CD5}, {0x0CC8, 0x0CD6},
+    {0x0CCA, 0x0CC2}, {0x0DDA, 0x0DD9}, {0x0F43, 0x0F42}, {0x0F4D, 0x0F4C},
+    {0x0F52, 0x0F51}, {0x0F57, 0x0F56}, {0x0F5C, 0x0F5B}, {0x0F69, 0x0F40},
+    {0x1026, 0x1025}, {0x10A0, 0x2D00}, {0x10A1, 0x2D01}, {0x10A2, 0x2D02},
+    {0x10A3, 0x2D03}, {0x10A4, 0x2D04}, {0x10A5, 0x2D05}, {0x10A6, 0x2D06},
+    {0x10A7, 0x2D07}, {0x10A8, 0x2D08}, {0x10A9, 0x2D09}, {0x10AA, 0x2D0A},
+    {0x10AB, 0x2D0B}, {0x10AC, 0x2D0C}, {0x10AD, 0x2D0D}, {0x10AE, 0x2D0E},
+    {0x10AF, 0x2D0F}, {0x10B0, 0x2D10}, {0x10B1, 0x2D11}, {0x10B2, 0x2D12},
+    {0x10B3, 0x2D13}, {0x10B4, 0x2D14}, {0x10B5, 0x2D15}, {0x10B6, 0x2D16},
+    {0x10B7, 0x2D17}, {0x10B8, 0x2D18}, {0x10B9, 0x2D19}, {0x10BA, 0x2D1A},
+    {0x10BB, 0x2D1B}, {0x10BC, 0x2D1C}, {0x10BD, 0x2D1D}, {0x10BE, 0x2D1E},
+    {0x10BF, 0x2D1F}, {0x10C0, 0x2D20}, {0x10C1, 0x2D21}, {0x10C2, 0x2D22},
+    {0x10C3, 0x2D23}, {0x10C4, 0x2D24}, {0x10C5, 0x2D25}, {0x10C7, 0x2D27},
+    {0x10CD, 0x2D2D}, {0x13A0, 0xAB70}, {0x13A1, 0xAB71}, {0x13A2, 0xAB72},
+    {0x13A3, 0xAB73}, {0x13A4, 0xAB74}, {0x13A5, 0xAB75}, {0x13A6, 0xAB76},
+    {0x13A7, 0xAB77}, {0x13A8, 0xAB78}, {0x13A9, 0xAB79}, {0x13AA, 0xAB7A},
+    {0x13AB, 0xAB7B}, {0x13AC, 0xAB7C}, {0x13AD, 0xAB7D}, {0x13AE, 0xAB7E},
+    {0x13AF, 0xAB7F}, {0x13B0, 0xAB80}, {0x13B1, 0xAB81}, {0x13B2, 0xAB82},
+    {0x13B3, 0xAB83}, {0x13B4, 0xAB84}, {0x13B5, 0xAB85}, {0x13B6, 0xAB86},
+    {0x13B7, 0xAB87}, {0x13B8, 0xAB88}, {0x13B9, 0xAB89}, {0x13BA, 0xAB8A},
+    {0x13BB, 0xAB8B}, {0x13BC, 0xAB8C}, {0x13BD, 0xAB8D}, {0x13BE, 0xAB8E},
+    {0x13BF, 0xAB8F}, {0x13C0, 0xAB90}, {0x13C1, 0xAB91}, {0x13C2, 0xAB92},
+    {0x13C3, 0xAB93}, {0x13C4, 0xAB94}, {0x13C5, 0xAB95}, {0x13C6, 0xAB96},
+    {0x13C7, 0xAB97}, {0x13C8, 0xAB98}, {0x13C9, 0xAB99}, {0x13CA, 0xAB9A},
+    {0x13CB, 0xAB9B}, {0x13CC, 0xAB9C}, {0x13CD, 0xAB9D}, {0x13CE, 0xAB9E},
+    {0x13CF, 0xAB9F}, {0x13D0, 0xABA0}, {0x13D1, 0xABA1}, {0x13D2, 0xABA2},
+    {0x13D3, 0xABA3}, {0x13D4, 0xABA4}, {0x13D5, 0xABA5}, {0x13D6, 0xABA6},
+    {0x13D7, 0xABA7}, {0x13D8, 0xABA8}, {0x13D9, 0xABA9}, {0x13DA, 0xABAA},
+    {0x13DB, 0xABAB}, {0x13DC, 0xABAC}, {0x13DD, 0xABAD}, {0x13DE, 0xABAE},
+    {0x13DF, 0xABAF}, {0x13E0, 0xABB0}, {0x13E1, 0xABB1}, {0x13E2, 0xABB2},
+    {0x13E3, 0xABB3}, {0x13E4, 0xABB4}, {0x13E5, 0xABB5}, {0x13E6, 0xABB6},
+    {0x13E7, 0xABB7}, {0x13E8, 0xABB8}, {0x13E9, 0xABB9}, {0x13EA, 0xABBA},
+    {0x13EB, 0xABBB}, {0x13EC, 0xABBC}, {0x13ED, 0xABBD}, {0x13EE, 0xABBE},
+    {0x13EF, 0xABBF}, {0x13F0, 0x13F8}, {0x13F1, 0x13F9}, {0x13F2, 0x13FA},
+    {0x13F3, 0x13FB}, {0x13F4, 0x13FC}, {0x13F5, 0x13FD}, {0x1B3B, 0x1B35},
+    {0x1B3D, 0x1B35}, {0x1B43, 0x1B35}, {0x1C90, 0x10D0}, {0x1C91, 0x10D1},
+    {0x1C92, 0x10D2}, {0x1C93, 0x10D3}, {0x1C94, 0x10D4}, {0x1C95, 0x10D5},
+    {0x1C96, 0x10D6}, {0x1C97, 0x10D7}, {0x1C98, 0x10D8}, {0x1C99, 0x10D9},
+    {0x1C9A, 0x10DA}, {0x1C9B, 0x10DB}, {0x1C9C, 0x10DC}, {0x1C9D, 0x10DD},
+    {0x1C9E, 0x10DE}, {0x1C9F, 0x10DF}, {0x1CA0, 0x10E0}, {0x1CA1, 0x10E1},
+    {0x1CA2, 0x10E2}, {0x1CA3, 0x10E3}, {0x1CA4, 0x10E4}, {0x1CA5, 0x10E5},
+    {0x1CA6, 0x10E6}, {0x1CA7, 0x10E7}, {0x1CA8, 0x10E8}, {0x1CA9, 0x10E9},
+    {0x1CAA, 0x10EA}, {0x1CAB, 0x10EB}, {0x1CAC, 0x10EC}, {0x1CAD, 0x10ED},
+    {0x1CAE, 0x10EE}, {0x1CAF, 0x10EF}, {0x1CB0, 0x10F0}, {0x1CB1, 0x10F1},
+    {0x1CB2, 0x10F2}, {0x1CB3, 0x10F3}, {0x1CB4, 0x10F4}, {0x1CB5, 0x10F5},
+    {0x1CB6, 0x10F6}, {0x1CB7, 0x10F7}, {0x1CB8, 0x10F8}, {0x1CB9, 0x10F9},
+    {0x1CBA, 0x10FA}, {0x1CBD, 0x10FD}, {0x1CBE, 0x10FE}, {0x1CBF, 0x10FF},
+    {0x1E00, 0x0061}, {0x1E01, 0x0061}, {0x1E02, 0x0062}, {0x1E03, 0x0062},
+    {0x1E04, 0x0062}, {0x1E05, 0x0062}, {0x1E06, 0x0062}, {0x1E07, 0x0062},
+    {0x1E08, 0x0063}, {0x1E09, 0x0063}, {0x1E0A, 0x0064}, {0x1E0B, 0x0064},
+    {0x1E0C, 0x0064}, {0x1E0D, 0x0064}, {0x1E0E, 0x0064}, {0x1E0F, 0x0064},
+    {0x1E10, 0x0064}, {0x1E11, 0x0064}, {0x1E12, 0x0064}, {0x1E13, 0x0064},
+    {0x1E14, 0x0065}, {0x1E15, 0x0065}, {0x1E16, 0x0065}, {0x1E17, 0x0065},
+    {0x1E18, 0x0065}, {0x1E19, 0x0065}, {0x1E1A, 0x0065}, {0x1E1B, 0x0065},
+    {0x1E1C, 0x0065}, {0x1E1D, 0x0065}, {0x1E1E, 0x0066}, {0x1E1F, 0x0066},
+    {0x1E20, 0x0067}, {0x1E21, 0x0067}, {0x1E22, 0x0068}, {0x1E23, 0x0068},
+    {0x1E24, 0x0068}, {0x1E25, 0x0068}, {0x1E26, 0x0068}, {0x1E27, 0x0068},
+    {0x1E28, 0x0068}, {0x1E29, 0x0068}, {0x1E2A, 0x0068}, {0x1E2B, 0x0068},
+    {0x1E2C, 0x0069}, {0x1E2D, 0x0069}, {0x1E2E, 0x0069}, {0x1E2F, 0x0069},
+    {0x1E30, 0x006B}, {0x1E31, 0x006B}, {0x1E32, 0x006B}, {0x1E33, 0x006B},
+    {0x1E34, 0x006B}, {0x1E35, 0x006B}, {0x1E36, 0x006C}, {0x1E37, 0x006C},
+    {0x1E38, 0x006C}, {0x1E39, 0x006C}, {0x1E3A, 0x006C}, {0x1E3B, 0x006C},
+    {0x1E3C, 0x006C}, {0x1E3D, 0x006C}, {0x1E3E, 0x006D}, {0x1E3F, 0x006D},
+    {0x1E40, 0x006D}, {0x1E41, 0x006D}, {0x1E42, 0x006D}, {0x1E43, 0x006D},
+    {0x1E44, 0x006E}, {0x1E45, 0x006E}, {0x1E46, 0x006E}, {0x1E47, 0x006E},
+    {0x1E48, 0x006E}, {0x1E49, 0x006E}, {0x1E4A, 0x006E}, {0x1E4B, 0x006E},
+    {0x1E4C, 0x006F}, {0x1E4D, 0x006F}, {0x1E4E, 0x006F}, {0x1E4F, 0x006F},
+    {0x1E50, 0x006F}, {0x1E51, 0x006F}, {0x1E52, 0x006F}, {0x1E53, 0x006F},
+    {0x1E54, 0x0070}, {0x1E55, 0x0070}, {0x1E56, 0x0070}, {0x1E57, 0x0070},
+    {0x1E58, 0x0072}, {0x1E59, 0x0072}, {0x1E5A, 0x0072}, {0x1E5B, 0x0072},
+    {0x1E5C, 0x0072}, {0x1E5D, 0x0072}, {0x1E5E, 0x0072}, {0x1E5F, 0x0072},
+    {0x1E60, 0x0073}, {0x1E61, 0x0073}, {0x1E62, 0x0073}, {0x1E63, 0x0073},
+    {0x1E64, 0x0073}, {0x1E65, 0x0073}, {0x1E66, 0x0073}, {0x1E67, 0x0073},
+    {0x1E68, 0x0073}, {0x1E69, 0x0073}, {0x1E6A, 0x0074}, {0x1E6B, 0x0074},
+    {0x1E6C, 0x0074}, {0x1E6D, 0x0074}, {0x1E6E, 0x0074}, {0x1E6F, 0x0074},
+    {0x1E70, 0x0074}, {0x1E71, 0x0074}, {0x1E72, 0x0075}, {0x1E73, 0x0075},
+    {0x1E74, 0x0075}, {0x1E75, 0x0075}, {0x1E76, 0x0075}, {0x1E77, 0x0075},
+    {0x1E78, 0x0075}, {0x1E79, 0x0075}, {0x1E7A, 0x0075}, {0x1E7B, 0x0075},
+    {0x1E7C, 0x0076}, {0x1E7D, 0x0076}, {0x1E7E, 0x0076}, {0x1E7F, 0x0076},
+    {0x1E80, 0x0077}, {0x1E81, 0x0077}, {0x1E82, 0x0077}, {0x1E83, 0x0077},
+    {0x1E84, 0x0077}, {0x1E85, 0x0077}, {0x1E86, 0x0077}, {0x1E87, 0x0077},
+    {0x1E88, 0x0077}, {0x1E89, 0x0077}, {0x1E8A, 0x0078}, {0x1E8B, 0x0078},
+    {0x1E8C, 0x0078}, {0x1E8D, 0x0078}, {0x1E8E, 0x0079}, {0x1E8F, 0x0079},
+    {0x1E90, 0x007A}, {0x1E91, 0x007A}, {0x1E92, 0x007A}, {0x1E93, 0x007A},
+    {0x1E94, 0x007A}, {0x1E95, 0x007A}, {0x1E96, 0x0068}, {0x1E97, 0x0074},
+    {0x1E98, 0x0077}, {0x1E99, 0x0079}, {0x1E9B, 0x017F}, {0x1E9E, 0x00DF},
+    {0x1EA0, 0x0061}, {0x1EA1, 0x0061}, {0x1EA2, 0x0061}, {0x1EA3, 0x0061},
+    {0x1EA4, 0x0061}, {0x1EA5, 0x0061}, {0x1EA6, 0x0061}, {0x1EA7, 0x0061},
+    {0x1EA8, 0x0061}, {0x1EA9, 0x0061}, {0x1EAA, 0x0061}, {0x1EAB, 0x0061},
+    {0x1EAC, 0x0061}, {0x1EAD, 0x0061}, {0x1EAE, 0x0061}, {0x1EAF, 0x0061},
+    {0x1EB0, 0x0061}, {0x1EB1, 0x0061}, {0x1EB2, 0x0061}, {0x1EB3, 0x0061},
+    {0x1EB4, 0x0061}, {0x1EB5, 0x0061}, {0x1EB6, 0x0061}, {0x1EB7, 0x0061},
+    {0x1EB8, 0x0065}, {0x1EB9, 0x0065}, {0x1EBA, 0x0065}, {0x1EBB, 0x0065},
+    {0x1EBC, 0x0065}, {0x1EBD, 0x0065}, {0x1EBE, 0x0065}, {0x1EBF, 0x0065},
+    {0x1EC0, 0x0065}, {0x1EC1, 0x0065}, {0x1EC2, 0x0065}, {0x1EC3, 0x0065},
+    {0x1EC4, 0x0065}, {0x1EC5, 0x0065}, {0x1EC6, 0x0065}, {0x1EC7, 0x0065},
+    {0x1EC8, 0x0069}, {0x1EC9, 0x0069}, {0x1ECA, 0x0069}, {0x1ECB, 0x0069},
+    {0x1ECC, 0x006F}, {0x1ECD, 0x006F}, {0x1ECE, 0x006F}, {0x1ECF, 0x006F},
+    {0x1ED0, 0x006F}, {0x1ED1, 0x006F}, {0x1ED2, 0x006F}, {0x1ED3, 0x006F},
+    {0x1ED4, 0x006F}, {0x1ED5, 0x006F}, {0x1ED6, 0x006F}, {0x1ED7, 0x006F},
+    {0x1ED8, 0x006F}, {0x1ED9, 0x006F}, {0x1EDA, 0x006F}, {0x1EDB, 0x006F},
+    {0x1EDC, 0x006F}, {0x1EDD, 0x006F}, {0x1EDE, 0x006F}, {0x1EDF, 0x006F},
+    {0x1EE0, 0x006F}, {0x1EE1, 0x006F}, {0x1EE2, 0x006F}, {0x1EE3, 0x006F},
+    {0x1EE4, 0x0075}, {0x1EE5, 0x0075}, {0x1EE6, 0x0075}, {0x1EE7, 0x0075},
+    {0x1EE8, 0x0075}, {0x1EE9, 0x0075}, {0x1EEA, 0x0075}, {0x1EEB, 0x0075},
+    {0x1EEC, 0x0075}, {0x1EED, 0x0075}, {0x1EEE, 0x0075}, {0x1EEF, 0x0075},
+    {0x1EF0, 0x0075}, {0x1EF1, 0x0075}, {0x1EF2, 0x0079}, {0x1EF3, 0x0079},
+    {0x1EF4, 0x0079}, {0x1EF5, 0x0079}, {0x1EF6, 0x0079}, {0x1EF7, 0x0079},
+    {0x1EF8, 0x0079}, {0x1EF9, 0x0079}, {0x1EFA, 0x1EFB}, {0x1EFC, 0x1EFD},
+    {0x1EFE, 0x1EFF}, {0x1F00, 0x03B1}, {0x1F01, 0x03B1}, {0x1F02, 0x03B1},
+    {0x1F03, 0x03B1}, {0x1F04, 0x03B1}, {0x1F05, 0x03B1}, {0x1F06, 0x03B1},
+    {0x1F07, 0x03B1}, {0x1F08, 0x03B1}, {0x1F09, 0x03B1}, {0x1F0A, 0x03B1},
+    {0x1F0B, 0x03B1}, {0x1F0C, 0x03B1}, {0x1F0D, 0x03B1}, {0x1F0E, 0x03B1},
+    {0x1F0F, 0x03B1}, {0x1F10, 0x03B5}, {0x1F11, 0x03B5}, {0x1F12, 0x03B5},
+    {0x1F13, 0x03B5}, {0x1F14, 0x03B5}, {0x1F15, 0x03B5}, {0x1F18, 0x03B5},
+    {0x1F19, 0x03B5}, {0x1F1A, 0x03B5}, {0x1F1B, 0x03B5}, {0x1F1C, 0x03B5},
+    {0x1F1D, 0x03B5}, {0x1F20, 0x03B7}, {0x1F21, 0x03B7}, {0x1F22, 0x03B7},
+    {0x1F23, 0x03B7}, {0x1F24, 0x03B7}, {0x1F25, 0x03B7}, {0x1F26, 0x03B7},
+    {0x1F27, 0x03B7}, {0x1F28, 0x03B7}, {0x1F29, 0x03B7}, {0x1F2A, 0x03B7},
+    {0x1F2B, 0x03B7}, {0x1F2C, 0x03B7}, {0x1F2D, 0x03B7}, {0x1F2E, 0x03B7},
+    {0x1F2F, 0x03B7}, {0x1F30, 0x03B9}, {0x1F31, 0x03B9}, {0x1F32, 0x03B9},
+    {0x1F33, 0x03B9}, {0x1F34, 0x03B9}, {0x1F35, 0x03B9}, {0x1F36, 0x03B9},
+    {0x1F37, 0x03B9}, {0x1F38, 0x03B9}, {0x1F39, 0x03B9}, {0x1F3A, 0x03B9},
+    {0x1F3B, 0x03B9}, {0x1F3C, 0x03B9}, {0x1F3D, 0x03B9}, {0x1F3E, 0x03B9},
+    {0x1F3F, 0x03B9}, {0x1F40, 0x03BF}, {0x1F41, 0x03BF}, {0x1F42, 0x03BF},
+    {0x1F43, 0x03BF}, {0x1F44, 0x03BF}, {0x1F45, 0x03BF}, {0x1F48, 0x03BF},
+    {0x1F49, 0x03BF}, {0x1F4A, 0x03BF}, {0x1F4B, 0x03BF}, {0x1F4C, 0x03BF},
+    {0x1F4D, 0x03BF}, {0x1F50, 0x03C5}, {0x1F51, 0x03C5}, {0x1F52, 0x03C5},
+    {0x1F53, 0x03C5}, {0x1F54, 0x03C5}, {0x1F55, 0x03C5}, {0x1F56, 0x03C5},
+    {0x1F57, 0x03C5}, {0x1F59, 0x03C5}, {0x1F5B, 0x03C5}, {0x1F5D, 0x03C5},
+    {0x1F5F, 0x03C5}, {0x1F60, 0x03C9}, {0x1F61, 0x03C9}, {0x1F62, 0x03C9},
+    {0x1F63, 0x03C9}, {0x1F64, 0x03C9}, {0x1F65, 0x03C9}, {0x1F66, 0x03C9},
+    {0x1F67, 0x03C9}, {0x1F68, 0x03C9}, {0x1F69, 0x03C9}, {0x1F6A, 0x03C9},
+    {0x1F6B, 0x03C9}, {0x1F6C, 0x03C9}, {0x1F6D, 0x03C9}, {0x1F6E, 0x03C9},
+    {0x1F6F, 0x03C9}, {0x1F70, 0x03B1}, {0x1F71, 0x03B1}, {0x1F72, 0x03B5},
+    {0x1F73, 0x03B5}, {0x1F74, 0x03B7}, {0x1F75, 0x03B7}, {0x1F76, 0x03B9},
+    {0x1F77, 0x03B9}, {0x1F78, 0x03BF}, {0x1F79, 0x03BF}, {0x1F7A, 0x03C5},
+    {0x1F7B, 0x03C5}, {0x1F7C, 0x03C9}, {0x1F7D, 0x03C9}, {0x1F80, 0x03B1},
+    {0x1F81, 0x03B1}, {0x1F82, 0x03B1}, {0x1F83, 0x03B1}, {0x1F84, 0x03B1},
+    {0x1F85, 0x03B1}, {0x1F86, 0x03B1}, {0x1F87, 0x03B1}, {0x1F88, 0x03B1},
+    {0x1F89, 0x03B1}, {0x1F8A, 0x03B1}, {0x1F8B, 0x03B1}, {0x1F8C, 0x03B1},
+    {0x1F8D, 0x03B1}, {0x1F8E, 0x03B1}, {0x1F8F, 0x03B1}, {0x1F90, 0x03B7},
+    {0x1F91, 0x03B7}, {0x1F92, 0x03B7}, {0x1F93, 0x03B7}, {0x1F94, 0x03B7},
+    {0x1F95, 0x03B7}, {0x1F96, 0x03B7}, {0x1F97, 0x03B7}, {0x1F98, 0x03B7},
+    {0x1F99, 0x03B7}, {0x1F9A, 0x03B7}, {0x1F9B, 0x03B7}, {0x1F9C, 0x03B7},
+    {0x1F9D, 0x03B7}, {0x1F9E, 0x03B7}, {0x1F9F, 0x03B7}, {0x1FA0, 0x03C9},
+    {0x1FA1, 0x03C9}, {0x1FA2, 0x03C9}, {0x1FA3, 0x03C9}, {0x1FA4, 0x03C9},
+    {0x1FA5, 0x03C9}, {0x1FA6, 0x03C9}, {0x1FA7, 0x03C9}, {0x1FA8, 0x03C9},
+    {0x1FA9, 0x03C9}, {0x1FAA, 0x03C9}, {0x1FAB, 0x03C9}, {0x1FAC, 0x03C9},
+    {0x1FAD, 0x03C9}, {0x1FAE, 0x03C9}, {0x1FAF, 0x03C9}, {0x1FB0, 0x03B1},
+    {0x1FB1, 0x03B1}, {0x1FB2, 0x03B1}, {0x1FB3, 0x03B1}, {0x1FB4, 0x03B1},
+    {0x1FB6, 0x03B1}, {0x1FB7, 0x03B1}, {0x1FB8, 0x03B1}, {0x1FB9, 0x03B1},
+    {0x1FBA, 0x03B1}, {0x1FBB, 0x03B1}, {0x1FBC, 0x03B1}, {0x1FBE, 0x03B9},
+    {0x1FC1, 0x00A8}, {0x1FC2, 0x03B7}, {0x1FC3, 0x03B7}, {0x1FC4, 0x03B7},
+    {0x1FC6, 0x03B7}, {0x1FC7, 0x03B7}, {0x1FC8, 0x03B5}, {0x1FC9, 0x03B5},
+    {0x1FCA, 0x03B7}, {0x1FCB, 0x03B7}, {0x1FCC, 0x03B7}, {0x1FCD, 0x1FBF},
+    {0x1FCE, 0x1FBF}, {0x1FCF, 0x1FBF}, {0x1FD0, 0x03B9}, {0x1FD1, 0x03B9},
+    {0x1FD2, 0x03B9}, {0x1FD3, 0x03B9}, {0x1FD6, 0x03B9}, {0x1FD7, 0x03B9},
+    {0x1FD8, 0x03B9}, {0x1FD9, 0x03B9}, {0x1FDA, 0x03B9}, {0x1FDB, 0x03B9},
+    {0x1FDD, 0x1FFE}, {0x1FDE, 0x1FFE}, {0x1FDF, 0x1FFE}, {0x1FE0, 0x03C5},
+    {0x1FE1, 0x03C5}, {0x1FE2, 0x03C5}, {0x1FE3, 0x03C5}, {0x1FE4, 0x03C1},
+    {0x1FE5, 0x03C1}, {0x1FE6, 0x03C5}, {0x1FE7, 0x03C5}, {0x1FE8, 0x03C5},
+    {0x1FE9, 0x03C5}, {0x1FEA, 0x03C5}, {0x1FEB, 0x03C5}, {0x1FEC, 0x03C1},
+    {0x1FED, 0x00A8}, {0x1FEE, 0x00A8}, {0x1FEF, 0x0060}, {0x1FF2, 0x03C9},
+    {0x1FF3, 0x03C9}, {0x1FF4, 0x03C9}, {0x1FF6, 0x03C9}, {0x1FF7, 0x03C9},
+    {0x1FF8, 0x03BF}, {0x1FF9, 0x03BF}, {0x1FFA, 0x03C9}, {0x1FFB, 0x03C9},
+    {0x1FFC, 0x03C9}, {0x1FFD, 0x00B4}, {0x2000, 0x2002}, {0x2001, 0x2003},
+    {0x2126, 0x03C9}, {0x212A, 0x006B}, {0x212B, 0x0061}, {0x2132, 0x214E},
+    {0x2160, 0x2170}, {0x2161, 0x2171}, {0x2162, 0x2172}, {0x2163, 0x2173},
+    {0x2164, 0x2174}, {0x2165, 0x2175}, {0x2166, 0x2176}, {0x2167, 0x2177},
+    {0x2168, 0x2178}, {0x2169, 0x2179}, {0x216A, 0x217A}, {0x216B, 0x217B},
+    {0x216C, 0x217C}, {0x216D, 0x217D}, {0x216E, 0x217E}, {0x216F, 0x217F},
+    {0x2183, 0x2184}, {0x219A, 0x2190}, {0x219B, 0x2192}, {0x21AE, 0x2194},
+    {0x21CD, 0x21D0}, {0x21CE, 0x21D4}, {0x21CF, 0x21D2}, {0x2204, 0x2203},
+    {0x2209, 0x2208}, {0x220C, 0x220B}, {0x2224, 0x2223}, {0x2226, 0x2225},
+    {0x2241, 0x223C}, {0x2244, 0x2243}, {0x2247, 0x2245}, {0x2249, 0x2248},
+    {0x2260, 0x003D}, {0x2262, 0x2261}, {0x226D, 0x224D}, {0x226E, 0x003C},
+    {0x226F, 0x003E}, {0x2270, 0x2264}, {0x2271, 0x2265}, {0x2274, 0x2272},
+    {0x2275, 0x2273}, {0x2278, 0x2276}, {0x2279, 0x2277}, {0x2280, 0x227A},
+    {0x2281, 0x227B}, {0x2284, 0x2282}, {0x2285, 0x2283}, {0x2288, 0x2286},
+    {0x2289, 0x2287}, {0x22AC, 0x22A2}, {0x22AD, 0x22A8}, {0x22AE, 0x22A9},
+    {0x22AF, 0x22AB}, {0x22E0, 0x227C}, {0x22E1, 0x227D}, {0x22E2, 0x2291},
+    {0x22E3, 0x2292}, {0x22EA, 0x22B2}, {0x22EB, 0x22B3}, {0x22EC, 0x22B4},
+    {0x22ED, 0x22B5}, {0x2329, 0x3008}, {0x232A, 0x3009}, {0x24B6, 0x24D0},
+    {0x24B7, 0x24D1}, {0x24B8, 0x24D2}, {0x24B9, 0x24D3}, {0x24BA, 0x24D4},
+    {0x24BB, 0x24D5}, {0x24BC, 0x24D6}, {0x24BD, 0x24D7}, {0x24BE, 0x24D8},
+    {0x24BF, 0x24D9}, {0x24C0, 0x24DA}, {0x24C1, 0x24DB}, {0x24C2, 0x24DC},
+    {0x24C3, 0x24DD}, {0x24C4, 0x24DE}, {0x24C5, 0x24DF}, {0x24C6, 0x24E0},
+    {0x24C7, 0x24E1}, {0x24C8, 0x24E2}, {0x24C9, 0x24E3}, {0x24CA, 0x24E4},
+    {0x24CB, 0x24E5}, {0x24CC, 0x24E6}, {0x24CD, 0x24E7}, {0x24CE, 0x24E8},
+    {0x24CF, 0x24E9}, {0x2ADC, 0x2ADD}, {0x2C00, 0x2C30}, {0x2C01, 0x2C31},
+    {0x2C02, 0x2C32}, {0x2C03, 0x2C33}, {0x2C04, 0x2C34}, {0x2C05, 0x2C35},
+    {0x2C06, 0x2C36}, {0x2C07, 0x2C37}, {0x2C08, 0x2C38}, {0x2C09, 0x2C39},
+    {0x2C0A, 0x2C3A}, {0x2C0B, 0x2C3B}, {0x2C0C, 0x2C3C}, {0x2C0D, 0x2C3D},
+    {0x2C0E, 0x2C3E}, {0x2C0F, 0x2C3F}, {0x2C10, 0x2C40}, {0x2C11, 0x2C41},
+    {0x2C12, 0x2C42}, {0x2C13, 0x2C43}, {0x2C14, 0x2C44}, {0x2C15, 0x2C45},
+    {0x2C16, 0x2C46}, {0x2C17, 0x2C47}, {0x2C18, 0x2C48}, {0x2C19, 0x2C49},
+    {0x2C1A, 0x2C4A}, {0x2C1B, 0x2C4B}, {0x2C1C, 0x2C4C}, {0x2C1D, 0x2C4D},
+    {0x2C1E, 0x2C4E}, {0x2C1F, 0x2C4F}, {0x2C20, 0x2C50}, {0x2C21, 0x2C51},
+    {0x2C22, 0x2C52}, {0x2C23, 0x2C53}, {0x2C24, 0x2C54}, {0x2C25, 0x2C55},
+    {0x2C26, 0x2C56}, {0x2C27, 0x2C57}, {0x2C28, 0x2C58}, {0x2C29, 0x2C59},
+    {0x2C2A, 0x2C5A}, {0x2C2B, 0x2C5B}, {0x2C2C, 0x2C5C}, {0x2C2D, 0x2C5D},
+    {0x2C2E, 0x2C5E}, {0x2C2F, 0x2C5F}, {0x2C60, 0x2C61}, {0x2C62, 0x026B},
+    {0x2C63, 0x1D7D}, {0x2C64, 0x027D}, {0x2C67, 0x2C68}, {0x2C69, 0x2C6A},
+    {0x2C6B, 0x2C6C}, {0x2C6D, 0x0251}, {0x2C6E, 0x0271}, {0x2C6F, 0x0250},
+    {0x2C70, 0x0252}, {0x2C72, 0x2C73}, {0x2C75, 0x2C76}, {0x2C7E, 0x023F},
+    {0x2C7F, 0x0240}, {0x2C80, 0x2C81}, {0x2C82, 0x2C83}, {0x2C84, 0x2C85},
+    {0x2C86, 0x2C87}, {0x2C88, 0x2C89}, {0x2C8A, 0x2C8B}, {0x2C8C, 0x2C8D},
+    {0x2C8E, 0x2C8F}, {0x2C90, 0x2C91}, {0x2C92, 0x2C93}, {0x2C94, 0x2C95},
+    {0x2C96, 0x2C97}, {0x2C98, 0x2C99}, {0x2C9A, 0x2C9B}, {0x2C9C, 0x2C9D},
+    {0x2C9E, 0x2C9F}, {0x2CA0, 0x2CA1}, {0x2CA2, 0x2CA3}, {0x2CA4, 0x2CA5},
+    {0x2CA6, 0x2CA7}, {0x2CA8, 0x2CA9}, {0x2CAA, 0x2CAB}, {0x2CAC, 0x2CAD},
+    {0x2CAE, 0x2CAF}, {0x2CB0, 0x2CB1}, {0x2CB2, 0x2CB3}, {0x2CB4, 0x2CB5},
+    {0x2CB6, 0x2CB7}, {0x2CB8, 0x2CB9}, {0x2CBA, 0x2CBB}, {0x2CBC, 0x2CBD},
+    {0x2CBE, 0x2CBF}, {0x2CC0, 0x2CC1}, {0x2CC2, 0x2CC3}, {0x2CC4, 0x2CC5},
+    {0x2CC6, 0x2CC7}, {0x2CC8, 0x2CC9}, {0x2CCA, 0x2CCB}, {0x2CCC, 0x2CCD},
+    {0x2CCE, 0x2CCF}, {0x2CD0, 0x2CD1}, {0x2CD2, 0x2CD3}, {0x2CD4, 0x2CD5},
+    {0x2CD6, 0x2CD7}, {0x2CD8, 0x2CD9}, {0x2CDA, 0x2CDB}, {0x2CDC, 0x2CDD},
+    {0x2CDE, 0x2CDF}, {0x2CE0, 0x2CE1}, {0x2CE2, 0x2CE3}, {0x2CEB, 0x2CEC},
+    {0x2CED, 0x2CEE}, {0x2CF2, 0x2CF3}, {0x304C, 0x304B}, {0x304E, 0x304D},
+    {0x3050, 0x304F}, {0x3052, 0x3051}, {0x3054, 0x3053}, {0x3056, 0x3055},
+    {0x3058, 0x3057}, {0x305A, 0x3059}, {0x305C, 0x305B}, {0x305E, 0x305D},
+    {0x3060, 0x305F}, {0x3062, 0x3061}, {0x3065, 0x3064}, {0x3067, 0x3066},
+    {0x3069, 0x3068}, {0x3070, 0x306F}, {0x3071, 0x306F}, {0x3073, 0x3072},
+    {0x3074, 0x3072}, {0x3076, 0x3075}, {0x3077, 0x3075}, {0x3079, 0x3078},
+    {0x307A, 0x3078}, {0x307C, 0x307B}, {0x307D, 0x307B}, {0x3094, 0x3046},
+    {0x309E, 0x309D}, {0x30AC, 0x30AB}, {0x30AE, 0x30AD}, {0x30B0, 0x30AF},
+    {0x30B2, 0x30B1}, {0x30B4, 0x30B3}, {0x30B6, 0x30B5}, {0x30B8, 0x30B7},
+    {0x30BA, 0x30B9}, {0x30BC, 0x30BB}, {0x30BE, 0x30BD}, {0x30C0, 0x30BF},
+    {0x30C2, 0x30C1}, {0x30C5, 0x30C4}, {0x30C7, 0x30C6}, {0x30C9, 0x30C8},
+    {0x30D0, 0x30CF}, {0x30D1, 0x30CF}, {0x30D3, 0x30D2}, {0x30D4, 0x30D2},
+    {0x30D6, 0x30D5}, {0x30D7, 0x30D5}, {0x30D9, 0x30D8}, {0x30DA, 0x30D8},
+    {0x30DC, 0x30DB}, {0x30DD, 0x30DB}, {0x30F4, 0x30A6}, {0x30F7, 0x30EF},
+    {0x30F8, 0x30F0}, {0x30F9, 0x30F1}, {0x30FA, 0x30F2}, {0x30FE, 0x30FD},
+    {0xA640, 0xA641}, {0xA642, 0xA643}, {0xA644, 0xA645}, {0xA646, 0xA647},
+    {0xA648, 0xA649}, {0xA64A, 0xA64B}, {0xA64C, 0xA64D}, {0xA64E, 0xA64F},
+    {0xA650, 0xA651}, {0xA652, 0xA653}, {0xA654, 0xA655}, {0xA656, 0xA657},
+    {0xA658, 0xA659}, {0xA65A, 0xA65B}, {0xA65C, 0xA65D}, {0xA65E, 0xA65F},
+    {0xA660, 0xA661}, {0xA662, 0xA663}, {0xA664, 0xA665}, {0xA666, 0xA667},
+    {0xA668, 0xA669}, {0xA66A, 0xA66B}, {0xA66C, 0xA66D}, {0xA680, 0xA681},
+    {0xA682, 0xA683}, {0xA684, 0xA685}, {0xA686, 0xA687}, {0xA688, 0xA689},
+    {0xA68A, 0xA68B}, {0xA68C, 0xA68D}, {0xA68E, 0xA68F}, {0xA690, 0xA691},
+    {0xA692, 0xA693}, {0xA694, 0xA695}, {0xA696, 0xA697}, {0xA698, 0xA699},
+    {0xA69A, 0xA69B}, {0xA722, 0xA723}, {0xA724, 0xA725}, {0xA726, 0xA727},
+    {0xA728, 0xA729}, {0xA72A, 0xA72B}, {0xA72C, 0xA72D}, {0xA72E, 0xA72F},
+    {0xA732, 0xA733}, {0xA734, 0xA735}, {0xA736, 0xA737}, {0xA738, 0xA739},
+    {0xA73A, 0xA73B}, {0xA73C, 0xA73D}, {0xA73E, 0xA73F}, {0xA740, 0xA741},
+    {0xA742, 0xA743}, {0xA744, 0xA745}, {0xA746, 0xA747}, {0xA748, 0xA749},
+    {0xA74A, 0xA74B}, {0xA74C, 0xA74D}, {0xA74E, 0xA74F}, {0xA750, 0xA751},
+    {0xA752, 0xA753}, {0xA754, 0xA755}, {0xA756, 0xA757}, {0xA758, 0xA759},
+    {0xA75A, 0xA75B}, {0xA75C, 0xA75D}, {0xA75E, 0xA75F}, {0xA760, 0xA761},
+    {0xA762, 0xA763}, {0xA764, 0xA765}, {0xA766, 0xA767}, {0xA768, 0xA769},
+    {0xA76A, 0xA76B}, {0xA76C, 0xA76D}, {0xA76E, 0xA76F}, {0xA779, 0xA77A},
+    {0xA77B, 0xA77C}, {0xA77D, 0x1D79}, {0xA77E, 0xA77F}, {0xA780, 0xA781},
+    {0xA782, 0xA783}, {0xA784, 0xA785}, {0xA786, 0xA787}, {0xA78B, 0xA78C},
+    {0xA78D, 0x0265}, {0xA790, 0xA791}, {0xA792, 0xA793}, {0xA796, 0xA797},
+    {0xA798, 0xA799}, {0xA79A, 0xA79B}, {0xA79C, 0xA79D}, {0xA79E, 0xA79F},
+    {0xA7A0, 0xA7A1}, {0xA7A2, 0xA7A3}, {0xA7A4, 0xA7A5}, {0xA7A6, 0xA7A7},
+    {0xA7A8, 0xA7A9}, {0xA7AA, 0x0266}, {0xA7AB, 0x025C}, {0xA7AC, 0x0261},
+    {0xA7AD, 0x026C}, {0xA7AE, 0x026A}, {0xA7B0, 0x029E}, {0xA7B1, 0x0287},
+    {0xA7B2, 0x029D}, {0xA7B3, 0xAB53}, {0xA7B4, 0xA7B5}, {0xA7B6, 0xA7B7},
+    {0xA7B8, 0xA7B9}, {0xA7BA, 0xA7BB}, {0xA7BC, 0xA7BD}, {0xA7BE, 0xA7BF},
+    {0xA7C0, 0xA7C1}, {0xA7C2, 0xA7C3}, {0xA7C4, 0xA794}, {0xA7C5, 0x0282},
+    {0xA7C6, 0x1D8E}, {0xA7C7, 0xA7C8}, {0xA7C9, 0xA7CA}, {0xA7D0, 0xA7D1},
+    {0xA7D6, 0xA7D7}, {0xA7D8, 0xA7D9}, {0xA7F5, 0xA7F6}, {0xF900, 0x8C48},
+    {0xF901, 0x66F4}, {0xF902, 0x8ECA}, {0xF903, 0x8CC8}, {0xF904, 0x6ED1},
+    {0xF905, 0x4E32}, {0xF906, 0x53E5}, {0xF907, 0x9F9C}, {0xF908, 0x9F9C},
+    {0xF909, 0x5951}, {0xF90A, 0x91D1}, {0xF90B, 0x5587}, {0xF90C, 0x5948},
+    {0xF90D, 0x61F6}, {0xF90E, 0x7669}, {0xF90F, 0x7F85}, {0xF910, 0x863F},
+    {0xF911, 0x87BA}, {0xF912, 0x88F8}, {0xF913, 0x908F}, {0xF914, 0x6A02},
+    {0xF915, 0x6D1B}, {0xF916, 0x70D9}, {0xF917, 0x73DE}, {0xF918, 0x843D},
+    {0xF919, 0x916A}, {0xF91A, 0x99F1}, {0xF91B, 0x4E82}, {0xF91C, 0x5375},
+    {0xF91D, 0x6B04}, {0xF91E, 0x721B}, {0xF91F, 0x862D}, {0xF920, 0x9E1E},
+    {0xF921, 0x5D50}, {0xF922, 0x6FEB}, {0xF923, 0x85CD}, {0xF924, 0x8964},
+    {0xF925, 0x62C9}, {0xF926, 0x81D8}, {0xF927, 0x881F}, {0xF928, 0x5ECA},
+    {0xF929, 0x6717}, {0xF92A, 0x6D6A}, {0xF92B, 0x72FC}, {0xF92C, 0x90CE},
+    {0xF92D, 0x4F86}, {0xF92E, 0x51B7}, {0xF92F, 0x52DE}, {0xF930, 0x64C4},
+    {0xF931, 0x6AD3}, {0xF932, 0x7210}, {0xF933, 0x76E7}, {0xF934, 0x8001},
+    {0xF935, 0x8606}, {0xF936, 0x865C}, {0xF937, 0x8DEF}, {0xF938, 0x9732},
+    {0xF939, 0x9B6F}, {0xF93A, 0x9DFA}, {0xF93B, 0x788C}, {0xF93C, 0x797F},
+    {0xF93D, 0x7DA0}, {0xF93E, 0x83C9}, {0xF93F, 0x9304}, {0xF940, 0x9E7F},
+    {0xF941, 0x8AD6}, {0xF942, 0x58DF}, {0xF943, 0x5F04}, {0xF944, 0x7C60},
+    {0xF945, 0x807E}, {0xF946, 0x7262}, {0xF947, 0x78CA}, {0xF948, 0x8CC2},
+    {0xF949, 0x96F7}, {0xF94A, 0x58D8}, {0xF94B, 0x5C62}, {0xF94C, 0x6A13},
+    {0xF94D, 0x6DDA}, {0xF94E, 0x6F0F}, {0xF94F, 0x7D2F}, {0xF950, 0x7E37},
+    {0xF951, 0x964B}, {0xF952, 0x52D2}, {0xF953, 0x808B}, {0xF954, 0x51DC},
+    {0xF955, 0x51CC}, {0xF956, 0x7A1C}, {0xF957, 0x7DBE}, {0xF958, 0x83F1},
+    {0xF959, 0x9675}, {0xF95A, 0x8B80}, {0xF95B, 0x62CF}, {0xF95C, 0x6A02},
+    {0xF95D, 0x8AFE}, {0xF95E, 0x4E39}, {0xF95F, 0x5BE7}, {0xF960, 0x6012},
+    {0xF961, 0x7387}, {0xF962, 0x7570}, {0xF963, 0x5317}, {0xF964, 0x78FB},
+    {0xF965, 0x4FBF}, {0xF966, 0x5FA9}, {0xF967, 0x4E0D}, {0xF968, 0x6CCC},
+    {0xF969, 0x6578}, {0xF96A, 0x7D22}, {0xF96B, 0x53C3}, {0xF96C, 0x585E},
+    {0xF96D, 0x7701}, {0xF96E, 0x8449}, {0xF96F, 0x8AAA}, {0xF970, 0x6BBA},
+    {0xF971, 0x8FB0}, {0xF972, 0x6C88}, {0xF973, 0x62FE}, {0xF974, 0x82E5},
+    {0xF975, 0x63A0}, {0xF976, 0x7565}, {0xF977, 0x4EAE}, {0xF978, 0x5169},
+    {0xF979, 0x51C9}, {0xF97A, 0x6881}, {0xF97B, 0x7CE7}, {0xF97C, 0x826F},
+    {0xF97D, 0x8AD2}, {0xF97E, 0x91CF}, {0xF97F, 0x52F5}, {0xF980, 0x5442},
+    {0xF981, 0x5973}, {0xF982, 0x5EEC}, {0xF983, 0x65C5}, {0xF984, 0x6FFE},
+    {0xF985, 0x792A}, {0xF986, 0x95AD}, {0xF987, 0x9A6A}, {0xF988, 0x9E97},
+    {0xF989, 0x9ECE}, {0xF98A, 0x529B}, {0xF98B, 0x66C6}, {0xF98C, 0x6B77},
+    {0xF98D, 0x8F62}, {0xF98E, 0x5E74}, {0xF98F, 0x6190}, {0xF990, 0x6200},
+    {0xF991, 0x649A}, {0xF992, 0x6F23}, {0xF993, 0x7149}, {0xF994, 0x7489},
+    {0xF995, 0x79CA}, {0xF996, 0x7DF4}, {0xF997, 0x806F}, {0xF998, 0x8F26},
+    {0xF999, 0x84EE}, {0xF99A, 0x9023}, {0xF99B, 0x934A}, {0xF99C, 0x5217},
+    {0xF99D, 0x52A3}, {0xF99E, 0x54BD}, {0xF99F, 0x70C8}, {0xF9A0, 0x88C2},
+    {0xF9A1, 0x8AAA}, {0xF9A2, 0x5EC9}, {0xF9A3, 0x5FF5}, {0xF9A4, 0x637B},
+    {0xF9A5, 0x6BAE}, {0xF9A6, 0x7C3E}, {0xF9A7, 0x7375}, {0xF9A8, 0x4EE4},
+    {0xF9A9, 0x56F9}, {0xF9AA, 0x5BE7}, {0xF9AB, 0x5DBA}, {0xF9AC, 0x601C},
+    {0xF9AD, 0x73B2}, {0xF9AE, 0x7469}, {0xF9AF, 0x7F9A}, {0xF9B0, 0x8046},
+    {0xF9B1, 0x9234}, {0xF9B2, 0x96F6}, {0xF9B3, 0x9748}, {0xF9B4, 0x9818},
+    {0xF9B5, 0x4F8B}, {0xF9B6, 0x79AE}, {0xF9B7, 0x91B4}, {0xF9B8, 0x96B8},
+    {0xF9B9, 0x60E1}, {0xF9BA, 0x4E86}, {0xF9BB, 0x50DA}, {0xF9BC, 0x5BEE},
+    {0xF9BD, 0x5C3F}, {0xF9BE, 0x6599}, {0xF9BF, 0x6A02}, {0xF9C0, 0x71CE},
+    {0xF9C1, 0x7642}, {0xF9C2, 0x84FC}, {0xF9C3, 0x907C}, {0xF9C4, 0x9F8D},
+    {0xF9C5, 0x6688}, {0xF9C6, 0x962E}, {0xF9C7, 0x5289}, {0xF9C8, 0x677B},
+    {0xF9C9, 0x67F3}, {0xF9CA, 0x6D41}, {0xF9CB, 0x6E9C}, {0xF9CC, 0x7409},
+    {0xF9CD, 0x7559}, {0xF9CE, 0x786B}, {0xF9CF, 0x7D10}, {0xF9D0, 0x985E},
+    {0xF9D1, 0x516D}, {0xF9D2, 0x622E}, {0xF9D3, 0x9678}, {0xF9D4, 0x502B},
+    {0xF9D5, 0x5D19}, {0xF9D6, 0x6DEA}, {0xF9D7, 0x8F2A}, {0xF9D8, 0x5F8B},
+    {0xF9D9, 0x6144}, {0xF9DA, 0x6817}, {0xF9DB, 0x7387}, {0xF9DC, 0x9686},
+    {0xF9DD, 0x5229}, {0xF9DE, 0x540F}, {0xF9DF, 0x5C65}, {0xF9E0, 0x6613},
+    {0xF9E1, 0x674E}, {0xF9E2, 0x68A8}, {0xF9E3, 0x6CE5}, {0xF9E4, 0x7406},
+    {0xF9E5, 0x75E2}, {0xF9E6, 0x7F79}, {0xF9E7, 0x88CF}, {0xF9E8, 0x88E1},
+    {0xF9E9, 0x91CC}, {0xF9EA, 0x96E2}, {0xF9EB, 0x533F}, {0xF9EC, 0x6EBA},
+    {0xF9ED, 0x541D}, {0xF9EE, 0x71D0}, {0xF9EF, 0x7498}, {0xF9F0, 0x85FA},
+    {0xF9F1, 0x96A3}, {0xF9F2, 0x9C57}, {0xF9F3, 0x9E9F}, {0xF9F4, 0x6797},
+    {0xF9F5, 0x6DCB}, {0xF9F6, 0x81E8}, {0xF9F7, 0x7ACB}, {0xF9F8, 0x7B20},
+    {0xF9F9, 0x7C92}, {0xF9FA, 0x72C0}, {0xF9FB, 0x7099}, {0xF9FC, 0x8B58},
+    {0xF9FD, 0x4EC0}, {0xF9FE, 0x8336}, {0xF9FF, 0x523A}, {0xFA00, 0x5207},
+    {0xFA01, 0x5EA6}, {0xFA02, 0x62D3}, {0xFA03, 0x7CD6}, {0xFA04, 0x5B85},
+    {0xFA05, 0x6D1E}, {0xFA06, 0x66B4}, {0xFA07, 0x8F3B}, {0xFA08, 0x884C},
+    {0xFA09, 0x964D}, {0xFA0A, 0x898B}, {0xFA0B, 0x5ED3}, {0xFA0C, 0x5140},
+    {0xFA0D, 0x55C0}, {0xFA10, 0x585A}, {0xFA12, 0x6674}, {0xFA15, 0x51DE},
+    {0xFA16, 0x732A}, {0xFA17, 0x76CA}, {0xFA18, 0x793C}, {0xFA19, 0x795E},
+    {0xFA1A, 0x7965}, {0xFA1B, 0x798F}, {0xFA1C, 0x9756}, {0xFA1D, 0x7CBE},
+    {0xFA1E, 0x7FBD}, {0xFA20, 0x8612}, {0xFA22, 0x8AF8}, {0xFA25, 0x9038},
+    {0xFA26, 0x90FD}, {0xFA2A, 0x98EF}, {0xFA2B, 0x98FC}, {0xFA2C, 0x9928},
+    {0xFA2D, 0x9DB4}, {0xFA2E, 0x90DE}, {0xFA2F, 0x96B7}, {0xFA30, 0x4FAE},
+    {0xFA31, 0x50E7}, {0xFA32, 0x514D}, {0xFA33, 0x52C9}, {0xFA34, 0x52E4},
+    {0xFA35, 0x5351}, {0xFA36, 0x559D}, {0xFA37, 0x5606}, {0xFA38, 0x5668},
+    {0xFA39, 0x5840}, {0xFA3A, 0x58A8}, {0xFA3B, 0x5C64}, {0xFA3C, 0x5C6E},
+    {0xFA3D, 0x6094}, {0xFA3E, 0x6168}, {0xFA3F, 0x618E}, {0xFA40, 0x61F2},
+    {0xFA41, 0x654F}, {0xFA42, 0x65E2}, {0xFA43, 0x6691}, {0xFA44, 0x6885},
+    {0xFA45, 0x6D77}, {0xFA46, 0x6E1A}, {0xFA47, 0x6F22}, {0xFA48, 0x716E},
+    {0xFA49, 0x722B}, {0xFA4A, 0x7422}, {0xFA4B, 0x7891}, {0xFA4C, 0x793E},
+    {0xFA4D, 0x7949}, {0xFA4E, 0x7948}, {0xFA4F, 0x7950}, {0xFA50, 0x7956},
+    {0xFA51, 0x795D}, {0xFA52, 0x798D}, {0xFA53, 0x798E}, {0xFA54, 0x7A40},
+    {0xFA55, 0x7A81}, {0xFA56, 0x7BC0}, {0xFA57, 0x7DF4}, {0xFA58, 0x7E09},
+    {0xFA59, 0x7E41}, {0xFA5A, 0x7F72}, {0xFA5B, 0x8005}, {0xFA5C, 0x81ED},
+    {0xFA5D, 0x8279}, {0xFA5E, 0x8279}, {0xFA5F, 0x8457}, {0xFA60, 0x8910},
+    {0xFA61, 0x8996}, {0xFA62, 0x8B01}, {0xFA63, 0x8B39}, {0xFA64, 0x8CD3},
+    {0xFA65, 0x8D08}, {0xFA66, 0x8FB6}, {0xFA67, 0x9038}, {0xFA68, 0x96E3},
+    {0xFA69, 0x97FF}, {0xFA6A, 0x983B}, {0xFA6B, 0x6075}, {0xFA6C, 0x242EE},
+    {0xFA6D, 0x8218}, {0xFA70, 0x4E26}, {0xFA71, 0x51B5}, {0xFA72, 0x5168},
+    {0xFA73, 0x4F80}, {0xFA74, 0x5145}, {0xFA75, 0x5180}, {0xFA76, 0x52C7},
+    {0xFA77, 0x52FA}, {0xFA78, 0x559D}, {0xFA79, 0x5555}, {0xFA7A, 0x5599},
+    {0xFA7B, 0x55E2}, {0xFA7C, 0x585A}, {0xFA7D, 0x58B3}, {0xFA7E, 0x5944},
+    {0xFA7F, 0x5954}, {0xFA80, 0x5A62}, {0xFA81, 0x5B28}, {0xFA82, 0x5ED2},
+    {0xFA83, 0x5ED9}, {0xFA84, 0x5F69}, {0xFA85, 0x5FAD}, {0xFA86, 0x60D8},
+    {0xFA87, 0x614E}, {0xFA88, 0x6108}, {0xFA89, 0x618E}, {0xFA8A, 0x6160},
+    {0xFA8B, 0x61F2}, {0xFA8C, 0x6234}, {0xFA8D, 0x63C4}, {0xFA8E, 0x641C},
+    {0xFA8F, 0x6452}, {0xFA90, 0x6556}, {0xFA91, 0x6674}, {0xFA92, 0x6717},
+    {0xFA93, 0x671B}, {0xFA94, 0x6756}, {0xFA95, 0x6B79}, {0xFA96, 0x6BBA},
+    {0xFA97, 0x6D41}, {0xFA98, 0x6EDB}, {0xFA99, 0x6ECB}, {0xFA9A, 0x6F22},
+    {0xFA9B, 0x701E}, {0xFA9C, 0x716E}, {0xFA9D, 0x77A7}, {0xFA9E, 0x7235},
+    {0xFA9F, 0x72AF}, {0xFAA0, 0x732A}, {0xFAA1, 0x7471}, {0xFAA2, 0x7506},
+    {0xFAA3, 0x753B}, {0xFAA4, 0x761D}, {0xFAA5, 0x761F}, {0xFAA6, 0x76CA},
+    {0xFAA7, 0x76DB}, {0xFAA8, 0x76F4}, {0xFAA9, 0x774A}, {0xFAAA, 0x7740},
+    {0xFAAB, 0x78CC}, {0xFAAC, 0x7AB1}, {0xFAAD, 0x7BC0}, {0xFAAE, 0x7C7B},
+    {0xFAAF, 0x7D5B}, {0xFAB0, 0x7DF4}, {0xFAB1, 0x7F3E}, {0xFAB2, 0x8005},
+    {0xFAB3, 0x8352}, {0xFAB4, 0x83EF}, {0xFAB5, 0x8779}, {0xFAB6, 0x8941},
+    {0xFAB7, 0x8986}, {0xFAB8, 0x8996}, {0xFAB9, 0x8ABF}, {0xFABA, 0x8AF8},
+    {0xFABB, 0x8ACB}, {0xFABC, 0x8B01}, {0xFABD, 0x8AFE}, {0xFABE, 0x8AED},
+    {0xFABF, 0x8B39}, {0xFAC0, 0x8B8A}, {0xFAC1, 0x8D08}, {0xFAC2, 0x8F38},
+    {0xFAC3, 0x9072}, {0xFAC4, 0x9199}, {0xFAC5, 0x9276}, {0xFAC6, 0x967C},
+    {0xFAC7, 0x96E3}, {0xFAC8, 0x9756}, {0xFAC9, 0x97DB}, {0xFACA, 0x97FF},
+    {0xFACB, 0x980B}, {0xFACC, 0x983B}, {0xFACD, 0x9B12}, {0xFACE, 0x9F9C},
+    {0xFACF, 0x2284A}, {0xFAD0, 0x22844}, {0xFAD1, 0x233D5}, {0xFAD2, 0x3B9D},
+    {0xFAD3, 0x4018}, {0xFAD4, 0x4039}, {0xFAD5, 0x25249}, {0xFAD6, 0x25CD0},
+    {0xFAD7, 0x27ED3}, {0xFAD8, 0x9F43}, {0xFAD9, 0x9F8E}, {0xFB1D, 0x05D9},
+    {0xFB1F, 0x05F2}, {0xFB2A, 0x05E9}, {0xFB2B, 0x05E9}, {0xFB2C, 0x05E9},
+    {0xFB2D, 0x05E9}, {0xFB2E, 0x05D0}, {0xFB2F, 0x05D0}, {0xFB30, 0x05D0},
+    {0xFB31, 0x05D1}, {0xFB32, 0x05D2}, {0xFB33, 0x05D3}, {0xFB34, 0x05D4},
+    {0xFB35, 0x05D5}, {0xFB36, 0x05D6}, {0xFB38, 0x05D8}, {0xFB39, 0x05D9},
+    {0xFB3A, 0x05DA}, {0xFB3B, 0x05DB}, {0xFB3C, 0x05DC}, {0xFB3E, 0x05DE},
+    {0xFB40, 0x05E0}, {0xFB41, 0x05E1}, {0xFB43, 0x05E3}, {0xFB44, 0x05E4},
+    {0xFB46, 0x05E6}, {0xFB47, 0x05E7}, {0xFB48, 0x05E8}, {0xFB49, 0x05E9},
+    {0xFB4A, 0x05EA}, {0xFB4B, 0x05D5}, {0xFB4C, 0x05D1}, {0xFB4D, 0x05DB},
+    {0xFB4E, 0x05E4}, {0xFF21, 0xFF41}, {0xFF22, 0xFF42}, {0xFF23, 0xFF43},
+    {0xFF24, 0xFF44}, {0xFF25, 0xFF45}, {0xFF26, 0xFF46}, {0xFF27, 0xFF47},
+    {0xFF28, 0xFF48}, {0xFF29, 0xFF49}, {0xFF2A, 0xFF4A}, {0xFF2B, 0xFF4B},
+    {0xFF2C, 0xFF4C}, {0xFF2D, 0xFF4D}, {0xFF2E, 0xFF4E}, {0xFF2F, 0xFF4F},
+    {0xFF30, 0xFF50}, {0xFF31, 0xFF51}, {0xFF32, 0xFF52}, {0xFF33, 0xFF53},
+    {0xFF34, 0xFF54}, {0xFF35, 0xFF55}, {0xFF36, 0xFF56}, {0xFF37, 0xFF57},
+    {0xFF38, 0xFF58}, {0xFF39, 0xFF59}, {0xFF3A, 0xFF5A}, {0x10400, 0x10428},
+    {0x10401, 0x10429}, {0x10402, 0x1042A}, {0x10403, 0x1042B},
+    {0x10404, 0x1042C}, {0x10405, 0x1042D}, {0x10406, 0x1042E},
+    {0x10407, 0x1042F}, {0x10408, 0x10430}, {0x10409, 0x10431},
+    {0x1040A, 0x10432}, {0x1040B, 0x10433}, {0x1040C, 0x10434},
+    {0x1040D, 0x10435}, {0x1040E, 0x10436}, {0x1040F, 0x10437},
+    {0x10410, 0x10438}, {0x10411, 0x10439}, {0x10412, 0x1043A},
+    {0x10413, 0x1043B}, {0x10414, 0x1043C}, {0x10415, 0x1043D},
+    {0x10416, 0x1043E}, {0x10417, 0x1043F}, {0x10418, 0x10440},
+    {0x10419, 0x10441}, {0x1041A, 0x10442}, {0x1041B, 0x10443},
+    {0x1041C, 0x10444}, {0x1041D, 0x10445}, {0x1041E, 0x10446},
+    {0x1041F, 0x10447}, {0x10420, 0x10448}, {0x10421, 0x10449},
+    {0x10422, 0x1044A}, {0x10423, 0x1044B}, {0x10424, 0x1044C},
+    {0x10425, 0x1044D}, {0x10426, 0x1044E}, {0x10427, 0x1044F},
+    {0x104B0, 0x104D8}, {0x104B1, 0x104D9}, {0x104B2, 0x104DA},
+    {0x104B3, 0x104DB}, {0x104B4, 0x104DC}, {0x104B5, 0x104DD},
+    {0x104B6, 0x104DE}, {0x104B7, 0x104DF}, {0x104B8, 0x104E0},
+    {0x104B9, 0x104E1}, {0x104BA, 0x104E2}, {0x104BB, 0x104E3},
+    {0x104BC, 0x104E4}, {0x104BD, 0x104E5}, {0x104BE, 0x104E6},
+    {0x104BF, 0x104E7}, {0x104C0, 0x104E8}, {0x104C1, 0x104E9},
+    {0x104C2, 0x104EA}, {0x104C3, 0x104EB}, {0x104C4, 0x104EC},
+    {0x104C5, 0x104ED}, {0x104C6, 0x104EE}, {0x104C7, 0x104EF},
+    {0x104C8, 0x104F0}, {0x104C9, 0x104F1}, {0x104CA, 0x104F2},
+    {0x104CB, 0x104F3}, {0x104CC, 0x104F4}, {0x104CD, 0x104F5},
+    {0x104CE, 0x104F6}, {0x104CF, 0x104F7}, {0x104D0, 0x104F8},
+    {0x104D1, 0x104F9}, {0x104D2, 0x104FA}, {0x104D3, 0x104FB},
+    {0x10570, 0x10597}, {0x10571, 0x10598}, {0x10572, 0x10599},
+    {0x10573, 0x1059A}, {0x10574, 0x1059B}, {0x10575, 0x1059C},
+    {0x10576, 0x1059D}, {0x10577, 0x1059E}, {0x10578, 0x1059F},
+    {0x10579, 0x105A0}, {0x1057A, 0x105A1}, {0x1057C, 0x105A3},
+    {0x1057D, 0x105A4}, {0x1057E, 0x105A5}, {0x1057F, 0x105A6},
+    {0x10580, 0x105A7}, {0x10581, 0x105A8}, {0x10582, 0x105A9},
+    {0x10583, 0x105AA}, {0x10584, 0x105AB}, {0x10585, 0x105AC},
+    {0x10586, 0x105AD}, {0x10587, 0x105AE}, {0x10588, 0x105AF},
+    {0x10589, 0x105B0}, {0x1058A, 0x105B1}, {0x1058C, 0x105B3},
+    {0x1058D, 0x105B4}, {0x1058E, 0x105B5}, {0x1058F, 0x105B6},
+    {0x10590, 0x105B7}, {0x10591, 0x105B8}, {0x10592, 0x105B9},
+    {0x10594, 0x105BB}, {0x10595, 0x105BC}, {0x10C80, 0x10CC0},
+    {0x10C81, 0x10CC1}, {0x10C82, 0x10CC2}, {0x10C83, 0x10CC3},
+    {0x10C84, 0x10CC4}, {0x10C85, 0x10CC5}, {0x10C86, 0x10CC6},
+    {0x10C87, 0x10CC7}, {0x10C88, 0x10CC8}, {0x10C89, 0x10CC9},
+    {0x10C8A, 0x10CCA}, {0x10C8B, 0x10CCB}, {0x10C8C, 0x10CCC},
+    {0x10C8D, 0x10CCD}, {0x10C8E, 0x10CCE}, {0x10C8F, 0x10CCF},
+    {0x10C90, 0x10CD0}, {0x10C91, 0x10CD1}, {0x10C92, 0x10CD2},
+    {0x10C93, 0x10CD3}, {0x10C94, 0x10CD4}, {0x10C95, 0x10CD5},
+    {0x10C96, 0x10CD6}, {0x10C97, 0x10CD7}, {0x10C98, 0x10CD8},
+    {0x10C99, 0x10CD9}, {0x10C9A, 0x10CDA}, {0x10C9B, 0x10CDB},
+    {0x10C9C, 0x10CDC}, {0x10C9D, 0x10CDD}, {0x10C9E, 0x10CDE},
+    {0x10C9F, 0x10CDF}, {0x10CA0, 0x10CE0}, {0x10CA1, 0x10CE1},
+    {0x10CA2, 0x10CE2}, {0x10CA3, 0x10CE3}, {0x10CA4, 0x10CE4},
+    {0x10CA5, 0x10CE5}, {0x10CA6, 0x10CE6}, {0x10CA7, 0x10CE7},
+    {0x10CA8, 0x10CE8}, {0x10CA9, 0x10CE9}, {0x10CAA, 0x10CEA},
+    {0x10CAB, 0x10CEB}, {0x10CAC, 0x10CEC}, {0x10CAD, 0x10CED},
+    {0x10CAE, 0x10CEE}, {0x10CAF, 0x10CEF}, {0x10CB0, 0x10CF0},
+    {0x10CB1, 0x10CF1}, {0x10CB2, 0x10CF2}, {0x1109A, 0x11099},
+    {0x1109C, 0x1109B}, {0x110AB, 0x110A5}, {0x114BB, 0x114B9},
+    {0x118A0, 0x118C0}, {0x118A1, 0x118C1}, {0x118A2, 0x118C2},
+    {0x118A3, 0x118C3}, {0x118A4, 0x118C4}, {0x118A5, 0x118C5},
+    {0x118A6, 0x118C6}, {0x118A7, 0x118C7}, {0x118A8, 0x118C8},
+    {0x118A9, 0x118C9}, {0x118AA, 0x118CA}, {0x118AB, 0x118CB},
+    {0x118AC, 0x118CC}, {0x118AD, 0x118CD}, {0x118AE, 0x118CE},
+    {0x118AF, 0x118CF}, {0x118B0, 0x118D0}, {0x118B1, 0x118D1},
+    {0x118B2, 0x118D2}, {0x118B3, 0x118D3}, {0x118B4, 0x118D4},
+    {0x118B5, 0x118D5}, {0x118B6, 0x118D6}, {0x118B7, 0x118D7},
+    {0x118B8, 0x118D8}, {0x118B9, 0x118D9}, {0x118BA, 0x118DA},
+    {0x118BB, 0x118DB}, {0x118BC, 0x118DC}, {0x118BD, 0x118DD},
+    {0x118BE, 0x118DE}, {0x118BF, 0x118DF}, {0x16E40, 0x16E60},
+    {0x16E41, 0x16E61}, {0x16E42, 0x16E62}, {0x16E43, 0x16E63},
+    {0x16E44, 0x16E64}, {0x16E45, 0x16E65}, {0x16E46, 0x16E66},
+    {0x16E47, 0x16E67}, {0x16E48, 0x16E68}, {0x16E49, 0x16E69},
+    {0x16E4A, 0x16E6A}, {0x16E4B, 0x16E6B}, {0x16E4C, 0x16E6C},
+    {0x16E4D, 0x16E6D}, {0x16E4E, 0x16E6E}, {0x16E4F, 0x16E6F},
+    {0x16E50, 0x16E70}, {0x16E51, 0x16E71}, {0x16E52, 0x16E72},
+    {0x16E53, 0x16E73}, {0x16E54, 0x16E74}, {0x16E55, 0x16E75},
+    {0x16E56, 0x16E76}, {0x16E57, 0x16E77}, {0x16E58, 0x16E78},
+    {0x16E59, 0x16E79}, {0x16E5A, 0x16E7A}, {0x16E5B, 0x16E7B},
+    {0x16E5C, 0x16E7C}, {0x16E5D, 0x16E7D}, {0x16E5E, 0x16E7E},
+    {0x16E5F, 0x16E7F}, {0x1E900, 0x1E922}, {0x1E901, 0x1E923},
+    {0x1E902, 0x1E924}, {0x1E903, 0x1E925}, {0x1E904, 0x1E926},
+    {0x1E905, 0x1E927}, {0x1E906, 0x1E928}, {0x1E907, 0x1E929},
+    {0x1E908, 0x1E92A}, {0x1E909, 0x1E92B}, {0x1E90A, 0x1E92C},
+    {0x1E90B, 0x1E92D}, {0x1E90C, 0x1E92E}, {0x1E90D, 0x1E92F},
+    {0x1E90E, 0x1E930}, {0x1E90F, 0x1E931}, {0x1E910, 0x1E932},
+    {0x1E911, 0x1E933}, {0x1E912, 0x1E934}, {0x1E913, 0x1E935},
+    {0x1E914, 0x1E936}, {0x1E915, 0x1E937}, {0x1E916, 0x1E938},
+    {0x1E917, 0x1E939}, {0x1E918, 0x1E93A}, {0x1E919, 0x1E93B},
+    {0x1E91A, 0x1E93C}, {0x1E91B, 0x1E93D}, {0x1E91C, 0x1E93E},
+    {0x1E91D, 0x1E93F}, {0x1E91E, 0x1E940}, {0x1E91F, 0x1E941},
+    {0x1E920, 0x1E942}, {0x1E921, 0x1E943}, {0x2F800, 0x4E3D},
+    {0x2F801, 0x4E38}, {0x2F802, 0x4E41}, {0x2F803, 0x20122},
+    {0x2F804, 0x4F60}, {0x2F805, 0x4FAE}, {0x2F806, 0x4FBB}, {0x2F807, 0x5002},
+    {0x2F808, 0x507A}, {0x2F809, 0x5099}, {0x2F80A, 0x50E7}, {0x2F80B, 0x50CF},
+    {0x2F80C, 0x349E}, {0x2F80D, 0x2063A}, {0x2F80E, 0x514D},
+    {0x2F80F, 0x5154}, {0x2F810, 0x5164}, {0x2F811, 0x5177},
+    {0x2F812, 0x2051C}, {0x2F813, 0x34B9}, {0x2F814, 0x5167},
+    {0x2F815, 0x518D}, {0x2F816, 0x2054B}, {0x2F817, 0x5197},
+    {0x2F818, 0x51A4}, {0x2F819, 0x4ECC}, {0x2F81A, 0x51AC}, {0x2F81B, 0x51B5},
+    {0x2F81C, 0x291DF}, {0x2F81D, 0x51F5}, {0x2F81E, 0x5203},
+    {0x2F81F, 0x34DF}, {0x2F820, 0x523B}, {0x2F821, 0x5246}, {0x2F822, 0x5272},
+    {0x2F823, 0x5277}, {0x2F824, 0x3515}, {0x2F825, 0x52C7}, {0x2F826, 0x52C9},
+    {0x2F827, 0x52E4}, {0x2F828, 0x52FA}, {0x2F829, 0x5305}, {0x2F82A, 0x5306},
+    {0x2F82B, 0x5317}, {0x2F82C, 0x5349}, {0x2F82D, 0x5351}, {0x2F82E, 0x535A},
+    {0x2F82F, 0x5373}, {0x2F830, 0x537D}, {0x2F831, 0x537F}, {0x2F832, 0x537F},
+    {0x2F833, 0x537F}, {0x2F834, 0x20A2C}, {0x2F835, 0x7070},
+    {0x2F836, 0x53CA}, {0x2F837, 0x53DF}, {0x2F838, 0x20B63},
+    {0x2F839, 0x53EB}, {0x2F83A, 0x53F1}, {0x2F83B, 0x5406}, {0x2F83C, 0x549E},
+    {0x2F83D, 0x5438}, {0x2F83E, 0x5448}, {0x2F83F, 0x5468}, {0x2F840, 0x54A2},
+    {0x2F841, 0x54F6}, {0x2F842, 0x5510}, {0x2F843, 0x5553}, {0x2F844, 0x5563},
+    {0x2F845, 0x5584}, {0x2F846, 0x5584}, {0x2F847, 0x5599}, {0x2F848, 0x55AB},
+    {0x2F849, 0x55B3}, {0x2F84A, 0x55C2}, {0x2F84B, 0x5716}, {0x2F84C, 0x5606},
+    {0x2F84D, 0x5717}, {0x2F84E, 0x5651}, {0x2F84F, 0x5674}, {0x2F850, 0x5207},
+    {0x2F851, 0x58EE}, {0x2F852, 0x57CE}, {0x2F853, 0x57F4}, {0x2F854, 0x580D},
+    {0x2F855, 0x578B}, {0x2F856, 0x5832}, {0x2F857, 0x5831}, {0x2F858, 0x58AC},
+    {0x2F859, 0x214E4}, {0x2F85A, 0x58F2}, {0x2F85B, 0x58F7},
+    {0x2F85C, 0x5906}, {0x2F85D, 0x591A}, {0x2F85E, 0x5922}, {0x2F85F, 0x5962},
+    {0x2F860, 0x216A8}, {0x2F861, 0x216EA}, {0x2F862, 0x59EC},
+    {0x2F863, 0x5A1B}, {0x2F864, 0x5A27}, {0x2F865, 0x59D8}, {0x2F866, 0x5A66},
+    {0x2F867, 0x36EE}, {0x2F868, 0x36FC}, {0x2F869, 0x5B08}, {0x2F86A, 0x5B3E},
+    {0x2F86B, 0x5B3E}, {0x2F86C, 0x219C8}, {0x2F86D, 0x5BC3},
+    {0x2F86E, 0x5BD8}, {0x2F86F, 0x5BE7}, {0x2F870, 0x5BF3},
+    {0x2F871, 0x21B18}, {0x2F872, 0x5BFF}, {0x2F873, 0x5C06},
+    {0x2F874, 0x5F53}, {0x2F875, 0x5C22}, {0x2F876, 0x3781}, {0x2F877, 0x5C60},
+    {0x2F878, 0x5C6E}, {0x2F879, 0x5CC0}, {0x2F87A, 0x5C8D},
+    {0x2F87B, 0x21DE4}, {0x2F87C, 0x5D43}, {0x2F87D, 0x21DE6},
+    {0x2F87E, 0x5D6E}, {0x2F87F, 0x5D6B}, {0x2F880, 0x5D7C}, {0x2F881, 0x5DE1},
+    {0x2F882, 0x5DE2}, {0x2F883, 0x382F}, {0x2F884, 0x5DFD}, {0x2F885, 0x5E28},
+    {0x2F886, 0x5E3D}, {0x2F887, 0x5E69}, {0x2F888, 0x3862},
+    {0x2F889, 0x22183}, {0x2F88A, 0x387C}, {0x2F88B, 0x5EB0},
+    {0x2F88C, 0x5EB3}, {0x2F88D, 0x5EB6}, {0x2F88E, 0x5ECA},
+    {0x2F88F, 0x2A392}, {0x2F890, 0x5EFE}, {0x2F891, 0x22331},
+    {0x2F892, 0x22331}, {0x2F893, 0x8201}, {0x2F894, 0x5F22},
+    {0x2F895, 0x5F22}, {0x2F896, 0x38C7}, {0x2F897, 0x232B8},
+    {0x2F898, 0x261DA}, {0x2F899, 0x5F62}, {0x2F89A, 0x5F6B},
+    {0x2F89B, 0x38E3}, {0x2F89C, 0x5F9A}, {0x2F89D, 0x5FCD}, {0x2F89E, 0x5FD7},
+    {0x2F89F, 0x5FF9}, {0x2F8A0, 0x6081}, {0x2F8A1, 0x393A}, {0x2F8A2, 0x391C},
+    {0x2F8A3, 0x6094}, {0x2F8A4, 0x226D4}, {0x2F8A5, 0x60C7},
+    {0x2F8A6, 0x6148}, {0x2F8A7, 0x614C}, {0x2F8A8, 0x614E}, {0x2F8A9, 0x614C},
+    {0x2F8AA, 0x617A}, {0x2F8AB, 0x618E}, {0x2F8AC, 0x61B2}, {0x2F8AD, 0x61A4},
+    {0x2F8AE, 0x61AF}, {0x2F8AF, 0x61DE}, {0x2F8B0, 0x61F2}, {0x2F8B1, 0x61F6},
+    {0x2F8B2, 0x6210}, {0x2F8B3, 0x621B}, {0x2F8B4, 0x625D}, {0x2F8B5, 0x62B1},
+    {0x2F8B6, 0x62D4}, {0x2F8B7, 0x6350}, {0x2F8B8, 0x22B0C},
+    {0x2F8B9, 0x633D}, {0x2F8BA, 0x62FC}, {0x2F8BB, 0x6368}, {0x2F8BC, 0x6383},
+    {0x2F8BD, 0x63E4}, {0x2F8BE, 0x22BF1}, {0x2F8BF, 0x6422},
+    {0x2F8C0, 0x63C5}, {0x2F8C1, 0x63A9}, {0x2F8C2, 0x3A2E}, {0x2F8C3, 0x6469},
+    {0x2F8C4, 0x647E}, {0x2F8C5, 0x649D}, {0x2F8C6, 0x6477}, {0x2F8C7, 0x3A6C},
+    {0x2F8C8, 0x654F}, {0x2F8C9, 0x656C}, {0x2F8CA, 0x2300A},
+    {0x2F8CB, 0x65E3}, {0x2F8CC, 0x66F8}, {0x2F8CD, 0x6649}, {0x2F8CE, 0x3B19},
+    {0x2F8CF, 0x6691}, {0x2F8D0, 0x3B08}, {0x2F8D1, 0x3AE4}, {0x2F8D2, 0x5192},
+    {0x2F8D3, 0x5195}, {0x2F8D4, 0x6700}, {0x2F8D5, 0x669C}, {0x2F8D6, 0x80AD},
+    {0x2F8D7, 0x43D9}, {0x2F8D8, 0x6717}, {0x2F8D9, 0x671B}, {0x2F8DA, 0x6721},
+    {0x2F8DB, 0x675E}, {0x2F8DC, 0x6753}, {0x2F8DD, 0x233C3},
+    {0x2F8DE, 0x3B49}, {0x2F8DF, 0x67FA}, {0x2F8E0, 0x6785}, {0x2F8E1, 0x6852},
+    {0x2F8E2, 0x6885}, {0x2F8E3, 0x2346D}, {0x2F8E4, 0x688E},
+    {0x2F8E5, 0x681F}, {0x2F8E6, 0x6914}, {0x2F8E7, 0x3B9D}, {0x2F8E8, 0x6942},
+    {0x2F8E9, 0x69A3}, {0x2F8EA, 0x69EA}, {0x2F8EB, 0x6AA8},
+    {0x2F8EC, 0x236A3}, {0x2F8ED, 0x6ADB}, {0x2F8EE, 0x3C18},
+    {0x2F8EF, 0x6B21}, {0x2F8F0, 0x238A7}, {0x2F8F1, 0x6B54},
+    {0x2F8F2, 0x3C4E}, {0x2F8F3, 0x6B72}, {0x2F8F4, 0x6B9F}, {0x2F8F5, 0x6BBA},
+    {0x2F8F6, 0x6BBB}, {0x2F8F7, 0x23A8D}, {0x2F8F8, 0x21D0B},
+    {0x2F8F9, 0x23AFA}, {0x2F8FA, 0x6C4E}, {0x2F8FB, 0x23CBC},
+    {0x2F8FC, 0x6CBF}, {0x2F8FD, 0x6CCD}, {0x2F8FE, 0x6C67}, {0x2F8FF, 0x6D16},
+    {0x2F900, 0x6D3E}, {0x2F901, 0x6D77}, {0x2F902, 0x6D41}, {0x2F903, 0x6D69},
+    {0x2F904, 0x6D78}, {0x2F905, 0x6D85}, {0x2F906, 0x23D1E},
+    {0x2F907, 0x6D34}, {0x2F908, 0x6E2F}, {0x2F909, 0x6E6E}, {0x2F90A, 0x3D33},
+    {0x2F90B, 0x6ECB}, {0x2F90C, 0x6EC7}, {0x2F90D, 0x23ED1},
+    {0x2F90E, 0x6DF9}, {0x2F90F, 0x6F6E}, {0x2F910, 0x23F5E},
+    {0x2F911, 0x23F8E}, {0x2F912, 0x6FC6}, {0x2F913, 0x7039},
+    {0x2F914, 0x701E}, {0x2F915, 0x701B}, {0x2F916, 0x3D96}, {0x2F917, 0x704A},
+    {0x2F918, 0x707D}, {0x2F919, 0x7077}, {0x2F91A, 0x70AD},
+    {0x2F91B, 0x20525}, {0x2F91C, 0x7145}, {0x2F91D, 0x24263},
+    {0x2F91E, 0x719C}, {0x2F91F, 0x243AB}, {0x2F920, 0x7228},
+    {0x2F921, 0x7235}, {0x2F922, 0x7250}, {0x2F923, 0x24608},
+    {0x2F924, 0x7280}, {0x2F925, 0x7295}, {0x2F926, 0x24735},
+    {0x2F927, 0x24814}, {0x2F928, 0x737A}, {0x2F929, 0x738B},
+    {0x2F92A, 0x3EAC}, {0x2F92B, 0x73A5}, {0x2F92C, 0x3EB8}, {0x2F92D, 0x3EB8},
+    {0x2F92E, 0x7447}, {0x2F92F, 0x745C}, {0x2F930, 0x7471}, {0x2F931, 0x7485},
+    {0x2F932, 0x74CA}, {0x2F933, 0x3F1B}, {0x2F934, 0x7524},
+    {0x2F935, 0x24C36}, {0x2F936, 0x753E}, {0x2F937, 0x24C92},
+    {0x2F938, 0x7570}, {0x2F939, 0x2219F}, {0x2F93A, 0x7610},
+    {0x2F93B, 0x24FA1}, {0x2F93C, 0x24FB8}, {0x2F93D, 0x25044},
+    {0x2F93E, 0x3FFC}, {0x2F93F, 0x4008}, {0x2F940, 0x76F4},
+    {0x2F941, 0x250F3}, {0x2F942, 0x250F2}, {0x2F943, 0x25119},
+    {0x2F944, 0x25133}, {0x2F945, 0x771E}, {0x2F946, 0x771F},
+    {0x2F947, 0x771F}, {0x2F948, 0x774A}, {0x2F949, 0x4039}, {0x2F94A, 0x778B},
+    {0x2F94B, 0x4046}, {0x2F94C, 0x4096}, {0x2F94D, 0x2541D},
+    {0x2F94E, 0x784E}, {0x2F94F, 0x788C}, {0x2F950, 0x78CC}, {0x2F951, 0x40E3},
+    {0x2F952, 0x25626}, {0x2F953, 0x7956}, {0x2F954, 0x2569A},
+    {0x2F955, 0x256C5}, {0x2F956, 0x798F}, {0x2F957, 0x79EB},
+    {0x2F958, 0x412F}, {0x2F959, 0x7A40}, {0x2F95A, 0x7A4A}, {0x2F95B, 0x7A4F},
+    {0x2F95C, 0x2597C}, {0x2F95D, 0x25AA7}, {0x2F95E, 0x25AA7},
+    {0x2F95F, 0x7AEE}, {0x2F960, 0x4202}, {0x2F961, 0x25BAB},
+    {0x2F962, 0x7BC6}, {0x2F963, 0x7BC9}, {0x2F964, 0x4227},
+    {0x2F965, 0x25C80}, {0x2F966, 0x7CD2}, {0x2F967, 0x42A0},
+    {0x2F968, 0x7CE8}, {0x2F969, 0x7CE3}, {0x2F96A, 0x7D00},
+    {0x2F96B, 0x25F86}, {0x2F96C, 0x7D63}, {0x2F96D, 0x4301},
+    {0x2F96E, 0x7DC7}, {0x2F96F, 0x7E02}, {0x2F970, 0x7E45}, {0x2F971, 0x4334},
+    {0x2F972, 0x26228}, {0x2F973, 0x26247}, {0x2F974, 0x4359},
+    {0x2F975, 0x262D9}, {0x2F976, 0x7F7A}, {0x2F977, 0x2633E},
+    {0x2F978, 0x7F95}, {0x2F979, 0x7FFA}, {0x2F97A, 0x8005},
+    {0x2F97B, 0x264DA}, {0x2F97C, 0x26523}, {0x2F97D, 0x8060},
+    {0x2F97E, 0x265A8}, {0x2F97F, 0x8070}, {0x2F980, 0x2335F},
+    {0x2F981, 0x43D5}, {0x2F982, 0x80B2}, {0x2F983, 0x8103}, {0x2F984, 0x440B},
+    {0x2F985, 0x813E}, {0x2F986, 0x5AB5}, {0x2F987, 0x267A7},
+    {0x2F988, 0x267B5}, {0x2F989, 0x23393}, {0x2F98A, 0x2339C},
+    {0x2F98B, 0x8201}, {0x2F98C, 0x8204}, {0x2F98D, 0x8F9E}, {0x2F98E, 0x446B},
+    {0x2F98F, 0x8291}, {0x2F990, 0x828B}, {0x2F991, 0x829D}, {0x2F992, 0x52B3},
+    {0x2F993, 0x82B1}, {0x2F994, 0x82B3}, {0x2F995, 0x82BD}, {0x2F996, 0x82E6},
+    {0x2F997, 0x26B3C}, {0x2F998, 0x82E5}, {0x2F999, 0x831D},
+    {0x2F99A, 0x8363}, {0x2F99B, 0x83AD}, {0x2F99C, 0x8323}, {0x2F99D, 0x83BD},
+    {0x2F99E, 0x83E7}, {0x2F99F, 0x8457}, {0x2F9A0, 0x8353}, {0x2F9A1, 0x83CA},
+    {0x2F9A2, 0x83CC}, {0x2F9A3, 0x83DC}, {0x2F9A4, 0x26C36},
+    {0x2F9A5, 0x26D6B}, {0x2F9A6, 0x26CD5}, {0x2F9A7, 0x452B},
+    {0x2F9A8, 0x84F1}, {0x2F9A9, 0x84F3}, {0x2F9AA, 0x8516},
+    {0x2F9AB, 0x273CA}, {0x2F9AC, 0x8564}, {0x2F9AD, 0x26F2C},
+    {0x2F9AE, 0x455D}, {0x2F9AF, 0x4561}, {0x2F9B0, 0x26FB1},
+    {0x2F9B1, 0x270D2}, {0x2F9B2, 0x456B}, {0x2F9B3, 0x8650},
+    {0x2F9B4, 0x865C}, {0x2F9B5, 0x8667}, {0x2F9B6, 0x8669}, {0x2F9B7, 0x86A9},
+    {0x2F9B8, 0x8688}, {0x2F9B9, 0x870E}, {0x2F9BA, 0x86E2}, {0x2F9BB, 0x8779},
+    {0x2F9BC, 0x8728}, {0x2F9BD, 0x876B}, {0x2F9BE, 0x8786}, {0x2F9BF, 0x45D7},
+    {0x2F9C0, 0x87E1}, {0x2F9C1, 0x8801}, {0x2F9C2, 0x45F9}, {0x2F9C3, 0x8860},
+    {0x2F9C4, 0x8863}, {0x2F9C5, 0x27667}, {0x2F9C6, 0x88D7},
+    {0x2F9C7, 0x88DE}, {0x2F9C8, 0x4635}, {0x2F9C9, 0x88FA}, {0x2F9CA, 0x34BB},
+    {0x2F9CB, 0x278AE}, {0x2F9CC, 0x27966}, {0x2F9CD, 0x46BE},
+    {0x2F9CE, 0x46C7}, {0x2F9CF, 0x8AA0}, {0x2F9D0, 0x8AED}, {0x2F9D1, 0x8B8A},
+    {0x2F9D2, 0x8C55}, {0x2F9D3, 0x27CA8}, {0x2F9D4, 0x8CAB},
+    {0x2F9D5, 0x8CC1}, {0x2F9D6, 0x8D1B}, {0x2F9D7, 0x8D77},
+    {0x2F9D8, 0x27F2F}, {0x2F9D9, 0x20804}, {0x2F9DA, 0x8DCB},
+    {0x2F9DB, 0x8DBC}, {0x2F9DC, 0x8DF0}, {0x2F9DD, 0x208DE},
+    {0x2F9DE, 0x8ED4}, {0x2F9DF, 0x8F38}, {0x2F9E0, 0x285D2},
+    {0x2F9E1, 0x285ED}, {0x2F9E2, 0x9094}, {0x2F9E3, 0x90F1},
+    {0x2F9E4, 0x9111}, {0x2F9E5, 0x2872E}, {0x2F9E6, 0x911B},
+    {0x2F9E7, 0x9238}, {0x2F9E8, 0x92D7}, {0x2F9E9, 0x92D8}, {0x2F9EA, 0x927C},
+    {0x2F9EB, 0x93F9}, {0x2F9EC, 0x9415}, {0x2F9ED, 0x28BFA},
+    {0x2F9EE, 0x958B}, {0x2F9EF, 0x4995}, {0x2F9F0, 0x95B7},
+    {0x2F9F1, 0x28D77}, {0x2F9F2, 0x49E6}, {0x2F9F3, 0x96C3},
+    {0x2F9F4, 0x5DB2}, {0x2F9F5, 0x9723}, {0x2F9F6, 0x29145},
+    {0x2F9F7, 0x2921A}, {0x2F9F8, 0x4A6E}, {0x2F9F9, 0x4A76},
+    {0x2F9FA, 0x97E0}, {0x2F9FB, 0x2940A}, {0x2F9FC, 0x4AB2},
+    {0x2F9FD, 0x29496}, {0x2F9FE, 0x980B}, {0x2F9FF, 0x980B},
+    {0x2FA00, 0x9829}, {0x2FA01, 0x295B6}, {0x2FA02, 0x98E2},
+    {0x2FA03, 0x4B33}, {0x2FA04, 0x9929}, {0x2FA05, 0x99A7}, {0x2FA06, 0x99C2},
+    {0x2FA07, 0x99FE}, {0x2FA08, 0x4BCE}, {0x2FA09, 0x29B30},
+    {0x2FA0A, 0x9B12}, {0x2FA0B, 0x9C40}, {0x2FA0C, 0x9CFD}, {0x2FA0D, 0x4CCE},
+    {0x2FA0E, 0x4CED}, {0x2FA0F, 0x9D67}, {0x2FA10, 0x2A0CE},
+    {0x2FA11, 0x4CF8}, {0x2FA12, 0x2A105}, {0x2FA13, 0x2A20E},
+    {0x2FA14, 0x2A291}, {0x2FA15, 0x9EBB}, {0x2FA16, 0x4D56},
+    {0x2FA17, 0x9EF9}, {0x2FA18, 0x9EFE}, {0x2FA19, 0x9F05}, {0x2FA1A, 0x9F0F},
+    {0x2FA1B, 0x9F16}, {0x2FA1C, 0x9F3B}, {0x2FA1D, 0x2A600},
+};
+
+// Code points that fold to more than one
+constexpr Expansion kExpansions[] = {
+    {0x09CB, "\xE0\xA7\x87\xE0\xA6\xBE"},
+    {0x09CC, "\xE0\xA7\x87\xE0\xA7\x97"},
+    {0x0B4B, "\xE0\xAD\x87\xE0\xAC\xBE"},
+    {0x0B4C, "\xE0\xAD\x87\xE0\xAD\x97"},
+    {0x0B94, "\xE0\xAE\x92\xE0\xAF\x97"},
+    {0x0BCA, "\xE0\xAF\x86\xE0\xAE\xBE"},
+    {0x0BCB, "\xE0\xAF\x87\xE0\xAE\xBE"},
+    {0x0BCC, "\xE0\xAF\x86\xE0\xAF\x97"},
+    {0x0CCB, "\xE0\xB3\x82\xE0\xB3\x95"},
+    {0x0D4A, "\xE0\xB5\x86\xE0\xB4\xBE"},
+    {0x0D4B, "\xE0\xB5\x87\xE0\xB4\xBE"},
+    {0x0D4C, "\xE0\xB5\x86\xE0\xB5\x97"},
+    {0x0DDC, "\xE0\xB7\x99\xE0\xB7\x8F"},
+    {0x0DDD, "\xE0\xB7\x99\xE0\xB7\x8F"},
+    {0x0DDE, "\xE0\xB7\x99\xE0\xB7\x9F"},
+    {0x1B06, "\xE1\xAC\x85\xE1\xAC\xB5"},
+    {0x1B08, "\xE1\xAC\x87\xE1\xAC\xB5"},
+    {0x1B0A, "\xE1\xAC\x89\xE1\xAC\xB5"},
+    {0x1B0C, "\xE1\xAC\x8B\xE1\xAC\xB5"},
+    {0x1B0E, "\xE1\xAC\x8D\xE1\xAC\xB5"},
+    {0x1B12, "\xE1\xAC\x91\xE1\xAC\xB5"},
+    {0x1B40, "\xE1\xAC\xBE\xE1\xAC\xB5"},
+    {0x1B41, "\xE1\xAC\xBF\xE1\xAC\xB5"},
+    {0x1134B, "\xF0\x91\x8D\x87\xF0\x91\x8C\xBE"},
+    {0x1134C, "\xF0\x91\x8D\x87\xF0\x91\x8D\x97"},
+    {0x114BC, "\xF0\x91\x92\xB9\xF0\x91\x92\xB0"},
+    {0x114BE, "\xF0\x91\x92\xB9\xF0\x91\x92\xBD"},
+    {0x115BA, "\xF0\x91\x96\xB8\xF0\x91\x96\xAF"},
+    {0x115BB, "\xF0\x91\x96\xB9\xF0\x91\x96\xAF"},
+    {0x11938, "\xF0\x91\xA4\xB5\xF0\x91\xA4\xB0"},
+    {0x1D15E, "\xF0\x9D\x85\x97\xF0\x9D\x85\xA5"},
+    {0x1D15F, "\xF0\x9D\x85\x98\xF0\x9D\x85\xA5"},
+    {0x1D160, "\xF0\x9D\x85\x98\xF0\x9D\x85\xA5\xF0\x9D\x85\xAE"},
+    {0x1D161, "\xF0\x9D\x85\x98\xF0\x9D\x85\xA5\xF0\x9D\x85\xAF"},
+    {0x1D162, "\xF0\x9D\x85\x98\xF0\x9D\x85\xA5\xF0\x9D\x85\xB0"},
+    {0x1D163, "\xF0\x9D\x85\x98\xF0\x9D\x85\xA5\xF0\x9D\x85\xB1"},
+    {0x1D164, "\xF0\x9D\x85\x98\xF0\x9D\x85\xA5\xF0\x9D\x85\xB2"},
+    {0x1D1BB, "\xF0\x9D\x86\xB9\xF0\x9D\x85\xA5"},
+    {0x1D1BC, "\xF0\x9D\x86\xBA\xF0\x9D\x85\xA5"},
+    {0x1D1BD, "\xF0\x9D\x86\xB9\xF0\x9D\x85\xA5\xF0\x9D\x85\xAE"},
+    {0x1D1BE, "\xF0\x9D\x86\xBA\xF0\x9D\x85\xA5\xF0\x9D\x85\xAE"},
+    {0x1D1BF, "\xF0\x9D\x86\xB9\xF0\x9D\x85\xA5\xF0\x9D\x85\xAF"},
+    {0x1D1C0, "\xF0\x9D\x86\xBA\xF0\x9D\x85\xA5\xF0\x9D\x85\xAF"},
+};
+
+void AppendUtf8(uint32_t cp, std::string& out) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
+
+template <size_t N>
+bool InRanges(const CodePointRange (&table)[N], uint32_t cp) {
+  auto it = std::upper_bound(
+      std::begin(table), std::end(table), cp,
+      [](uint32_t value, const CodePointRange& r) { return value < r.first; });
+  return it != std::begin(table) && cp <= std::prev(it)->last;
+}
+
+// Entry of `code_point` in a table sorted by code point, null if none
+template <typename T, size_t N>
+const T* Find(const T (&table)[N], uint32_t cp) {
+  auto it = std::lower_bound(std::begin(table), std::end(table), cp,
+                             [](const T& entry, uint32_t value) {
+                               return entry.code_point < value;
+                             });
+  return it != std::end(table) && it->code_point == cp ? &*it : nullptr;
+}
+}  // namespace
+
+void AppendFolded(uint32_t cp, std::string& out) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp >= 'A' && cp <= 'Z' ? cp - 'A' + 'a' : cp);
+    return;
+  }
+  // Hangul syllables decompose into their conjoining jamo
+  if (cp >= 0xAC00 && cp <= 0xD7A3) {
+    auto index = cp - 0xAC00;
+    AppendUtf8(0x1100 + index / 588, out);
+    AppendUtf8(0x1161 + index % 588 / 28, out);
+    if (index % 28 != 0) {
+      AppendUtf8(0x11A7 + index % 28, out);
+    }
+    return;
+  }
+  if (InRanges(kMarks, cp)) {
+    return;
+  }
+  if (const auto* fold = Find(kFolds, cp)) {
+    AppendUtf8(fold->folded, out);
+    return;
+  }
+  if (const auto* expansion = Find(kExpansions, cp)) {
+    out += expansion->utf8;
+    return;
+  }
+  AppendUtf8(cp, out);
+}
+
+bool IsWhitespace(uint32_t cp) {
+  return InRanges(kSpaces, cp);
+}
+
+bool IsControl(uint32_t cp) {
+  return InRanges(kControls, cp);
+}
+
+bool IsPunctuation(uint32_t cp) {
+  return InRanges(kPunctuation, cp);
+}
+}  // namespace cortex_onnx
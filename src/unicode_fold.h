@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace cortex_onnx {
+// Appends the UTF-8 of `cp` lower cased, decomposed (NFD) and without
+// nonspacing marks, as the BERT BasicTokenizer normalizes the text of uncased
+// models. Nonspacing marks themselves append nothing. Final sigma is left to
+// the caller, it depends on the surrounding text.
+void AppendFolded(uint32_t cp, std::string& out);
+
+// Character classes of the BERT BasicTokenizer: space separators (Zs), tab
+// and line breaks; control and format characters (Cc, Cf) but tab and line
+// breaks; punctuation (P*) and all non-alphanumeric ASCII
+bool IsWhitespace(uint32_t cp);
+bool IsControl(uint32_t cp);
+bool IsPunctuation(uint32_t cp);
+}  // namespace cortex_onnx
@@ -0,0 +1,161 @@
+#include "wordpiece_tokenizer.h"
+#include <algorithm>
+#include <fstream>
+#include "unicode_fold.h"
+
+namespace cortex_onnx {
+namespace {
+constexpr size_t kMaxWordChars = 100;
+constexpr uint32_t kCapitalSigma = 0x3A3;
+
+// Decodes the code point at `pos` and its length in bytes. Invalid bytes
+// decode as U+FFFD.
+uint32_t DecodeUtf8(std::string_view s, size_t pos, size_t& length) {
+  auto c = static_cast<unsigned char>(s[pos]);
+  if (c < 0x80) {
+    length = 1;
+    return c;
+  }
+  length = (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 0;
+  if (length == 0 || pos + length > s.size()) {
+    length = 1;
+    return 0xFFFD;
+  }
+  uint32_t cp = c & (0x7F >> length);
+  for (size_t i = 1; i < length; i++) {
+    auto b = static_cast<unsigned char>(s[pos + i]);
+    if ((b & 0xC0) != 0x80) {
+      length = 1;
+      return 0xFFFD;
+    }
+    cp = (cp << 6) | (b & 0x3F);
+  }
+  return cp;
+}
+
+// CJK ideographs are tokenized one character at a time
+bool IsCjk(uint32_t cp) {
+  return (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+         (cp >= 0x20000 && cp <= 0x2A6DF) || (cp >= 0x2A700 && cp <= 0x2CEAF) ||
+         (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0x2F800 && cp <= 0x2FA1F);
+}
+}  // namespace
+
+bool WordPieceTokenizer::Load(const std::string& vocab_path,
+                              bool lower_case) {
+  std::ifstream file(vocab_path);
+  if (!file.is_open()) {
+    return false;
+  }
+  vocab_.clear();
+  std::string line;
+  int64_t id = 0;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    vocab_.emplace(line, id++);
+  }
+  lower_case_ = lower_case;
+  auto find = [this](const char* token, int64_t& out) {
+    auto it = vocab_.find(token);
+    if (it == vocab_.end()) {
+      return false;
+    }
+    out = it->second;
+    return true;
+  };
+  return find("[CLS]", cls_id_) && find("[SEP]", sep_id_) &&
+         find("[UNK]", unk_id_) && find("[PAD]", pad_id_);
+}
+
+void WordPieceTokenizer::Encode(std::string_view text, size_t max_length,
+                                std::vector<int64_t>& ids) const {
+  const auto start = ids.size();
+  // Room for [SEP]
+  const auto limit = start + std::max<size_t>(max_length, 2) - 1;
+  ids.push_back(cls_id_);
+  std::string word;
+  auto flush = [&] {
+    if (!word.empty() && ids.size() < limit) {
+      AppendWordPieces(word, ids);
+    }
+    word.clear();
+  };
+  for (size_t pos = 0, length = 0; pos < text.size() && ids.size() < limit;
+       pos += length) {
+    auto cp = DecodeUtf8(text, pos, length);
+    // Invalid bytes decode as U+FFFD, which BERT drops like NUL
+    if (cp == 0 || cp == 0xFFFD || IsControl(cp)) {
+      continue;
+    }
+    if (IsWhitespace(cp)) {
+      flush();
+    } else if (IsPunctuation(cp) || IsCjk(cp)) {
+      flush();
+      word.append(text.substr(pos, length));
+      flush();
+    } else if (lower_case_ && cp == kCapitalSigma) {
+      // Final sigma at the end of a word, as Python's str.lower() does it
+      size_t next_length = 0;
+      auto next = pos + length < text.size()
+                      ? DecodeUtf8(text, pos + length, next_length)
+                      : ' ';
+      bool final = !word.empty() &&
+                   (IsWhitespace(next) || IsPunctuation(next) ||
+                    IsControl(next) || (next >= '0' && next <= '9'));
+      word += final ? "\u03C2" : "\u03C3";
+    } else if (lower_case_) {
+      AppendFolded(cp, word);
+    } else {
+      word.append(text.substr(pos, length));
+    }
+  }
+  flush();
+  if (ids.size() > limit) {
+    ids.resize(limit);
+  }
+  ids.push_back(sep_id_);
+}
+
+void WordPieceTokenizer::AppendWordPieces(const std::string& word,
+                                          std::vector<int64_t>& ids) const {
+  size_t chars = 0;
+  for (char c : word) {
+    chars += (c & 0xC0) != 0x80;
+  }
+  if (chars > kMaxWordChars) {
+    ids.push_back(unk_id_);
+    return;
+  }
+
+  const auto first = ids.size();
+  std::string piece;
+  size_t start = 0;
+  while (start < word.size()) {
+    // Longest prefix of the rest of the word that is in the vocabulary
+    size_t end = word.size();
+    int64_t id = -1;
+    while (end > start) {
+      piece.assign(start > 0 ? "##" : "");
+      piece.append(word, start, end - start);
+      auto it = vocab_.find(piece);
+      if (it != vocab_.end()) {
+        id = it->second;
+        break;
+      }
+      // Back off by one UTF-8 character
+      do {
+        end--;
+      } while (end > start && (word[end] & 0xC0) == 0x80);
+    }
+    if (id < 0) {
+      ids.resize(first);
+      ids.push_back(unk_id_);
+      return;
+    }
+    ids.push_back(id);
+    start = end;
+  }
+}
+}  // namespace cortex_onnx
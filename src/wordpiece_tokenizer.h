@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cortex_onnx {
+// BERT WordPiece tokenizer read from `vocab.txt`, as used by encoder
+// embedding models. Uncased vocabularies get the text lower cased and
+// stripped of accents like the Hugging Face BasicTokenizer does.
+class WordPieceTokenizer {
+ public:
+  // Returns false if the vocabulary cannot be read or lacks the special
+  // tokens
+  bool Load(const std::string& vocab_path, bool lower_case);
+
+  // Appends `[CLS] tokens [SEP]` to `ids`, truncated to `max_length` ids
+  void Encode(std::string_view text, size_t max_length,
+              std::vector<int64_t>& ids) const;
+
+  int64_t pad_id() const { return pad_id_; }
+
+ private:
+  // Appends the word pieces of `word`, or [UNK] if it cannot be split
+  void AppendWordPieces(const std::string& word,
+                        std::vector<int64_t>& ids) const;
+
+ private:
+  std::unordered_map<std::string, int64_t> vocab_;
+  bool lower_case_ = true;
+  int64_t cls_id_ = 0;
+  int64_t sep_id_ = 0;
+  int64_t unk_id_ = 0;
+  int64_t pad_id_ = 0;
+};
+}  // namespace cortex_onnx
@@ -0,0 +1,67 @@
+// Checks WordPieceTokenizer against token ids of the Hugging Face
+// BertTokenizer (do_lower_case=True) over a small vocabulary.
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "wordpiece_tokenizer.h"
+
+namespace {
+const char* kVocab[] = {
+    "[PAD]", "[UNK]", "[CLS]", "[SEP]", "[MASK]", "!", ",", ".",
+    "creme", "brulee", "cafe", "naive", "angstrom", "istanbul", "οδος",
+    "οδοσ", "ежик", "strasse", "straße", "un", "##aff", "##able", "ᄒ",
+    "##ᅡ", "##ᆫ", "##ᄀ", "##ᅮ", "##ᆨ", "我", "hello", "123", "##s",
+    "«", "»", "§", "¶", "·", "world"};
+
+struct Case {
+  const char* text;
+  std::vector<int64_t> ids;
+};
+
+const Case kCases[] = {
+    {"Crème Brûlée!", {2, 8, 9, 5, 3}},
+    {"ÅNGSTRÖM, İstanbul.", {2, 12, 6, 13, 7, 3}},
+    {"ΟΔΟΣ ΟΔΟΣ.", {2, 14, 14, 7, 3}},
+    {"ЁЖИК", {2, 16, 3}},
+    {"STRASSE Straße", {2, 17, 18, 3}},
+    {"Unaffable", {2, 19, 20, 21, 3}},
+    {"한국", {2, 22, 23, 24, 25, 26, 27, 3}},
+    {"Café naïve 123s", {2, 10, 11, 30, 31, 3}},
+    {"我Hello", {2, 28, 29, 3}},
+    {"«Crème»§1 ¶2·3", {2, 32, 8, 33, 34, 1, 35, 1, 36, 1, 3}},
+    {"Hello\u202FWorld\u1680hello\u205Fworld", {2, 29, 37, 29, 37, 3}},
+    {"hel\u200Blo\uFEFF w\u200Cor\u200Dld\u200E\u200F!", {2, 29, 37, 5, 3}},
+};
+}  // namespace
+
+int main() {
+  auto path = std::filesystem::temp_directory_path() / "wordpiece_vocab.txt";
+  {
+    std::ofstream file(path);
+    for (auto token : kVocab) {
+      file << token << '\n';
+    }
+  }
+  cortex_onnx::WordPieceTokenizer tokenizer;
+  if (!tokenizer.Load(path.string(), true)) {
+    std::fprintf(stderr, "failed to load %s\n", path.string().c_str());
+    return 1;
+  }
+  int failures = 0;
+  for (const auto& c : kCases) {
+    std::vector<int64_t> ids;
+    tokenizer.Encode(c.text, 512, ids);
+    if (ids != c.ids) {
+      std::fprintf(stderr, "mismatch for \"%s\":", c.text);
+      for (auto id : ids) {
+        std::fprintf(stderr, " %lld", static_cast<long long>(id));
+      }
+      std::fprintf(stderr, "\n");
+      failures++;
+    }
+  }
+  std::filesystem::remove(path);
+  return failures == 0 ? 0 : 1;
+}